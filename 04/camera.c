@@ -4,16 +4,68 @@
 #include "deps/linmath.h"
 
 #define MAX_VERT_ANGLE 85.0f
+/* The cached matrices that depend on the view or on the projection. */
+#define CAM_VIEW_DEPS (CAM_VIEW | CAM_INV_VIEW | CAM_VIEW_PROJ | CAM_INV_VIEW_PROJ)
+#define CAM_PROJ_DEPS (CAM_PROJ | CAM_INV_PROJ | CAM_VIEW_PROJ | CAM_INV_VIEW_PROJ)
 
 static void cam_norm_angles(struct camera *cam);
+static void cam_invalidate(struct camera *cam, unsigned int stale);
 static void print_mat4x4(mat4x4 mat);
 static void print_vec4(vec4 v);
 static void print_vec3(vec3 v);
 
-void cam_get_orientation(struct camera *cam, mat4x4 dest)
+void cam_set_fov(struct camera *cam, float fov)
 {
-	mat4x4_rotate_X(dest, dest, RADIANS(cam->vert_angle));
-	mat4x4_rotate_Y(dest, dest, RADIANS(cam->horiz_angle));
+	cam->fov = fov;
+	cam_invalidate(cam, CAM_PROJ_DEPS);
+}
+
+void cam_set_aspect_ratio(struct camera *cam, float aspect_ratio)
+{
+	cam->vp_aspect_ratio = aspect_ratio;
+	cam_invalidate(cam, CAM_PROJ_DEPS);
+}
+
+void cam_set_planes(struct camera *cam, float near_plane, float far_plane)
+{
+	cam->near_plane = near_plane;
+	cam->far_plane = far_plane;
+	cam_invalidate(cam, CAM_PROJ_DEPS);
+}
+
+/* Call after setting horiz_angle, vert_angle or pos directly. */
+void cam_update_orientation(struct camera *cam)
+{
+	quat pitch, yaw;
+	mat3x4 rotation;
+	int i;
+
+	/* The rotations of mat3x4_rotate_X and mat3x4_rotate_Y, the latter turns clockwise. */
+	quat_rotate(pitch, RADIANS(cam->vert_angle), (vec3){1, 0, 0});
+	quat_rotate(yaw, RADIANS(cam->horiz_angle), (vec3){0, -1, 0});
+	quat_mul(cam->orientation, pitch, yaw);
+
+	/* The rows of the rotation are the camera's axes. */
+	mat3x4_from_quat(rotation, cam->orientation);
+	for (i = 0; i < 3; i++) {
+		cam->right[i] = rotation[i][0];
+		cam->up[i] = rotation[i][1];
+		cam->forward[i] = -rotation[i][2];
+	}
+
+	cam_invalidate(cam, CAM_VIEW_DEPS);
+}
+
+void cam_get_orientation(struct camera *cam, mat3x4 dest)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		dest[i][0] = cam->right[i];
+		dest[i][1] = cam->up[i];
+		dest[i][2] = -cam->forward[i];
+		dest[3][i] = 0.0f;
+	}
 }
 
 void cam_offset_orientation(struct camera *cam, float right, float down)
@@ -21,6 +73,7 @@ void cam_offset_orientation(struct camera *cam, float right, float down)
 	cam->horiz_angle += right;
 	cam->vert_angle += down;
 	cam_norm_angles(cam);
+	cam_update_orientation(cam);
 }
 
 void cam_look_at(struct camera *cam, vec3 pos)
@@ -33,71 +86,118 @@ void cam_look_at(struct camera *cam, vec3 pos)
 	cam->vert_angle = RADIANS(asinf(-direction[1]));
 	cam->horiz_angle = -RADIANS(atan2f(-direction[0], -direction[2]));
 	cam_norm_angles(cam);
+	cam_update_orientation(cam);
 }
 
 void cam_move(struct camera *cam, const int d, float distance)
 {
-	vec4 dir, displacement;
-	mat4x4 orientation;
-
-	mat4x4_identity(orientation);
+	float *axis = d == LEFT || d == RIGHT ? cam->right :
+			d == UP || d == DOWN ? cam->up : cam->forward;
+	vec3 displacement;
 
-	cam_get_orientation(cam, orientation);
-	mat4x4_invert(orientation, orientation);
+	if (d == LEFT || d == DOWN || d == BACKWARD)
+		distance = -distance;
 
-	/* Calculate the direction as a unit vector inline
-	 *
-	 * XXX: mat4x4_mul_vec4(x, m, x) doesn't work...
-	 */
-	mat4x4_mul_vec4(dir, orientation, (vec4){
-			d == LEFT || d == RIGHT ? 1 : 0,
-			d == UP || d == DOWN ? 1 : 0,
-			d == FORWARD || d == BACKWARD ? 1 : 0,
-			1});
-
-	if (d == LEFT || d == DOWN || d == FORWARD)
-		vec4_scale(dir, dir, -1);
+	/* Displace the old position by axis * distance */
+	vec3_scale(displacement, axis, distance);
+	vec3_add(cam->pos, cam->pos, displacement);
+	cam_invalidate(cam, CAM_VIEW_DEPS);
+}
 
-	/* displacement = dir * distance */
-	vec4_scale(displacement, dir, distance);
+void cam_get_view(struct camera *cam, mat3x4 dest)
+{
+	cam_view(cam);
+	mat3x4_dup(dest, cam->view);
+}
 
-	/* Displace the old position */
-	vec3_add(cam->pos, cam->pos, (vec3){displacement[0],
-					displacement[1],
-					displacement[2]});
+void cam_get_projection(struct camera *cam, mat4x4 dest)
+{
+	cam_projection(cam);
+	mat4x4_dup(dest, cam->proj);
 }
 
-void cam_get_view(struct camera *cam, mat4x4 dest)
+void cam_get_matrix(struct camera *cam, mat4x4 dest)
 {
-	mat4x4 trans, orientation;
+	cam_view_proj(cam);
+	mat4x4_dup(dest, cam->view_proj);
+}
 
-	mat4x4_identity(trans);
-	mat4x4_identity(orientation);
+/*
+ * The accessors below return the cached matrix, recomputing it only if the
+ * camera changed since. The pointer stays valid as long as the camera.
+ */
+const vec3 *cam_view(struct camera *cam)
+{
+	if (!(cam->valid & CAM_VIEW)) {
+		cam_get_orientation(cam, cam->view);
+		mat3x4_translate_in_place(cam->view, cam->pos[0] * -1,
+				cam->pos[1] * -1, cam->pos[2] * -1);
+		cam->valid |= CAM_VIEW;
+	}
+
+	return (const vec3 *) cam->view;
+}
 
-	cam_get_orientation(cam, orientation);
-	mat4x4_translate(trans, cam->pos[0] * -1,
-			cam->pos[1] * -1, cam->pos[2] * -1);
+const vec3 *cam_inv_view(struct camera *cam)
+{
+	if (!(cam->valid & CAM_INV_VIEW)) {
+		cam_view(cam);
+		mat3x4_invert_rigid(cam->inv_view, cam->view);
+		cam->valid |= CAM_INV_VIEW;
+	}
 
-	mat4x4_mul(dest, orientation, trans);
+	return (const vec3 *) cam->inv_view;
 }
 
-void cam_get_projection(struct camera *cam, mat4x4 dest)
+const vec4 *cam_projection(struct camera *cam)
 {
-	mat4x4_perspective(dest, RADIANS(cam->fov), cam->vp_aspect_ratio,
-			cam->near_plane, cam->far_plane);
+	if (!(cam->valid & CAM_PROJ)) {
+		mat4x4_perspective(cam->proj, RADIANS(cam->fov),
+				cam->vp_aspect_ratio, cam->near_plane,
+				cam->far_plane);
+		cam->valid |= CAM_PROJ;
+	}
+
+	return (const vec4 *) cam->proj;
 }
 
-void cam_get_matrix(struct camera *cam, mat4x4 dest)
+const vec4 *cam_inv_projection(struct camera *cam)
 {
-	mat4x4 proj, view;
+	if (!(cam->valid & CAM_INV_PROJ)) {
+		cam_projection(cam);
+		mat4x4_invert(cam->inv_proj, cam->proj);
+		cam->valid |= CAM_INV_PROJ;
+	}
 
-	mat4x4_identity(proj);
-	mat4x4_identity(view);
+	return (const vec4 *) cam->inv_proj;
+}
 
-	cam_get_projection(cam, proj);
-	cam_get_view(cam, view);
+const vec4 *cam_view_proj(struct camera *cam)
+{
+	if (!(cam->valid & CAM_VIEW_PROJ)) {
+		cam_projection(cam);
+		cam_view(cam);
+		mat4x4_mul_mat3x4(cam->view_proj, cam->proj, cam->view);
+		cam->valid |= CAM_VIEW_PROJ;
+	}
+
+	return (const vec4 *) cam->view_proj;
+}
 
-	mat4x4_mul(dest, proj, view);
+const vec4 *cam_inv_view_proj(struct camera *cam)
+{
+	mat4x4 inv_view;
+
+	if (!(cam->valid & CAM_INV_VIEW_PROJ)) {
+		/* (proj * view)^-1 = view^-1 * proj^-1, and view^-1 is a transpose. */
+		cam_inv_projection(cam);
+		cam_inv_view(cam);
+		mat4x4_from_mat3x4(inv_view, cam->inv_view);
+		mat4x4_mul(cam->inv_view_proj, inv_view, cam->inv_proj);
+		cam->valid |= CAM_INV_VIEW_PROJ;
+	}
+
+	return (const vec4 *) cam->inv_view_proj;
 }
 
 static void cam_norm_angles(struct camera *cam)
@@ -113,6 +213,12 @@ static void cam_norm_angles(struct camera *cam)
 		cam->vert_angle = -MAX_VERT_ANGLE;
 }
 
+static void cam_invalidate(struct camera *cam, unsigned int stale)
+{
+	cam->valid &= ~stale;
+	cam->generation++;
+}
+
 static void print_mat4x4(mat4x4 m)
 {
 	int r;
@@ -13,21 +13,64 @@
 
 enum direction { LEFT, RIGHT, UP, DOWN, FORWARD, BACKWARD };
 
+/* Bits of camera.valid. */
+#define CAM_VIEW (1 << 0)
+#define CAM_INV_VIEW (1 << 1)
+#define CAM_PROJ (1 << 2)
+#define CAM_INV_PROJ (1 << 3)
+#define CAM_VIEW_PROJ (1 << 4)
+#define CAM_INV_VIEW_PROJ (1 << 5)
+
 struct camera {
 	vec3 pos;
 	float horiz_angle;
 	float vert_angle;
+	/* Change these with cam_set_fov, cam_set_aspect_ratio and cam_set_planes. */
 	float fov;
 	float near_plane;
 	float far_plane;
 	float vp_aspect_ratio;
+
+	/*
+	 * Derived from the angles by cam_update_orientation: the rotation from
+	 * world to camera space and the camera's axes in world space.
+	 */
+	quat orientation;
+	vec3 right;
+	vec3 up;
+	vec3 forward;
+
+	/*
+	 * Incremented whenever the view or the projection changes, so users of
+	 * the matrices can tell whether theirs are still current.
+	 */
+	unsigned long generation;
+
+	/* Computed on demand, CAM_* bits are set in valid for those up to date. */
+	unsigned int valid;
+	mat3x4 view;
+	mat3x4 inv_view;
+	mat4x4 proj;
+	mat4x4 inv_proj;
+	mat4x4 view_proj;
+	mat4x4 inv_view_proj;
 };
 
-void cam_get_orientation(struct camera *cam, mat4x4 dest);
+void cam_set_fov(struct camera *cam, float fov);
+void cam_set_aspect_ratio(struct camera *cam, float aspect_ratio);
+void cam_set_planes(struct camera *cam, float near_plane, float far_plane);
+void cam_update_orientation(struct camera *cam);
+void cam_get_orientation(struct camera *cam, mat3x4 dest);
 void cam_offset_orientation(struct camera *cam, float up, float right);
 void cam_look_at(struct camera *cam, vec3 pos);
 void cam_move(struct camera *cam, const int d, float distance);
-void cam_get_view(struct camera *cam, mat4x4 dest);
+void cam_get_view(struct camera *cam, mat3x4 dest);
 void cam_get_projection(struct camera *cam, mat4x4 dest);
 void cam_get_matrix(struct camera *cam, mat4x4 dest);
+const vec3 *cam_view(struct camera *cam);
+const vec3 *cam_inv_view(struct camera *cam);
+const vec4 *cam_projection(struct camera *cam);
+const vec4 *cam_inv_projection(struct camera *cam);
+const vec4 *cam_view_proj(struct camera *cam);
+const vec4 *cam_inv_view_proj(struct camera *cam);
 #endif
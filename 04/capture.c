@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "capture.h"
+#include "deps/lodepng.h"
+
+/* The captures are for comparing and reporting, speed matters more than size. */
+#define CAPTURE_PNG_LEVEL 1
+#define CAPTURE_PATH_LEN 512
+/* How long capture_destroy waits for each readback still in flight, in nanoseconds. */
+#define CAPTURE_DRAIN_TIMEOUT 1000000000ull
+
+static void *encode_frames(void *arg);
+static void collect_readbacks(struct capture *cap, bool wait);
+static void queue_readback(struct capture *cap, int slot);
+static size_t frame_size(struct capture *cap);
+
+bool capture_init(struct capture *cap, unsigned int width, unsigned int height,
+		const char *prefix)
+{
+	int i;
+
+	memset(cap, 0, sizeof(*cap));
+	cap->width = width;
+	cap->height = height;
+	cap->prefix = prefix;
+
+	if (!GLEW_VERSION_2_1 && !GLEW_ARB_pixel_buffer_object) {
+		fprintf(stderr, "Capture needs pixel buffer objects\n");
+		return false;
+	}
+	/* Without fences a readback is mapped once the ring is full, which may wait a little. */
+	cap->use_fences = GLEW_VERSION_3_2 || GLEW_ARB_sync;
+
+	for (i = 0; i < CAPTURE_FRAMES; i++) {
+		cap->frames[i].pixels = malloc(frame_size(cap));
+		if (!cap->frames[i].pixels) {
+			while (i--)
+				free(cap->frames[i].pixels);
+			return false;
+		}
+	}
+
+	glGenBuffers(CAPTURE_RING_LEN, cap->pbos);
+	for (i = 0; i < CAPTURE_RING_LEN; i++) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, cap->pbos[i]);
+		glBufferData(GL_PIXEL_PACK_BUFFER, frame_size(cap), NULL, GL_STREAM_READ);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	pthread_mutex_init(&cap->lock, NULL);
+	pthread_cond_init(&cap->cond, NULL);
+	if (pthread_create(&cap->thread, NULL, encode_frames, cap)) {
+		fprintf(stderr, "Failed to start the capture encoder\n");
+		pthread_cond_destroy(&cap->cond);
+		pthread_mutex_destroy(&cap->lock);
+		glDeleteBuffers(CAPTURE_RING_LEN, cap->pbos);
+		for (i = 0; i < CAPTURE_FRAMES; i++)
+			free(cap->frames[i].pixels);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Starts reading back the frame that was just rendered, call it before the buffers
+ * are swapped. Never waits for the GPU or the encoder: if every pixel pack buffer
+ * is still in flight, or the encoder is behind, the frame is dropped.
+ */
+void capture_frame(struct capture *cap)
+{
+	int slot;
+
+	collect_readbacks(cap, false);
+
+	if (cap->ring_count == CAPTURE_RING_LEN) {
+		cap->next_frame++;
+		cap->dropped++;
+		return;
+	}
+
+	slot = (cap->ring_head + cap->ring_count) % CAPTURE_RING_LEN;
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, cap->pbos[slot]);
+	glReadPixels(0, 0, cap->width, cap->height, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	if (cap->use_fences)
+		cap->fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	cap->numbers[slot] = cap->next_frame++;
+	cap->ring_count++;
+}
+
+/* Saves what is still in flight or queued, then stops the encoder. */
+void capture_destroy(struct capture *cap)
+{
+	int i;
+
+	collect_readbacks(cap, true);
+
+	pthread_mutex_lock(&cap->lock);
+	cap->stop = true;
+	pthread_cond_signal(&cap->cond);
+	pthread_mutex_unlock(&cap->lock);
+	pthread_join(cap->thread, NULL);
+
+	pthread_cond_destroy(&cap->cond);
+	pthread_mutex_destroy(&cap->lock);
+	glDeleteBuffers(CAPTURE_RING_LEN, cap->pbos);
+	for (i = 0; i < CAPTURE_FRAMES; i++)
+		free(cap->frames[i].pixels);
+
+	printf("Captured %lu frames, dropped %lu\n", cap->saved, cap->dropped);
+}
+
+static size_t frame_size(struct capture *cap)
+{
+	return (size_t)cap->width * cap->height * 3;
+}
+
+/* Hands the finished readbacks, oldest first, to the encoder. */
+static void collect_readbacks(struct capture *cap, bool wait)
+{
+	while (cap->ring_count > 0) {
+		int slot = cap->ring_head;
+
+		if (cap->use_fences) {
+			GLenum status = glClientWaitSync(cap->fences[slot],
+					wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+					wait ? CAPTURE_DRAIN_TIMEOUT : 0);
+
+			if (status == GL_TIMEOUT_EXPIRED && !wait)
+				break;
+			glDeleteSync(cap->fences[slot]);
+			cap->fences[slot] = 0;
+		} else if (!wait && cap->ring_count < CAPTURE_RING_LEN) {
+			break;
+		}
+
+		queue_readback(cap, slot);
+		cap->ring_head = (cap->ring_head + 1) % CAPTURE_RING_LEN;
+		cap->ring_count--;
+	}
+}
+
+/* Copies a readback into a free frame, GL's bottom row first becomes the PNG's last row. */
+static void queue_readback(struct capture *cap, int slot)
+{
+	struct capture_frame *frame = NULL;
+	size_t stride = (size_t)cap->width * 3;
+	const unsigned char *pixels;
+	unsigned int y;
+	int i;
+
+	/* Only this thread makes free frames queued, so it can fill one without the lock. */
+	pthread_mutex_lock(&cap->lock);
+	for (i = 0; i < CAPTURE_FRAMES && !frame; i++)
+		if (cap->frames[i].state == CAPTURE_FREE)
+			frame = &cap->frames[i];
+	pthread_mutex_unlock(&cap->lock);
+
+	if (!frame) {
+		cap->dropped++;
+		return;
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, cap->pbos[slot]);
+	pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	if (pixels) {
+		for (y = 0; y < cap->height; y++)
+			memcpy(frame->pixels + y * stride,
+				pixels + (cap->height - y - 1) * stride, stride);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	if (!pixels) {
+		cap->dropped++;
+		return;
+	}
+
+	pthread_mutex_lock(&cap->lock);
+	frame->number = cap->numbers[slot];
+	frame->state = CAPTURE_QUEUED;
+	pthread_cond_signal(&cap->cond);
+	pthread_mutex_unlock(&cap->lock);
+}
+
+/* The encoder thread, saves the queued frames in order until stopped. */
+static void *encode_frames(void *arg)
+{
+	struct capture *cap = arg;
+	char path[CAPTURE_PATH_LEN];
+	LodePNGState state;
+
+	lodepng_state_init(&state);
+	state.info_raw.colortype = LCT_RGB;
+	state.info_raw.bitdepth = 8;
+	state.info_png.color.colortype = LCT_RGB;
+	state.info_png.color.bitdepth = 8;
+	state.encoder.auto_convert = 0;
+	state.encoder.zlibsettings.level = CAPTURE_PNG_LEVEL;
+
+	pthread_mutex_lock(&cap->lock);
+	for (;;) {
+		struct capture_frame *frame = NULL;
+		unsigned char *png = NULL;
+		size_t png_size = 0;
+		unsigned int err;
+		int i;
+
+		for (i = 0; i < CAPTURE_FRAMES; i++)
+			if (cap->frames[i].state == CAPTURE_QUEUED &&
+			    (!frame || cap->frames[i].number < frame->number))
+				frame = &cap->frames[i];
+		if (!frame) {
+			if (cap->stop)
+				break;
+			pthread_cond_wait(&cap->cond, &cap->lock);
+			continue;
+		}
+		frame->state = CAPTURE_ENCODING;
+		pthread_mutex_unlock(&cap->lock);
+
+		snprintf(path, sizeof(path), "%s%06lu.png", cap->prefix, frame->number);
+		err = lodepng_encode(&png, &png_size, frame->pixels, cap->width,
+				cap->height, &state);
+		if (!err)
+			err = lodepng_save_file(png, png_size, path);
+		if (err)
+			fprintf(stderr, "Failed to save %s: %s\n", path, lodepng_error_text(err));
+		free(png);
+
+		pthread_mutex_lock(&cap->lock);
+		if (!err)
+			cap->saved++;
+		frame->state = CAPTURE_FREE;
+	}
+	pthread_mutex_unlock(&cap->lock);
+
+	lodepng_state_cleanup(&state);
+
+	return NULL;
+}
@@ -0,0 +1,51 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <GL/glew.h>
+
+/* Pixel pack buffers in flight, a readback is mapped this many frames later at the latest. */
+#define CAPTURE_RING_LEN 3
+/* Frames waiting for the encoder, more are dropped instead of stalling render(). */
+#define CAPTURE_QUEUE_LEN 4
+/* The encoder works on one frame while the others wait. */
+#define CAPTURE_FRAMES (CAPTURE_QUEUE_LEN + 1)
+
+enum capture_state { CAPTURE_FREE, CAPTURE_QUEUED, CAPTURE_ENCODING };
+
+struct capture_frame {
+	unsigned char *pixels;
+	unsigned long number;
+	enum capture_state state;
+};
+
+struct capture {
+	unsigned int width;
+	unsigned int height;
+	const char *prefix;
+	unsigned long next_frame;
+	unsigned long saved;
+	unsigned long dropped;
+
+	/* Readbacks in flight, oldest at ring_head. */
+	GLuint pbos[CAPTURE_RING_LEN];
+	GLsync fences[CAPTURE_RING_LEN];
+	unsigned long numbers[CAPTURE_RING_LEN];
+	int ring_head;
+	int ring_count;
+	bool use_fences;
+
+	/* Frames shared with the encoder thread, guarded by lock. */
+	struct capture_frame frames[CAPTURE_FRAMES];
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stop;
+};
+
+bool capture_init(struct capture *cap, unsigned int width, unsigned int height,
+		const char *prefix);
+void capture_frame(struct capture *cap);
+void capture_destroy(struct capture *cap);
+#endif
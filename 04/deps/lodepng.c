@@ -37,6 +37,46 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 #include <fstream>
 #endif /*LODEPNG_COMPILE_CPP*/
 
+#ifdef LODEPNG_COMPILE_SIMD
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define LODEPNG_SIMD_X86
+/*the SIMD functions are compiled for their instruction set even if the rest isn't, and only called if the CPU has it*/
+#define LODEPNG_TARGET(isa) __attribute__((target(isa)))
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define LODEPNG_SIMD_X86
+#define LODEPNG_TARGET(isa)
+#include <intrin.h>
+#include <immintrin.h>
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__) && defined(__ARM_FEATURE_CRC32) \
+    && defined(__linux__)
+/*only the CRC32 instructions, which the compiler won't use unless asked to, so the
+rest of the program still runs on CPUs without them*/
+#define LODEPNG_SIMD_ARM
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1ul << 7)
+#endif /*HWCAP_CRC32*/
+#endif
+#endif /*LODEPNG_COMPILE_SIMD*/
+
+#if defined(LODEPNG_COMPILE_DISK) && (defined(__unix__) || defined(__APPLE__))
+/*files are memory mapped instead of read, elsewhere lodepng_map_file reads them*/
+#define LODEPNG_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif /*LODEPNG_COMPILE_DISK*/
+
+#if defined(LODEPNG_COMPILE_THREADS) && (defined(__unix__) || defined(__APPLE__))
+/*the threads are POSIX threads, elsewhere the thread settings are ignored*/
+#define LODEPNG_PTHREADS
+#include <pthread.h>
+#endif /*LODEPNG_COMPILE_THREADS*/
+
 #if defined(_MSC_VER) && (_MSC_VER >= 1310) /*Visual Studio: A few warning types are not desired here.*/
 #pragma warning( disable : 4244 ) /*implicit conversions: not warned by gcc -Wall -Wextra and requires too much casts*/
 #pragma warning( disable : 4996 ) /*VS does not like fopen, but fopen_s is not standard C so unusable here*/
@@ -124,6 +164,134 @@ Example: if(!uivector_resizev(&frequencies_ll, 286, 0)) ERROR_BREAK(83);
   return;\
 }
 
+/*
+LodePNGArena: each block starts with an ArenaBlock, followed by the memory given out.
+The newest block is the first in the list. Allocations are aligned to ARENA_ALIGN.
+*/
+typedef struct ArenaBlock
+{
+  struct ArenaBlock* next; /*the block before it*/
+  size_t size; /*bytes after the header*/
+} ArenaBlock;
+
+#define ARENA_ALIGN 16u
+#define ARENA_HEADER ((sizeof(ArenaBlock) + ARENA_ALIGN - 1u) / ARENA_ALIGN * ARENA_ALIGN)
+/*the size of the first block, later blocks double the capacity*/
+#define ARENA_MIN_BLOCK 65536u
+
+void lodepng_arena_init(LodePNGArena* arena)
+{
+  arena->blocks = 0;
+  arena->used = arena->capacity = 0;
+  arena->last = 0;
+  arena->allocations = arena->bytes = arena->blockallocations = 0;
+}
+
+void lodepng_arena_cleanup(LodePNGArena* arena)
+{
+  ArenaBlock* block = (ArenaBlock*)arena->blocks;
+  while(block)
+  {
+    ArenaBlock* next = block->next;
+    lodepng_free(block);
+    block = next;
+  }
+  lodepng_arena_init(arena);
+}
+
+void lodepng_arena_reset(LodePNGArena* arena)
+{
+  ArenaBlock* block = (ArenaBlock*)arena->blocks;
+  if(block && block->next)
+  {
+    /*one block of the total size, so that the same work fits in it next time*/
+    size_t capacity = arena->capacity;
+    lodepng_arena_cleanup(arena);
+    block = (ArenaBlock*)lodepng_malloc(ARENA_HEADER + capacity);
+    if(block)
+    {
+      block->next = 0;
+      block->size = capacity;
+      arena->blocks = block;
+      arena->capacity = capacity;
+    }
+  }
+  arena->used = 0;
+  arena->last = 0;
+  arena->allocations = arena->bytes = arena->blockallocations = 0;
+}
+
+/*lodepng_malloc if arena is null, else an allocation from the arena*/
+static void* arena_malloc(LodePNGArena* arena, size_t size)
+{
+  ArenaBlock* block;
+  unsigned char* result;
+  if(!arena) return lodepng_malloc(size);
+
+  if(size > (size_t)(-1) / 2) return 0;
+  size = (size + ARENA_ALIGN - 1u) & ~(size_t)(ARENA_ALIGN - 1u);
+  block = (ArenaBlock*)arena->blocks;
+  if(!block || size > block->size - arena->used)
+  {
+    size_t blocksize = arena->capacity > size ? arena->capacity : size;
+    if(blocksize < ARENA_MIN_BLOCK) blocksize = ARENA_MIN_BLOCK;
+    if(blocksize > (size_t)(-1) - ARENA_HEADER) return 0;
+    block = (ArenaBlock*)lodepng_malloc(ARENA_HEADER + blocksize);
+    if(!block) return 0;
+    block->next = (ArenaBlock*)arena->blocks;
+    block->size = blocksize;
+    arena->blocks = block;
+    arena->used = 0;
+    arena->capacity += blocksize;
+    ++arena->blockallocations;
+  }
+  result = (unsigned char*)block + ARENA_HEADER + arena->used;
+  arena->used += size;
+  arena->last = result;
+  ++arena->allocations;
+  arena->bytes += size;
+  return result;
+}
+
+/*
+lodepng_realloc if arena is null. Else the last allocation is resized in place if it
+fits, others are copied to a new allocation. oldsize is the size of ptr.
+*/
+static void* arena_realloc(LodePNGArena* arena, void* ptr, size_t oldsize, size_t size)
+{
+  void* result;
+  if(!arena) return lodepng_realloc(ptr, size);
+
+  if(ptr && ptr == arena->last)
+  {
+    ArenaBlock* block = (ArenaBlock*)arena->blocks;
+    size_t start = (size_t)((unsigned char*)ptr - ((unsigned char*)block + ARENA_HEADER));
+    if(size <= block->size - start)
+    {
+      size_t end = start + ((size + ARENA_ALIGN - 1u) & ~(size_t)(ARENA_ALIGN - 1u));
+      if(end > block->size) end = block->size;
+      ++arena->allocations;
+      if(end > arena->used) arena->bytes += end - arena->used;
+      arena->used = end;
+      return ptr;
+    }
+  }
+  result = arena_malloc(arena, size);
+  if(result && ptr) memcpy(result, ptr, oldsize < size ? oldsize : size);
+  return result;
+}
+
+/*lodepng_free if arena is null. Else only the last allocation is given back, the rest at the reset.*/
+static void arena_free(LodePNGArena* arena, void* ptr)
+{
+  if(!arena) lodepng_free(ptr);
+  else if(ptr && ptr == arena->last)
+  {
+    arena->used = (size_t)((unsigned char*)ptr - ((unsigned char*)arena->blocks + ARENA_HEADER));
+    arena->last = 0;
+  }
+}
+
 /*
 About uivector, ucvector and string:
 -All of them wrap dynamic arrays or text strings in a similar way.
@@ -133,19 +301,20 @@ About uivector, ucvector and string:
 -As with many other structs in this file, the init and cleanup functions serve as ctor and dtor.
 */
 
-#ifdef LODEPNG_COMPILE_ZLIB
+#if defined(LODEPNG_COMPILE_ZLIB) && defined(LODEPNG_COMPILE_ENCODER)
 /*dynamic vector of unsigned ints*/
 typedef struct uivector
 {
   unsigned* data;
   size_t size; /*size in number of unsigned longs*/
   size_t allocsize; /*allocated size in bytes*/
+  LodePNGArena* arena; /*where data is allocated, null for lodepng_malloc*/
 } uivector;
 
 static void uivector_cleanup(void* p)
 {
   ((uivector*)p)->size = ((uivector*)p)->allocsize = 0;
-  lodepng_free(((uivector*)p)->data);
+  arena_free(((uivector*)p)->arena, ((uivector*)p)->data);
   ((uivector*)p)->data = NULL;
 }
 
@@ -155,7 +324,7 @@ static unsigned uivector_reserve(uivector* p, size_t allocsize)
   if(allocsize > p->allocsize)
   {
     size_t newsize = (allocsize > p->allocsize * 2) ? allocsize : (allocsize * 3 / 2);
-    void* data = lodepng_realloc(p->data, newsize);
+    void* data = arena_realloc(p->arena, p->data, p->allocsize, newsize);
     if(data)
     {
       p->allocsize = newsize;
@@ -187,9 +356,9 @@ static void uivector_init(uivector* p)
 {
   p->data = NULL;
   p->size = p->allocsize = 0;
+  p->arena = 0;
 }
 
-#ifdef LODEPNG_COMPILE_ENCODER
 /*returns 1 if success, 0 if failure ==> nothing done*/
 static unsigned uivector_push_back(uivector* p, unsigned c)
 {
@@ -197,17 +366,7 @@ static unsigned uivector_push_back(uivector* p, unsigned c)
   p->data[p->size - 1] = c;
   return 1;
 }
-
-/*copy q to p, returns 1 if success, 0 if failure ==> nothing done*/
-static unsigned uivector_copy(uivector* p, const uivector* q)
-{
-  size_t i;
-  if(!uivector_resize(p, q->size)) return 0;
-  for(i = 0; i != q->size; ++i) p->data[i] = q->data[i];
-  return 1;
-}
-#endif /*LODEPNG_COMPILE_ENCODER*/
-#endif /*LODEPNG_COMPILE_ZLIB*/
+#endif /*defined(LODEPNG_COMPILE_ZLIB) && defined(LODEPNG_COMPILE_ENCODER)*/
 
 /* /////////////////////////////////////////////////////////////////////////// */
 
@@ -217,6 +376,7 @@ typedef struct ucvector
   unsigned char* data;
   size_t size; /*used size*/
   size_t allocsize; /*allocated size*/
+  LodePNGArena* arena; /*where data is allocated, null for lodepng_malloc*/
 } ucvector;
 
 /*returns 1 if success, 0 if failure ==> nothing done*/
@@ -225,7 +385,7 @@ static unsigned ucvector_reserve(ucvector* p, size_t allocsize)
   if(allocsize > p->allocsize)
   {
     size_t newsize = (allocsize > p->allocsize * 2) ? allocsize : (allocsize * 3 / 2);
-    void* data = lodepng_realloc(p->data, newsize);
+    void* data = arena_realloc(p->arena, p->data, p->allocsize, newsize);
     if(data)
     {
       p->allocsize = newsize;
@@ -249,7 +409,7 @@ static unsigned ucvector_resize(ucvector* p, size_t size)
 static void ucvector_cleanup(void* p)
 {
   ((ucvector*)p)->size = ((ucvector*)p)->allocsize = 0;
-  lodepng_free(((ucvector*)p)->data);
+  arena_free(((ucvector*)p)->arena, ((ucvector*)p)->data);
   ((ucvector*)p)->data = NULL;
 }
 
@@ -257,6 +417,7 @@ static void ucvector_init(ucvector* p)
 {
   p->data = NULL;
   p->size = p->allocsize = 0;
+  p->arena = 0;
 }
 
 #ifdef LODEPNG_COMPILE_DECODER
@@ -278,9 +439,58 @@ static void ucvector_init_buffer(ucvector* p, unsigned char* buffer, size_t size
 {
   p->data = buffer;
   p->allocsize = p->size = size;
+  p->arena = 0;
 }
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
+#ifdef LODEPNG_COMPILE_DECODER
+/*total size of the data of the spans*/
+static size_t spansSize(const LodePNGSpan* spans, size_t numspans)
+{
+  size_t i, size = 0;
+  for(i = 0; i != numspans; ++i) size += spans[i].size;
+  return size;
+}
+
+/*copies size bytes starting at position pos of the data of the spans, which must have them*/
+static void spansCopy(unsigned char* out, const LodePNGSpan* spans, size_t pos, size_t size)
+{
+  for(; size != 0; ++spans)
+  {
+    size_t amount;
+    if(pos >= spans->size)
+    {
+      pos -= spans->size;
+      continue;
+    }
+    amount = spans->size - pos < size ? spans->size - pos : size;
+    memcpy(out, &spans->data[pos], amount);
+    out += amount;
+    size -= amount;
+    pos = 0;
+  }
+}
+
+/*
+gives the data of the spans in one piece: the data of the span itself if there is only
+one, else a copy in buffer. Return value is error.
+*/
+static unsigned spansJoin(const unsigned char** out, ucvector* buffer,
+                          const LodePNGSpan* spans, size_t numspans)
+{
+  size_t size = spansSize(spans, numspans);
+  if(numspans == 1)
+  {
+    *out = spans[0].data;
+    return 0;
+  }
+  if(!ucvector_resize(buffer, size)) return 83; /*alloc fail*/
+  spansCopy(buffer->data, spans, 0, size);
+  *out = buffer->data;
+  return 0;
+}
+#endif /*LODEPNG_COMPILE_DECODER*/
+
 #if (defined(LODEPNG_COMPILE_PNG) && defined(LODEPNG_COMPILE_ANCILLARY_CHUNKS)) || defined(LODEPNG_COMPILE_ENCODER)
 /*returns 1 if success, 0 if failure ==> nothing done*/
 static unsigned ucvector_push_back(ucvector* p, unsigned char c)
@@ -395,6 +605,50 @@ unsigned lodepng_load_file(unsigned char** out, size_t* outsize, const char* fil
   return 0;
 }
 
+unsigned lodepng_map_file(const unsigned char** out, size_t* outsize, const char* filename)
+{
+#ifdef LODEPNG_MMAP
+  int fd;
+  struct stat st;
+  void* data;
+
+  *out = 0;
+  *outsize = 0;
+
+  fd = open(filename, O_RDONLY);
+  if(fd < 0) return 78;
+  /*only regular files have a size that can be mapped, which must fit in memory*/
+  if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (off_t)(size_t)st.st_size != st.st_size)
+  {
+    close(fd);
+    return 78;
+  }
+  if(st.st_size == 0)
+  {
+    close(fd);
+    return 0;
+  }
+  data = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); /*the mapping stays after the file is closed*/
+  if(data == MAP_FAILED) return 78;
+  *out = (const unsigned char*)data;
+  *outsize = (size_t)st.st_size;
+  return 0;
+#else /*LODEPNG_MMAP*/
+  return lodepng_load_file((unsigned char**)out, outsize, filename);
+#endif /*LODEPNG_MMAP*/
+}
+
+void lodepng_unmap_file(const unsigned char* buffer, size_t buffersize)
+{
+#ifdef LODEPNG_MMAP
+  if(buffersize != 0) munmap((void*)buffer, buffersize);
+#else /*LODEPNG_MMAP*/
+  (void)buffersize;
+  lodepng_free((void*)buffer);
+#endif /*LODEPNG_MMAP*/
+}
+
 /*write given buffer to the file, overwriting the file, it doesn't append to it.*/
 unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const char* filename)
 {
@@ -408,6 +662,120 @@ unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const
 
 #endif /*LODEPNG_COMPILE_DISK*/
 
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / CPU features                                                           / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+#if (defined(LODEPNG_SIMD_X86) || defined(LODEPNG_SIMD_ARM)) && (defined(LODEPNG_COMPILE_PNG) || defined(LODEPNG_COMPILE_ZLIB))
+
+#define CPU_SSE2 1u
+#define CPU_SSSE3 2u
+#define CPU_AVX2 4u
+#define CPU_PCLMUL 8u
+#define CPU_CRC32 16u /*ARMv8 CRC32 instructions*/
+#define CPU_DETECTED 0x80000000u /*set in the cached flags once they're known*/
+
+#ifdef LODEPNG_SIMD_ARM
+static unsigned detectCpuFeatures(void)
+{
+  return (getauxval(AT_HWCAP) & HWCAP_CRC32 ? CPU_CRC32 : 0) | CPU_DETECTED;
+}
+#else /*LODEPNG_SIMD_ARM*/
+static void cpuid(unsigned regs[4], unsigned leaf)
+{
+#ifdef _MSC_VER
+  int r[4];
+  __cpuidex(r, (int)leaf, 0);
+  regs[0] = (unsigned)r[0]; regs[1] = (unsigned)r[1]; regs[2] = (unsigned)r[2]; regs[3] = (unsigned)r[3];
+#else /*_MSC_VER*/
+  regs[0] = regs[1] = regs[2] = regs[3] = 0;
+  __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif /*_MSC_VER*/
+}
+
+/*the register state the OS saves on context switches (XCR0)*/
+static unsigned xgetbv0(void)
+{
+#ifdef _MSC_VER
+  return (unsigned)_xgetbv(0);
+#else /*_MSC_VER*/
+  unsigned eax, edx;
+  __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  return eax;
+#endif /*_MSC_VER*/
+}
+
+static unsigned detectCpuFeatures(void)
+{
+  unsigned regs[4];
+  unsigned result = 0;
+  cpuid(regs, 0);
+  if(regs[0] < 1) return 0;
+  {
+    unsigned maxleaf = regs[0];
+    cpuid(regs, 1);
+    if(regs[3] & (1u << 26)) result |= CPU_SSE2;
+    if(regs[2] & (1u << 9)) result |= CPU_SSSE3;
+    if(regs[2] & (1u << 1)) result |= CPU_PCLMUL;
+    /*AVX2 also needs the OS to save the YMM registers (OSXSAVE and XCR0 bits 1 and 2)*/
+    if(maxleaf >= 7 && (regs[2] & (1u << 27)) && (xgetbv0() & 6u) == 6u)
+    {
+      cpuid(regs, 7);
+      if(regs[1] & (1u << 5)) result |= CPU_AVX2;
+    }
+  }
+  return result | CPU_DETECTED;
+}
+#endif /*LODEPNG_SIMD_ARM*/
+
+/*
+returns the CPU_ flags of the instruction sets that can be used. cpuid takes microseconds
+in virtual machines, too slow for every checksum of a small chunk, so the flags are
+detected on the first call only.
+*/
+#ifdef LODEPNG_PTHREADS
+static pthread_once_t cpu_features_once = PTHREAD_ONCE_INIT;
+static unsigned cpu_features;
+
+static void initCpuFeatures(void)
+{
+  cpu_features = detectCpuFeatures();
+}
+
+static unsigned getCpuFeatures(void)
+{
+  pthread_once(&cpu_features_once, initCpuFeatures);
+  return cpu_features;
+}
+#else /*LODEPNG_PTHREADS*/
+static unsigned getCpuFeatures(void)
+{
+  /*threads calling this at the same time all store the same value*/
+  static unsigned cpu_features = 0;
+  if(!cpu_features) cpu_features = detectCpuFeatures();
+  return cpu_features;
+}
+#endif /*LODEPNG_PTHREADS*/
+
+#endif /*(defined(LODEPNG_SIMD_X86) || defined(LODEPNG_SIMD_ARM)) && (defined(LODEPNG_COMPILE_PNG) || defined(LODEPNG_COMPILE_ZLIB))*/
+
+#if defined(LODEPNG_SIMD_X86) && defined(LODEPNG_COMPILE_PNG) && defined(LODEPNG_COMPILE_DECODER)
+
+/*unaligned 4-byte load and store, memcpy with a constant size compiles to a single mov*/
+static unsigned load32(const unsigned char* p)
+{
+  unsigned v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static void store32(unsigned char* p, unsigned v)
+{
+  memcpy(p, &v, 4);
+}
+
+#endif /*defined(LODEPNG_SIMD_X86) && defined(LODEPNG_COMPILE_PNG) && defined(LODEPNG_COMPILE_DECODER)*/
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* ////////////////////////////////////////////////////////////////////////// */
 /* // End of common code and tools. Begin of Zlib related code.            // */
@@ -426,40 +794,140 @@ unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const
   ++(*bitpointer);\
 }
 
+/*writes up to a byte's worth of bits per step instead of one bit at a time*/
 static void addBitsToStream(size_t* bitpointer, ucvector* bitstream, unsigned value, size_t nbits)
 {
-  size_t i;
-  for(i = 0; i != nbits; ++i) addBitToStream(bitpointer, bitstream, (unsigned char)((value >> i) & 1));
+  while(nbits)
+  {
+    size_t shift = (*bitpointer) & 7;
+    size_t n = 8 - shift < nbits ? 8 - shift : nbits;
+    if(shift == 0) ucvector_push_back(bitstream, (unsigned char)0);
+    bitstream->data[bitstream->size - 1] |= (unsigned char)((value & ((1u << n) - 1u)) << shift);
+    value >>= n;
+    nbits -= n;
+    *bitpointer += n;
+  }
 }
 
 static void addBitsToStreamReversed(size_t* bitpointer, ucvector* bitstream, unsigned value, size_t nbits)
 {
   size_t i;
-  for(i = 0; i != nbits; ++i) addBitToStream(bitpointer, bitstream, (unsigned char)((value >> (nbits - 1 - i)) & 1));
+  unsigned reversed = 0;
+  for(i = 0; i != nbits; ++i) reversed |= ((value >> (nbits - 1 - i)) & 1u) << i;
+  addBitsToStream(bitpointer, bitstream, reversed, nbits);
 }
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-#define READBIT(bitpointer, bitstream) ((bitstream[bitpointer >> 3] >> (bitpointer & 0x7)) & (unsigned char)1)
+/*
+Bit reader for the inflator. Instead of fetching the input one bit at a time,
+it keeps a buffer of upcoming bits in a size_t (64 bits on 64-bit platforms),
+so that the Huffman decoder can look at many bits at once with a table lookup.
+The first bit of the stream is the lsb of the buffer. When the end of the input
+is reached zero bits are shifted in, BitReader_overrun tells if any of those
+were consumed.
+*/
+typedef struct BitReader
+{
+  const unsigned char* data;
+  size_t size; /*size of data in bytes*/
+  size_t pos; /*position of the next byte of data to go into the buffer*/
+  size_t buffer; /*the upcoming bits*/
+  unsigned bitcount; /*amount of valid bits in buffer*/
+} BitReader;
+
+#define BITREADER_BUFFERBITS (sizeof(size_t) * 8)
 
-static unsigned char readBitFromStream(size_t* bitpointer, const unsigned char* bitstream)
+static void BitReader_init(BitReader* reader, const unsigned char* data, size_t size)
 {
-  unsigned char result = (unsigned char)(READBIT(*bitpointer, bitstream));
-  ++(*bitpointer);
-  return result;
+  reader->data = data;
+  reader->size = size;
+  reader->pos = 0;
+  reader->buffer = 0;
+  reader->bitcount = 0;
 }
 
-static unsigned readBitsFromStream(size_t* bitpointer, const unsigned char* bitstream, size_t nbits)
+/*tops up the buffer so that it contains at least BITREADER_BUFFERBITS - 7 bits (57 on 64-bit platforms)*/
+static void BitReader_fill(BitReader* reader)
 {
-  unsigned result = 0, i;
-  for(i = 0; i != nbits; ++i)
+  if(reader->pos + sizeof(size_t) <= reader->size)
+  {
+    const unsigned char* data = &reader->data[reader->pos];
+    while(reader->bitcount <= BITREADER_BUFFERBITS - 8)
+    {
+      reader->buffer |= (size_t)(*data++) << reader->bitcount;
+      reader->bitcount += 8;
+      ++reader->pos;
+    }
+  }
+  else
   {
-    result += ((unsigned)READBIT(*bitpointer, bitstream)) << i;
-    ++(*bitpointer);
+    while(reader->bitcount <= BITREADER_BUFFERBITS - 8)
+    {
+      size_t byte = reader->pos < reader->size ? reader->data[reader->pos] : 0;
+      reader->buffer |= byte << reader->bitcount;
+      reader->bitcount += 8;
+      ++reader->pos;
+    }
   }
+}
+
+/*returns the next nbits bits without consuming them. nbits must be at most the amount in the buffer*/
+static unsigned BitReader_peek(const BitReader* reader, unsigned nbits)
+{
+  return (unsigned)(reader->buffer & (((size_t)1 << nbits) - 1u));
+}
+
+static void BitReader_skip(BitReader* reader, unsigned nbits)
+{
+  reader->buffer >>= nbits;
+  reader->bitcount -= nbits;
+}
+
+/*reads nbits bits, at most 24, the first one in the lsb of the result*/
+static unsigned BitReader_read(BitReader* reader, unsigned nbits)
+{
+  unsigned result;
+  if(reader->bitcount < nbits) BitReader_fill(reader);
+  result = BitReader_peek(reader, nbits);
+  BitReader_skip(reader, nbits);
   return result;
 }
+
+/*amount of bits consumed so far*/
+static size_t BitReader_bitpos(const BitReader* reader)
+{
+  return reader->pos * 8 - reader->bitcount;
+}
+
+/*returns 1 if more bits were consumed than the input has*/
+static int BitReader_overrun(const BitReader* reader)
+{
+  return BitReader_bitpos(reader) > reader->size * 8;
+}
+
+/*moves the reader to the given bit position, used to go back to a point before the end of the input*/
+static void BitReader_seek(BitReader* reader, size_t bitpos)
+{
+  reader->pos = bitpos / 8;
+  reader->buffer = 0;
+  reader->bitcount = 0;
+  if(bitpos & 7u)
+  {
+    BitReader_fill(reader);
+    BitReader_skip(reader, (unsigned)(bitpos & 7u));
+  }
+}
+
+/*skips to the next byte boundary and empties the buffer, so that data can be read bytewise from pos*/
+static void BitReader_align(BitReader* reader)
+{
+  BitReader_skip(reader, reader->bitcount & 7u);
+  reader->pos -= reader->bitcount / 8;
+  reader->buffer = 0;
+  reader->bitcount = 0;
+}
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -507,11 +975,17 @@ Huffman tree struct, containing multiple representations of the tree
 */
 typedef struct HuffmanTree
 {
-  unsigned* tree2d;
   unsigned* tree1d;
   unsigned* lengths; /*the lengths of the codes of the 1d-tree*/
   unsigned maxbitlen; /*maximum number of bits a single code can get*/
   unsigned numcodes; /*number of symbols in the alphabet = number of codes*/
+  /*lookup table for decoding, see HuffmanTree_makeTable*/
+  unsigned char* table_len; /*length of the code, or of the longest code behind a subtable*/
+  unsigned short* table_value; /*the symbol, or the start of a subtable*/
+  /*allocated sizes, so that a tree that is made again reuses the arrays if they're big enough*/
+  unsigned capacity; /*of tree1d and lengths*/
+  size_t tablecapacity; /*of table_len and table_value*/
+  LodePNGArena* arena; /*where the arrays are allocated, null for lodepng_malloc*/
 } HuffmanTree;
 
 /*function used for debug purposes to draw the tree in ascii art with C++*/
@@ -529,74 +1003,156 @@ static void HuffmanTree_draw(HuffmanTree* tree)
 
 static void HuffmanTree_init(HuffmanTree* tree)
 {
-  tree->tree2d = 0;
   tree->tree1d = 0;
   tree->lengths = 0;
+  tree->table_len = 0;
+  tree->table_value = 0;
+  tree->capacity = 0;
+  tree->tablecapacity = 0;
+  tree->arena = 0;
+}
+
+/*makes room for numcodes codes in tree1d and lengths, without keeping their values. return value is error*/
+static unsigned HuffmanTree_reserve(HuffmanTree* tree, size_t numcodes)
+{
+  void* tree1d;
+  void* lengths;
+  if(numcodes <= tree->capacity) return 0;
+  tree1d = arena_realloc(tree->arena, tree->tree1d, 0, numcodes * sizeof(unsigned));
+  if(tree1d) tree->tree1d = (unsigned*)tree1d;
+  lengths = arena_realloc(tree->arena, tree->lengths, 0, numcodes * sizeof(unsigned));
+  if(lengths) tree->lengths = (unsigned*)lengths;
+  if(!tree1d || !lengths) return 83; /*alloc fail, the old arrays are still freed by the cleanup*/
+  tree->capacity = (unsigned)numcodes;
+  return 0;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree)
 {
-  lodepng_free(tree->tree2d);
-  lodepng_free(tree->tree1d);
-  lodepng_free(tree->lengths);
+  arena_free(tree->arena, tree->tree1d);
+  arena_free(tree->arena, tree->lengths);
+  arena_free(tree->arena, tree->table_len);
+  arena_free(tree->arena, tree->table_value);
+}
+
+/*amount of bits looked up at once in the primary decoding table*/
+#define FIRSTBITS 9u
+/*symbol value of table entries that no valid code leads to*/
+#define INVALIDSYMBOL 65535u
+/*table_len value of entries not filled in yet while making the table*/
+#define UNFILLED 255u
+
+/*reverses the order of the lowest numbits bits of bits*/
+static unsigned reverseBits(unsigned bits, unsigned numbits)
+{
+  unsigned i, result = 0;
+  for(i = 0; i != numbits; ++i) result |= ((bits >> (numbits - i - 1u)) & 1u) << i;
+  return result;
 }
 
-/*the tree representation used by the decoder. return value is error*/
-static unsigned HuffmanTree_make2DTree(HuffmanTree* tree)
+/*
+the lookup table representation used by the decoder. return value is error.
+The primary table is indexed by the next FIRSTBITS bits of the stream (first bit
+in the lsb, since deflate stores Huffman codes starting with their msb). Codes
+of at most FIRSTBITS bits are repeated over all entries that start with them.
+For longer codes, the entry of their first FIRSTBITS bits holds the length of
+the longest code with that prefix and the position of a subtable after the
+primary table, which is indexed by the remaining bits. Subtable entries store
+the code length minus FIRSTBITS. Entries that no code leads to are invalid, and
+an oversubscribed set of lengths gives error 55.
+*/
+static unsigned HuffmanTree_makeTable(HuffmanTree* tree)
 {
-  unsigned nodefilled = 0; /*up to which node it is filled*/
-  unsigned treepos = 0; /*position in the tree (1 of the numcodes columns)*/
-  unsigned n, i;
+  static const unsigned headsize = 1u << FIRSTBITS;
+  static const unsigned mask = (1u << FIRSTBITS) - 1u;
+  size_t i, size, pointer;
+  unsigned maxlens[1u << FIRSTBITS];
+
+  /*compute the size of the subtables, given by the longest code behind each primary entry*/
+  for(i = 0; i != headsize; ++i) maxlens[i] = 0;
+  for(i = 0; i != tree->numcodes; ++i)
+  {
+    unsigned l = tree->lengths[i];
+    unsigned index;
+    if(l <= FIRSTBITS) continue;
+    index = reverseBits(tree->tree1d[i] >> (l - FIRSTBITS), FIRSTBITS);
+    if(l > maxlens[index]) maxlens[index] = l;
+  }
+  size = headsize;
+  for(i = 0; i != headsize; ++i)
+  {
+    if(maxlens[i] > FIRSTBITS) size += (size_t)1u << (maxlens[i] - FIRSTBITS);
+  }
 
-  tree->tree2d = (unsigned*)lodepng_malloc(tree->numcodes * 2 * sizeof(unsigned));
-  if(!tree->tree2d) return 83; /*alloc fail*/
+  if(size > tree->tablecapacity)
+  {
+    /*with room for the subtables of most trees, so that the next trees of a stream fit*/
+    size_t capacity = size < 2 * headsize ? 2 * headsize : size;
+    void* table_len = arena_realloc(tree->arena, tree->table_len, 0, capacity * sizeof(*tree->table_len));
+    void* table_value;
+    if(table_len) tree->table_len = (unsigned char*)table_len;
+    table_value = arena_realloc(tree->arena, tree->table_value, 0, capacity * sizeof(*tree->table_value));
+    if(table_value) tree->table_value = (unsigned short*)table_value;
+    if(!table_len || !table_value) return 83; /*alloc fail*/
+    tree->tablecapacity = capacity;
+  }
+  for(i = 0; i != size; ++i) tree->table_len[i] = UNFILLED;
 
-  /*
-  convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means
-  uninited, a value >= numcodes is an address to another bit, a value < numcodes
-  is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as
-  many columns as codes - 1.
-  A good huffmann tree has N * 2 - 1 nodes, of which N - 1 are internal nodes.
-  Here, the internal nodes are stored (what their 0 and 1 option point to).
-  There is only memory for such good tree currently, if there are more nodes
-  (due to too long length codes), error 55 will happen
-  */
-  for(n = 0; n < tree->numcodes * 2; ++n)
+  /*primary entries pointing to subtables*/
+  pointer = headsize;
+  for(i = 0; i != headsize; ++i)
   {
-    tree->tree2d[n] = 32767; /*32767 here means the tree2d isn't filled there yet*/
+    if(maxlens[i] <= FIRSTBITS) continue;
+    tree->table_len[i] = (unsigned char)maxlens[i];
+    tree->table_value[i] = (unsigned short)pointer;
+    pointer += (size_t)1u << (maxlens[i] - FIRSTBITS);
   }
 
-  for(n = 0; n < tree->numcodes; ++n) /*the codes*/
+  /*fill in the codes*/
+  for(i = 0; i != tree->numcodes; ++i)
   {
-    for(i = 0; i != tree->lengths[n]; ++i) /*the bits for this code*/
+    unsigned l = tree->lengths[i];
+    unsigned reverse, num, j;
+    if(l == 0) continue;
+    reverse = reverseBits(tree->tree1d[i], l);
+    if(l <= FIRSTBITS)
     {
-      unsigned char bit = (unsigned char)((tree->tree1d[n] >> (tree->lengths[n] - i - 1)) & 1);
-      /*oversubscribed, see comment in lodepng_error_text*/
-      if(treepos > 2147483647 || treepos + 2 > tree->numcodes) return 55;
-      if(tree->tree2d[2 * treepos + bit] == 32767) /*not yet filled in*/
+      num = 1u << (FIRSTBITS - l);
+      for(j = 0; j != num; ++j)
       {
-        if(i + 1 == tree->lengths[n]) /*last bit*/
-        {
-          tree->tree2d[2 * treepos + bit] = n; /*put the current code in it*/
-          treepos = 0;
-        }
-        else
-        {
-          /*put address of the next step in here, first that address has to be found of course
-          (it's just nodefilled + 1)...*/
-          ++nodefilled;
-          /*addresses encoded with numcodes added to it*/
-          tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes;
-          treepos = nodefilled;
-        }
+        unsigned index = reverse | (j << l);
+        /*oversubscribed, see comment in lodepng_error_text*/
+        if(tree->table_len[index] != UNFILLED) return 55;
+        tree->table_len[index] = (unsigned char)l;
+        tree->table_value[index] = (unsigned short)i;
+      }
+    }
+    else
+    {
+      unsigned index = reverse & mask;
+      unsigned tablelen = tree->table_len[index] - FIRSTBITS;
+      unsigned start = tree->table_value[index];
+      unsigned reverse2 = reverse >> FIRSTBITS;
+      num = 1u << (tablelen - (l - FIRSTBITS));
+      for(j = 0; j != num; ++j)
+      {
+        unsigned index2 = start + (reverse2 | (j << (l - FIRSTBITS)));
+        if(tree->table_len[index2] != UNFILLED) return 55;
+        tree->table_len[index2] = (unsigned char)(l - FIRSTBITS);
+        tree->table_value[index2] = (unsigned short)i;
       }
-      else treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
     }
   }
 
-  for(n = 0; n < tree->numcodes * 2; ++n)
+  /*incomplete codes are allowed (e.g. a distance tree with a single code), those
+  entries only give an error if the stream actually uses them*/
+  for(i = 0; i != size; ++i)
   {
-    if(tree->tree2d[n] == 32767) tree->tree2d[n] = 0; /*remove possible remaining 32767's*/
+    if(tree->table_len[i] == UNFILLED)
+    {
+      tree->table_len[i] = 0;
+      tree->table_value[i] = INVALIDSYMBOL;
+    }
   }
 
   return 0;
@@ -609,42 +1165,26 @@ value is error.
 */
 static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
 {
-  uivector blcount;
-  uivector nextcode;
-  unsigned error = 0;
+  /*indexed by code length, maxbitlen is at most 15*/
+  unsigned blcount[16];
+  unsigned nextcode[16];
   unsigned bits, n;
 
-  uivector_init(&blcount);
-  uivector_init(&nextcode);
-
-  tree->tree1d = (unsigned*)lodepng_malloc(tree->numcodes * sizeof(unsigned));
-  if(!tree->tree1d) error = 83; /*alloc fail*/
-
-  if(!uivector_resizev(&blcount, tree->maxbitlen + 1, 0)
-  || !uivector_resizev(&nextcode, tree->maxbitlen + 1, 0))
-    error = 83; /*alloc fail*/
-
-  if(!error)
+  for(bits = 0; bits != 16; ++bits) blcount[bits] = nextcode[bits] = 0;
+  /*step 1: count number of instances of each code length*/
+  for(bits = 0; bits != tree->numcodes; ++bits) ++blcount[tree->lengths[bits]];
+  /*step 2: generate the nextcode values*/
+  for(bits = 1; bits <= tree->maxbitlen; ++bits)
   {
-    /*step 1: count number of instances of each code length*/
-    for(bits = 0; bits != tree->numcodes; ++bits) ++blcount.data[tree->lengths[bits]];
-    /*step 2: generate the nextcode values*/
-    for(bits = 1; bits <= tree->maxbitlen; ++bits)
-    {
-      nextcode.data[bits] = (nextcode.data[bits - 1] + blcount.data[bits - 1]) << 1;
-    }
-    /*step 3: generate all the codes*/
-    for(n = 0; n != tree->numcodes; ++n)
-    {
-      if(tree->lengths[n] != 0) tree->tree1d[n] = nextcode.data[tree->lengths[n]]++;
-    }
+    nextcode[bits] = (nextcode[bits - 1] + blcount[bits - 1]) << 1;
+  }
+  /*step 3: generate all the codes*/
+  for(n = 0; n != tree->numcodes; ++n)
+  {
+    if(tree->lengths[n] != 0) tree->tree1d[n] = nextcode[tree->lengths[n]]++;
   }
 
-  uivector_cleanup(&blcount);
-  uivector_cleanup(&nextcode);
-
-  if(!error) return HuffmanTree_make2DTree(tree);
-  else return error;
+  return HuffmanTree_makeTable(tree);
 }
 
 /*
@@ -656,8 +1196,7 @@ static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* b
                                             size_t numcodes, unsigned maxbitlen)
 {
   unsigned i;
-  tree->lengths = (unsigned*)lodepng_malloc(numcodes * sizeof(unsigned));
-  if(!tree->lengths) return 83; /*alloc fail*/
+  CERROR_TRY_RETURN(HuffmanTree_reserve(tree, numcodes));
   for(i = 0; i != numcodes; ++i) tree->lengths[i] = bitlen[i];
   tree->numcodes = (unsigned)numcodes; /*number of symbols*/
   tree->maxbitlen = maxbitlen;
@@ -667,89 +1206,130 @@ static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* b
 #ifdef LODEPNG_COMPILE_ENCODER
 
 /*
-A coin, this is the terminology used for the package-merge algorithm and the
-coin collector's problem. This is used to generate the huffman tree.
-A coin can be multiple coins (when they're merged)
+Length-limited Huffman code lengths with package-merge, represented by the coin collector's
+problem. The weights are the float fractions of the total, and at equal weight packages
+come before symbols, so that among the sets of lengths of equal cost the same one is chosen
+as always, the choice changes the size of the tree header. All storage is on the stack for
+up to HUFFMAN_STACK_CODES used symbols and a limit of up to HUFFMAN_STACK_BITLEN bits, more
+gets a single allocation.
 */
-typedef struct Coin
-{
-  uivector symbols;
-  float weight; /*the sum of all weights in this coin*/
-} Coin;
 
-static void coin_init(Coin* c)
-{
-  uivector_init(&c->symbols);
-}
+/*enough for the symbols and the maximum code length of deflate*/
+#define HUFFMAN_STACK_CODES 288u
+#define HUFFMAN_STACK_BITLEN 15u
 
-/*argument c is void* so that this dtor can be given as function pointer to the vector resize function*/
-static void coin_cleanup(void* c)
+typedef struct HuffmanLeaf
 {
-  uivector_cleanup(&((Coin*)c)->symbols);
-}
+  float weight; /*the frequency divided by the sum of all frequencies*/
+  unsigned symbol;
+} HuffmanLeaf;
 
-static void coin_copy(Coin* c1, const Coin* c2)
+/*by weight, then by symbol, so that the code lengths don't depend on the sort*/
+static int leafLess(const HuffmanLeaf* a, const HuffmanLeaf* b)
 {
-  c1->weight = c2->weight;
-  uivector_copy(&c1->symbols, &c2->symbols);
+  return a->weight != b->weight ? a->weight < b->weight : a->symbol < b->symbol;
 }
 
-static void add_coins(Coin* c1, const Coin* c2)
+/*heapsort, qsort may allocate memory*/
+static void sortLeaves(HuffmanLeaf* leaves, size_t num)
 {
-  size_t i;
-  for(i = 0; i != c2->symbols.size; ++i) uivector_push_back(&c1->symbols, c2->symbols.data[i]);
-  c1->weight += c2->weight;
+  size_t start = num / 2, end = num;
+  while(end > 1)
+  {
+    size_t root;
+    HuffmanLeaf temp;
+    if(start > 0) --start; /*building the heap*/
+    else
+    {
+      /*the largest is at the root, move it to the end*/
+      --end;
+      temp = leaves[end]; leaves[end] = leaves[0]; leaves[0] = temp;
+    }
+    root = start;
+    for(;;) /*sift down*/
+    {
+      size_t child = root * 2 + 1;
+      if(child >= end) break;
+      if(child + 1 < end && leafLess(&leaves[child], &leaves[child + 1])) ++child;
+      if(!leafLess(&leaves[root], &leaves[child])) break;
+      temp = leaves[root]; leaves[root] = leaves[child]; leaves[child] = temp;
+      root = child;
+    }
+  }
 }
 
-static void init_coins(Coin* coins, size_t num)
+/*
+Package-merge for the n sorted leaves and a limit of maxbitlen bits, which must
+allow all n to have a code. Each row (one per code length) is the leaves merged with the
+packages of two items of the row below it, the bits of row tell which items are leaves. The
+2n - 2 cheapest items of the top row are taken, the packages among those take items from the
+row below, and so on. The code length of a leaf is the amount of rows it's taken from.
+*/
+static void packageMergeLengths(unsigned* lengths, const HuffmanLeaf* leaves, size_t n, unsigned maxbitlen,
+                                float* row, float* prevrow, unsigned char* isleaf)
 {
-  size_t i;
-  for(i = 0; i != num; ++i) coin_init(&coins[i]);
-}
+  size_t rowbytes = (2 * n + 7) / 8;
+  size_t numprev = n, i, take;
+  unsigned j;
 
-static void cleanup_coins(Coin* coins, size_t num)
-{
-  size_t i;
-  for(i = 0; i != num; ++i) coin_cleanup(&coins[i]);
-}
+  /*the bottom row is only the leaves*/
+  for(i = 0; i != n; ++i) prevrow[i] = leaves[i].weight;
+  memset(&isleaf[(maxbitlen - 1) * rowbytes], 255, rowbytes);
 
-static int coin_compare(const void* a, const void* b) {
-  float wa = ((const Coin*)a)->weight;
-  float wb = ((const Coin*)b)->weight;
-  return wa > wb ? 1 : wa < wb ? -1 : 0;
-}
+  for(j = maxbitlen - 1; j-- > 0;)
+  {
+    unsigned char* bits = &isleaf[j * rowbytes];
+    size_t l = 0, p = 0, numpackages = numprev / 2, num = 0;
+    float* temp;
+    memset(bits, 0, rowbytes);
+    while(l != n || p != numpackages)
+    {
+      float package = p != numpackages ? prevrow[2 * p] + prevrow[2 * p + 1] : 0;
+      /*at equal weight the package comes first*/
+      if(p == numpackages || (l != n && leaves[l].weight < package))
+      {
+        bits[num / 8] |= (unsigned char)(1u << (num & 7));
+        row[num++] = leaves[l++].weight;
+      }
+      else
+      {
+        row[num++] = package;
+        ++p;
+      }
+    }
+    temp = prevrow; prevrow = row; row = temp;
+    numprev = num;
+  }
 
-static unsigned append_symbol_coins(Coin* coins, const unsigned* frequencies, unsigned numcodes, size_t sum)
-{
-  unsigned i;
-  unsigned j = 0; /*index of present symbols*/
-  for(i = 0; i != numcodes; ++i)
+  for(j = 0, take = 2 * n - 2; j != maxbitlen && take != 0; ++j)
   {
-    if(frequencies[i] != 0) /*only include symbols that are present*/
+    const unsigned char* bits = &isleaf[j * rowbytes];
+    size_t numleaves = 0;
+    for(i = 0; i != take; ++i)
     {
-      coins[j].weight = frequencies[i] / (float)sum;
-      uivector_push_back(&coins[j].symbols, i);
-      ++j;
+      if(bits[i / 8] & (1u << (i & 7))) ++lengths[leaves[numleaves++].symbol];
     }
+    take = 2 * (take - numleaves);
   }
-  return 0;
 }
 
 unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequencies,
                                       size_t numcodes, unsigned maxbitlen)
 {
-  unsigned i, j;
-  size_t sum = 0, numpresent = 0;
-  unsigned error = 0;
-  Coin* coins; /*the coins of the currently calculated row*/
-  Coin* prev_row; /*the previous row of coins*/
-  size_t numcoins;
-  size_t coinmem;
+  HuffmanLeaf stackleaves[HUFFMAN_STACK_CODES];
+  float stackrows[2][HUFFMAN_STACK_CODES * 2];
+  unsigned char stackbits[HUFFMAN_STACK_BITLEN * (HUFFMAN_STACK_CODES * 2 / 8)];
+  HuffmanLeaf* leaves = stackleaves;
+  float* rows[2];
+  unsigned char* isleaf = stackbits;
+  void* allocated = 0;
+  size_t i, numpresent = 0, sum = 0;
 
   if(numcodes == 0) return 80; /*error: a tree of 0 symbols is not supposed to be made*/
 
   for(i = 0; i != numcodes; ++i)
   {
+    lengths[i] = 0;
     if(frequencies[i] > 0)
     {
       ++numpresent;
@@ -757,8 +1337,6 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
     }
   }
 
-  for(i = 0; i != numcodes; ++i) lengths[i] = 0;
-
   /*ensure at least two present symbols. There should be at least one symbol
   according to RFC 1951 section 3.2.7. To decoders incorrectly require two. To
   make these work as well ensure there are at least two symbols. The
@@ -767,6 +1345,7 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
   if(numpresent == 0)
   {
     lengths[0] = lengths[1] = 1; /*note that for RFC 1951 section 3.2.7, only lengths[0] = 1 is needed*/
+    return 0;
   }
   else if(numpresent == 1)
   {
@@ -779,79 +1358,39 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
         break;
       }
     }
+    return 0;
   }
-  else
+
+  /*error: the limit doesn't allow that many codes*/
+  if(maxbitlen < sizeof(size_t) * 8 && ((size_t)1 << maxbitlen) < numpresent) return 100;
+
+  rows[0] = stackrows[0];
+  rows[1] = stackrows[1];
+  if(numpresent > HUFFMAN_STACK_CODES || maxbitlen > HUFFMAN_STACK_BITLEN)
   {
-    /*Package-Merge algorithm represented by coin collector's problem
-    For every symbol, maxbitlen coins will be created*/
+    size_t rowbytes = (2 * numpresent + 7) / 8;
+    allocated = lodepng_malloc(numpresent * (sizeof(HuffmanLeaf) + 4 * sizeof(float)) + maxbitlen * rowbytes);
+    if(!allocated) return 83; /*alloc fail*/
+    rows[0] = (float*)allocated;
+    rows[1] = rows[0] + 2 * numpresent;
+    leaves = (HuffmanLeaf*)(rows[1] + 2 * numpresent);
+    isleaf = (unsigned char*)(leaves + numpresent);
+  }
 
-    coinmem = numpresent * 2; /*max amount of coins needed with the current algo*/
-    coins = (Coin*)lodepng_malloc(sizeof(Coin) * coinmem);
-    prev_row = (Coin*)lodepng_malloc(sizeof(Coin) * coinmem);
-    if(!coins || !prev_row)
-    {
-      lodepng_free(coins);
-      lodepng_free(prev_row);
-      return 83; /*alloc fail*/
-    }
-    init_coins(coins, coinmem);
-    init_coins(prev_row, coinmem);
-
-    /*first row, lowest denominator*/
-    error = append_symbol_coins(coins, frequencies, numcodes, sum);
-    numcoins = numpresent;
-    qsort(coins, numcoins, sizeof(Coin), coin_compare);
-    if(!error)
-    {
-      unsigned numprev = 0;
-      for(j = 1; j <= maxbitlen && !error; ++j) /*each of the remaining rows*/
-      {
-        unsigned tempnum;
-        Coin* tempcoins;
-        /*swap prev_row and coins, and their amounts*/
-        tempcoins = prev_row; prev_row = coins; coins = tempcoins;
-        tempnum = numprev; numprev = numcoins; numcoins = tempnum;
-
-        cleanup_coins(coins, numcoins);
-        init_coins(coins, numcoins);
-
-        numcoins = 0;
-
-        /*fill in the merged coins of the previous row*/
-        for(i = 0; i + 1 < numprev; i += 2)
-        {
-          /*merge prev_row[i] and prev_row[i + 1] into new coin*/
-          Coin* coin = &coins[numcoins++];
-          coin_copy(coin, &prev_row[i]);
-          add_coins(coin, &prev_row[i + 1]);
-        }
-        /*fill in all the original symbols again*/
-        if(j < maxbitlen)
-        {
-          error = append_symbol_coins(coins + numcoins, frequencies, numcodes, sum);
-          numcoins += numpresent;
-        }
-        qsort(coins, numcoins, sizeof(Coin), coin_compare);
-      }
-    }
-
-    if(!error)
-    {
-      /*calculate the lengths of each symbol, as the amount of times a coin of each symbol is used*/
-      for(i = 0; i + 1 < numpresent; ++i)
-      {
-        Coin* coin = &coins[i];
-        for(j = 0; j < coin->symbols.size; ++j) ++lengths[coin->symbols.data[j]];
-      }
-    }
-
-    cleanup_coins(coins, coinmem);
-    lodepng_free(coins);
-    cleanup_coins(prev_row, coinmem);
-    lodepng_free(prev_row);
+  numpresent = 0;
+  for(i = 0; i != numcodes; ++i)
+  {
+    if(frequencies[i] == 0) continue;
+    leaves[numpresent].weight = frequencies[i] / (float)sum;
+    leaves[numpresent].symbol = (unsigned)i;
+    ++numpresent;
   }
+  sortLeaves(leaves, numpresent);
 
-  return error;
+  packageMergeLengths(lengths, leaves, numpresent, maxbitlen, rows[0], rows[1], isleaf);
+
+  lodepng_free(allocated);
+  return 0;
 }
 
 /*Create the Huffman tree given the symbol frequencies*/
@@ -862,8 +1401,8 @@ static unsigned HuffmanTree_makeFromFrequencies(HuffmanTree* tree, const unsigne
   while(!frequencies[numcodes - 1] && numcodes > mincodes) --numcodes; /*trim zeroes*/
   tree->maxbitlen = maxbitlen;
   tree->numcodes = (unsigned)numcodes; /*number of symbols*/
-  tree->lengths = (unsigned*)lodepng_realloc(tree->lengths, numcodes * sizeof(unsigned));
-  if(!tree->lengths) return 83; /*alloc fail*/
+  /*the old lengths aren't kept, they're all set below*/
+  CERROR_TRY_RETURN(HuffmanTree_reserve(tree, numcodes));
   /*initialize all lengths to 0*/
   memset(tree->lengths, 0, numcodes * sizeof(unsigned));
 
@@ -886,9 +1425,8 @@ static unsigned HuffmanTree_getLength(const HuffmanTree* tree, unsigned index)
 /*get the literal and length code tree of a deflated block with fixed tree, as per the deflate specification*/
 static unsigned generateFixedLitLenTree(HuffmanTree* tree)
 {
-  unsigned i, error = 0;
-  unsigned* bitlen = (unsigned*)lodepng_malloc(NUM_DEFLATE_CODE_SYMBOLS * sizeof(unsigned));
-  if(!bitlen) return 83; /*alloc fail*/
+  unsigned i;
+  unsigned bitlen[NUM_DEFLATE_CODE_SYMBOLS];
 
   /*288 possible codes: 0-255=literals, 256=endcode, 257-285=lengthcodes, 286-287=unused*/
   for(i =   0; i <= 143; ++i) bitlen[i] = 8;
@@ -896,50 +1434,47 @@ static unsigned generateFixedLitLenTree(HuffmanTree* tree)
   for(i = 256; i <= 279; ++i) bitlen[i] = 7;
   for(i = 280; i <= 287; ++i) bitlen[i] = 8;
 
-  error = HuffmanTree_makeFromLengths(tree, bitlen, NUM_DEFLATE_CODE_SYMBOLS, 15);
-
-  lodepng_free(bitlen);
-  return error;
+  return HuffmanTree_makeFromLengths(tree, bitlen, NUM_DEFLATE_CODE_SYMBOLS, 15);
 }
 
 /*get the distance code tree of a deflated block with fixed tree, as specified in the deflate specification*/
 static unsigned generateFixedDistanceTree(HuffmanTree* tree)
 {
-  unsigned i, error = 0;
-  unsigned* bitlen = (unsigned*)lodepng_malloc(NUM_DISTANCE_SYMBOLS * sizeof(unsigned));
-  if(!bitlen) return 83; /*alloc fail*/
+  unsigned i;
+  unsigned bitlen[NUM_DISTANCE_SYMBOLS];
 
   /*there are 32 distance codes, but 30-31 are unused*/
   for(i = 0; i != NUM_DISTANCE_SYMBOLS; ++i) bitlen[i] = 5;
-  error = HuffmanTree_makeFromLengths(tree, bitlen, NUM_DISTANCE_SYMBOLS, 15);
-
-  lodepng_free(bitlen);
-  return error;
+  return HuffmanTree_makeFromLengths(tree, bitlen, NUM_DISTANCE_SYMBOLS, 15);
 }
 
 #ifdef LODEPNG_COMPILE_DECODER
 
 /*
-returns the code, or (unsigned)(-1) if error happened
-inbitlength is the length of the complete buffer, in bits (so its byte length times 8)
+returns the symbol, or INVALIDSYMBOL if the bits don't form a code of the tree.
+Reading past the end of the input is not checked here, the caller does that
+with BitReader_overrun.
 */
-static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
-                                    const HuffmanTree* codetree, size_t inbitlength)
+static unsigned huffmanDecodeSymbol(BitReader* reader, const HuffmanTree* codetree)
 {
-  unsigned treepos = 0, ct;
-  for(;;)
+  unsigned index, length, value;
+  /*a code is at most 15 bits, which always fits after filling*/
+  if(reader->bitcount < 15) BitReader_fill(reader);
+  index = BitReader_peek(reader, FIRSTBITS);
+  length = codetree->table_len[index];
+  value = codetree->table_value[index];
+  if(length <= FIRSTBITS)
   {
-    if(*bp >= inbitlength) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
-    /*
-    decode the symbol from the tree. The "readBitFromStream" code is inlined in
-    the expression below because this is the biggest bottleneck while decoding
-    */
-    ct = codetree->tree2d[(treepos << 1) + READBIT(*bp, in)];
-    ++(*bp);
-    if(ct < codetree->numcodes) return ct; /*the symbol is decoded, return it*/
-    else treepos = ct - codetree->numcodes; /*symbol not yet decoded, instead move tree position*/
-
-    if(treepos >= codetree->numcodes) return (unsigned)(-1); /*error: it appeared outside the codetree*/
+    BitReader_skip(reader, length);
+    return value;
+  }
+  else
+  {
+    /*the code is longer than FIRSTBITS, look up the remaining bits in the subtable*/
+    BitReader_skip(reader, FIRSTBITS);
+    index = value + BitReader_peek(reader, length - FIRSTBITS);
+    BitReader_skip(reader, codetree->table_len[index]);
+    return codetree->table_value[index];
   }
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
@@ -951,62 +1486,54 @@ static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
 /* ////////////////////////////////////////////////////////////////////////// */
 
 /*get the tree of a deflated block with fixed tree, as specified in the deflate specification*/
-static void getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
+static unsigned getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
 {
-  /*TODO: check for out of memory errors*/
-  generateFixedLitLenTree(tree_ll);
-  generateFixedDistanceTree(tree_d);
+  CERROR_TRY_RETURN(generateFixedLitLenTree(tree_ll));
+  return generateFixedDistanceTree(tree_d);
 }
 
-/*get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
-static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
-                                      const unsigned char* in, size_t* bp, size_t inlength)
+/*
+get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree.
+tree_cl is for the code length codes, it's given to reuse its memory.
+*/
+static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d, HuffmanTree* tree_cl,
+                                      BitReader* reader)
 {
   /*make sure that length values that aren't filled in will be 0, or a wrong tree will be generated*/
   unsigned error = 0;
   unsigned n, HLIT, HDIST, HCLEN, i;
-  size_t inbitlength = inlength * 8;
+  size_t inbitlength = reader->size * 8;
 
   /*see comments in deflateDynamic for explanation of the context and these variables, it is analogous*/
-  unsigned* bitlen_ll = 0; /*lit,len code lengths*/
-  unsigned* bitlen_d = 0; /*dist code lengths*/
+  unsigned bitlen_ll[NUM_DEFLATE_CODE_SYMBOLS]; /*lit,len code lengths*/
+  unsigned bitlen_d[NUM_DISTANCE_SYMBOLS]; /*dist code lengths*/
   /*code length code lengths ("clcl"), the bit lengths of the huffman tree used to compress bitlen_ll and bitlen_d*/
-  unsigned* bitlen_cl = 0;
-  HuffmanTree tree_cl; /*the code tree for code length codes (the huffman tree for compressed huffman trees)*/
+  unsigned bitlen_cl[NUM_CODE_LENGTH_CODES];
 
-  if((*bp) + 14 > (inlength << 3)) return 49; /*error: the bit pointer is or will go past the memory*/
+  if(BitReader_bitpos(reader) + 14 > inbitlength) return 49; /*error: the bit pointer is or will go past the memory*/
 
   /*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already*/
-  HLIT =  readBitsFromStream(bp, in, 5) + 257;
+  HLIT =  BitReader_read(reader, 5) + 257;
   /*number of distance codes. Unlike the spec, the value 1 is added to it here already*/
-  HDIST = readBitsFromStream(bp, in, 5) + 1;
+  HDIST = BitReader_read(reader, 5) + 1;
   /*number of code length codes. Unlike the spec, the value 4 is added to it here already*/
-  HCLEN = readBitsFromStream(bp, in, 4) + 4;
-
-  if((*bp) + HCLEN * 3 > (inlength << 3)) return 50; /*error: the bit pointer is or will go past the memory*/
+  HCLEN = BitReader_read(reader, 4) + 4;
 
-  HuffmanTree_init(&tree_cl);
+  if(BitReader_bitpos(reader) + HCLEN * 3 > inbitlength) return 50; /*error: the bit pointer is or will go past the memory*/
 
   while(!error)
   {
     /*read the code length codes out of 3 * (amount of code length codes) bits*/
-
-    bitlen_cl = (unsigned*)lodepng_malloc(NUM_CODE_LENGTH_CODES * sizeof(unsigned));
-    if(!bitlen_cl) ERROR_BREAK(83 /*alloc fail*/);
-
     for(i = 0; i != NUM_CODE_LENGTH_CODES; ++i)
     {
-      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBitsFromStream(bp, in, 3);
+      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = BitReader_read(reader, 3);
       else bitlen_cl[CLCL_ORDER[i]] = 0; /*if not, it must stay 0*/
     }
 
-    error = HuffmanTree_makeFromLengths(&tree_cl, bitlen_cl, NUM_CODE_LENGTH_CODES, 7);
+    error = HuffmanTree_makeFromLengths(tree_cl, bitlen_cl, NUM_CODE_LENGTH_CODES, 7);
     if(error) break;
 
     /*now we can use this tree to read the lengths for the tree that this function will return*/
-    bitlen_ll = (unsigned*)lodepng_malloc(NUM_DEFLATE_CODE_SYMBOLS * sizeof(unsigned));
-    bitlen_d = (unsigned*)lodepng_malloc(NUM_DISTANCE_SYMBOLS * sizeof(unsigned));
-    if(!bitlen_ll || !bitlen_d) ERROR_BREAK(83 /*alloc fail*/);
     for(i = 0; i != NUM_DEFLATE_CODE_SYMBOLS; ++i) bitlen_ll[i] = 0;
     for(i = 0; i != NUM_DISTANCE_SYMBOLS; ++i) bitlen_d[i] = 0;
 
@@ -1014,7 +1541,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     i = 0;
     while(i < HLIT + HDIST)
     {
-      unsigned code = huffmanDecodeSymbol(in, bp, &tree_cl, inbitlength);
+      unsigned code = huffmanDecodeSymbol(reader, tree_cl);
+      if(BitReader_overrun(reader)) ERROR_BREAK(10); /*error: end of input memory reached without endcode*/
       if(code <= 15) /*a length code*/
       {
         if(i < HLIT) bitlen_ll[i] = code;
@@ -1028,8 +1556,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 
         if (i == 0) ERROR_BREAK(54); /*can't repeat previous if i is 0*/
 
-        if((*bp + 2) > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-        replength += readBitsFromStream(bp, in, 2);
+        if(BitReader_bitpos(reader) + 2 > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        replength += BitReader_read(reader, 2);
 
         if(i < HLIT + 1) value = bitlen_ll[i - 1];
         else value = bitlen_d[i - HLIT - 1];
@@ -1045,8 +1573,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 17) /*repeat "0" 3-10 times*/
       {
         unsigned replength = 3; /*read in the bits that indicate repeat length*/
-        if((*bp + 3) > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-        replength += readBitsFromStream(bp, in, 3);
+        if(BitReader_bitpos(reader) + 3 > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        replength += BitReader_read(reader, 3);
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; ++n)
@@ -1061,8 +1589,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 18) /*repeat "0" 11-138 times*/
       {
         unsigned replength = 11; /*read in the bits that indicate repeat length*/
-        if((*bp + 7) > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-        replength += readBitsFromStream(bp, in, 7);
+        if(BitReader_bitpos(reader) + 7 > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        replength += BitReader_read(reader, 7);
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; ++n)
@@ -1074,15 +1602,10 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
           ++i;
         }
       }
-      else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+      else /*if(code == INVALIDSYMBOL)*/
       {
-        if(code == (unsigned)(-1))
-        {
-          /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-          (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inbitlength ? 10 : 11;
-        }
-        else error = 16; /*unexisting code, this can never happen*/
+        /*11=the bits don't form a code of the tree*/
+        error = code == INVALIDSYMBOL ? 11 : 16; /*16: unexisting code, this can never happen*/
         break;
       }
     }
@@ -1098,115 +1621,228 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     break; /*end of error-while*/
   }
 
-  lodepng_free(bitlen_cl);
-  lodepng_free(bitlen_ll);
-  lodepng_free(bitlen_d);
-  HuffmanTree_cleanup(&tree_cl);
-
   return error;
 }
 
-/*inflate a block with dynamic of fixed Huffman tree*/
-static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size_t* bp,
-                                    size_t* pos, size_t inlength, unsigned btype)
+/*
+State of an inflation in progress. The input may arrive in parts: then
+inflateRun decodes as far as the input goes and stops at the last symbol it
+could fully read, and can be called again when more input was added.
+*/
+typedef struct Inflator
 {
-  unsigned error = 0;
-  HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
-  HuffmanTree tree_d; /*the huffman tree for distance codes*/
-  size_t inbitlength = inlength * 8;
+  BitReader reader;
+  /*
+  The trees are made again for every block in the same memory, so that blocks cost no
+  allocations once the tables are big enough. With an arena, that memory is reused for
+  the next decode too.
+  */
+  HuffmanTree tree_ll; /*the huffman tree for literal and length codes of the current block*/
+  HuffmanTree tree_d; /*the huffman tree for distance codes of the current block*/
+  HuffmanTree tree_cl; /*the huffman tree for the code lengths of a dynamic block header*/
+  unsigned fixed; /*1 if tree_ll and tree_d are the fixed trees, which don't need to be made again*/
+  size_t resume; /*bit position to continue from*/
+  size_t pos; /*byte position in the out buffer*/
+  size_t maxpos; /*error 91 if the output would grow beyond this size*/
+  size_t stop; /*bit position of a block boundary to stop at, when only a part of the data is inflated*/
+  unsigned inblock; /*1 while in the middle of a Huffman block, with its trees made*/
+  unsigned final; /*BFINAL of the current block*/
+  unsigned done; /*1 when the last block has ended*/
+  LodePNGArena* arena; /*where the trees are allocated, null for lodepng_malloc*/
+} Inflator;
+
+/*not an error code: returned internally when the input ends before the data does*/
+#define INFLATE_NEED_INPUT 65536u
 
-  HuffmanTree_init(&tree_ll);
-  HuffmanTree_init(&tree_d);
+/*
+A dynamic block header fits in this many bytes (3 + 14 + 19 * 3 + 320 * 14 bits
+at most). When the input is incomplete, a block is only started once at least
+this much is available, so only the symbols of the block itself can be broken off.
+*/
+#define MAX_BLOCK_HEADER_BYTES 600u
+
+static void Inflator_init(Inflator* inflator, LodePNGArena* arena)
+{
+  BitReader_init(&inflator->reader, 0, 0);
+  HuffmanTree_init(&inflator->tree_ll);
+  HuffmanTree_init(&inflator->tree_d);
+  HuffmanTree_init(&inflator->tree_cl);
+  inflator->tree_ll.arena = inflator->tree_d.arena = inflator->tree_cl.arena = arena;
+  inflator->fixed = 0;
+  inflator->arena = arena;
+  inflator->resume = 0;
+  inflator->pos = 0;
+  inflator->maxpos = (size_t)(-1);
+  inflator->stop = (size_t)(-1);
+  inflator->inblock = 0;
+  inflator->final = 0;
+  inflator->done = 0;
+}
+
+static void Inflator_endBlock(Inflator* inflator)
+{
+  inflator->inblock = 0;
+}
+
+static void Inflator_cleanup(Inflator* inflator)
+{
+  HuffmanTree_cleanup(&inflator->tree_ll);
+  HuffmanTree_cleanup(&inflator->tree_d);
+  HuffmanTree_cleanup(&inflator->tree_cl);
+}
+
+/*
+Copies a match of length bytes from distance bytes back. The source and destination overlap
+if distance < length, then the copy repeats the last distance bytes. Chunks of 16 or 8 bytes
+read only bytes that were written before them if the distance is at least the chunk size,
+and may write up to 15 bytes past the end, which must be allocated. avail is the amount of
+bytes allocated from dst on.
+*/
+static void inflateCopyMatch(unsigned char* dst, size_t distance, size_t length, size_t avail)
+{
+  const unsigned char* src = dst - distance;
+  size_t i;
+  if(distance >= 16 && length + 15 <= avail)
+  {
+    for(i = 0; i < length; i += 16) memcpy(&dst[i], &src[i], 16);
+  }
+  else if(distance >= 8 && length + 7 <= avail)
+  {
+    for(i = 0; i < length; i += 8) memcpy(&dst[i], &src[i], 8);
+  }
+  else if(distance == 1)
+  {
+    memset(dst, src[0], length);
+  }
+  else
+  {
+    for(i = 0; i != length; ++i) dst[i] = src[i];
+  }
+}
 
-  if(btype == 1) getTreeInflateFixed(&tree_ll, &tree_d);
-  else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, in, bp, inlength);
+/*
+inflate the symbols of a block with dynamic of fixed Huffman tree, until the end code.
+If last is 0 the input may be incomplete, then INFLATE_NEED_INPUT is returned
+with inflator->resume at the start of the first symbol that isn't complete.
+*/
+static unsigned inflateHuffmanBlock(Inflator* inflator, ucvector* out, unsigned last)
+{
+  unsigned error = 0;
+  BitReader* reader = &inflator->reader;
+  const HuffmanTree* tree_ll = &inflator->tree_ll;
+  const HuffmanTree* tree_d = &inflator->tree_d;
+  size_t pos = inflator->pos;
+  /*
+  The output is written up to its allocated size, and its size is only set at the end. Below
+  limit, which is the allocated size or maxpos, symbols need no other checks. The decoders
+  reserve the exact size of the image, so the output only grows if it isn't known.
+  */
+  size_t limit = out->allocsize < inflator->maxpos ? out->allocsize : inflator->maxpos;
 
   while(!error) /*decode all symbols until end reached, breaks at end code*/
   {
     /*code_ll is literal, length or end code*/
-    unsigned code_ll = huffmanDecodeSymbol(in, bp, &tree_ll, inbitlength);
+    unsigned code_ll;
+    size_t symbolstart = BitReader_bitpos(reader);
+
+    code_ll = huffmanDecodeSymbol(reader, tree_ll);
+    if(BitReader_overrun(reader))
+    {
+      if(!last)
+      {
+        inflator->resume = symbolstart;
+        CERROR_BREAK(error, INFLATE_NEED_INPUT);
+      }
+      ERROR_BREAK(10); /*error: end of input memory reached without endcode*/
+    }
     if(code_ll <= 255) /*literal symbol*/
     {
-      /*ucvector_push_back would do the same, but for some reason the two lines below run 10% faster*/
-      if(!ucvector_resize(out, (*pos) + 1)) ERROR_BREAK(83 /*alloc fail*/);
-      out->data[*pos] = (unsigned char)code_ll;
-      ++(*pos);
+      if(pos >= limit)
+      {
+        if(pos >= inflator->maxpos) ERROR_BREAK(91); /*output larger than allowed*/
+        if(!ucvector_reserve(out, pos + 1)) ERROR_BREAK(83 /*alloc fail*/);
+        limit = out->allocsize < inflator->maxpos ? out->allocsize : inflator->maxpos;
+      }
+      out->data[pos++] = (unsigned char)code_ll;
     }
     else if(code_ll >= FIRST_LENGTH_CODE_INDEX && code_ll <= LAST_LENGTH_CODE_INDEX) /*length code*/
     {
       unsigned code_d, distance;
       unsigned numextrabits_l, numextrabits_d; /*extra bits for length and distance*/
-      size_t start, forward, backward, length;
+      size_t length;
 
       /*part 1: get length base*/
       length = LENGTHBASE[code_ll - FIRST_LENGTH_CODE_INDEX];
 
       /*part 2: get extra bits and add the value of that to length*/
       numextrabits_l = LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX];
-      if((*bp + numextrabits_l) > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      length += readBitsFromStream(bp, in, numextrabits_l);
+      if(numextrabits_l != 0) length += BitReader_read(reader, numextrabits_l);
 
       /*part 3: get distance code*/
-      code_d = huffmanDecodeSymbol(in, bp, &tree_d, inbitlength);
-      if(code_d > 29)
+      code_d = huffmanDecodeSymbol(reader, tree_d);
+      if(code_d <= 29)
       {
-        if(code_ll == (unsigned)(-1)) /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+        distance = DISTANCEBASE[code_d];
+
+        /*part 4: get extra bits from distance*/
+        numextrabits_d = DISTANCEEXTRA[code_d];
+        if(numextrabits_d != 0) distance += BitReader_read(reader, numextrabits_d);
+      }
+      else distance = 0;
+      if(BitReader_overrun(reader))
+      {
+        if(!last)
         {
-          /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-          (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inlength * 8 ? 10 : 11;
+          inflator->resume = symbolstart;
+          CERROR_BREAK(error, INFLATE_NEED_INPUT);
         }
-        else error = 18; /*error: invalid distance code (30-31 are never used)*/
-        break;
+        /*return error code 10 or 51 depending on whether the distance code itself was cut off*/
+        ERROR_BREAK(code_d > 29 ? 10 : 51);
+      }
+      if(code_d > 29)
+      {
+        /*11=the bits don't form a code of the tree, 18=unused distance codes 30-31*/
+        ERROR_BREAK(code_d == INVALIDSYMBOL ? 11 : 18);
       }
-      distance = DISTANCEBASE[code_d];
-
-      /*part 4: get extra bits from distance*/
-      numextrabits_d = DISTANCEEXTRA[code_d];
-      if((*bp + numextrabits_d) > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      distance += readBitsFromStream(bp, in, numextrabits_d);
 
       /*part 5: fill in all the out[n] values based on the length and dist*/
-      start = (*pos);
-      if(distance > start) ERROR_BREAK(52); /*too long backward distance*/
-      backward = start - distance;
-
-      if(!ucvector_resize(out, (*pos) + length)) ERROR_BREAK(83 /*alloc fail*/);
-      for(forward = 0; forward < length; ++forward)
+      if(distance > pos) ERROR_BREAK(52); /*too long backward distance*/
+      if(length > limit - pos)
       {
-        out->data[(*pos)] = out->data[backward];
-        ++(*pos);
-        ++backward;
-        if(backward >= start) backward = start - distance;
+        if(length > inflator->maxpos - pos) ERROR_BREAK(91); /*output larger than allowed*/
+        if(!ucvector_reserve(out, pos + length)) ERROR_BREAK(83 /*alloc fail*/);
+        limit = out->allocsize < inflator->maxpos ? out->allocsize : inflator->maxpos;
       }
+      inflateCopyMatch(&out->data[pos], distance, length, out->allocsize - pos);
+      pos += length;
     }
     else if(code_ll == 256)
     {
       break; /*end code, break the loop*/
     }
-    else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+    else /*if(code_ll == INVALIDSYMBOL)*/
     {
-      /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-      (10=no endcode, 11=wrong jump outside of tree)*/
-      error = ((*bp) > inlength * 8) ? 10 : 11;
+      /*the bits don't form a code of the tree, or it is one of the unused codes 286-287*/
+      error = 11;
       break;
     }
   }
 
-  HuffmanTree_cleanup(&tree_ll);
-  HuffmanTree_cleanup(&tree_d);
-
+  inflator->pos = pos;
+  out->size = pos;
   return error;
 }
 
-static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, size_t* bp, size_t* pos, size_t inlength)
+static unsigned inflateNoCompression(ucvector* out, BitReader* reader, size_t* pos, size_t maxpos)
 {
   size_t p;
   unsigned LEN, NLEN, n, error = 0;
+  const unsigned char* in = reader->data;
+  size_t inlength = reader->size;
 
   /*go to first boundary of byte*/
-  while(((*bp) & 0x7) != 0) ++(*bp);
-  p = (*bp) / 8; /*byte position*/
+  BitReader_align(reader);
+  p = reader->pos; /*byte position*/
 
   /*read LEN (2 bytes) and NLEN (2 bytes)*/
   if(p + 4 >= inlength) return 52; /*error, bit pointer will jump past memory*/
@@ -1215,6 +1851,7 @@ static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, siz
 
   /*check if 16-bit NLEN is really the one's complement of LEN*/
   if(LEN + NLEN != 65535) return 21; /*error: NLEN is not one's complement of LEN*/
+  if(LEN > maxpos - *pos) return 91; /*output larger than allowed*/
 
   if(!ucvector_resize(out, (*pos) + LEN)) return 83; /*alloc fail*/
 
@@ -1222,38 +1859,259 @@ static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, siz
   if(p + LEN > inlength) return 23; /*error: reading outside of in buffer*/
   for(n = 0; n < LEN; ++n) out->data[(*pos)++] = in[p++];
 
-  (*bp) = p * 8;
+  reader->pos = p;
 
   return error;
 }
 
+/*
+Continues inflating with the input in[0..insize-1], which must start with the
+input of the previous call (it may have moved in memory). If last is 0, more
+input may follow: then 0 is returned when everything given is decoded (or
+inflator->done is set), and the output can contain a part of the data.
+*/
+static unsigned inflateRun(Inflator* inflator, ucvector* out,
+                           const unsigned char* in, size_t insize, unsigned last)
+{
+  BitReader* reader = &inflator->reader;
+  unsigned error = 0;
+
+  BitReader_init(reader, in, insize);
+  BitReader_seek(reader, inflator->resume);
+
+  while(!inflator->done)
+  {
+    if(!inflator->inblock)
+    {
+      unsigned BTYPE;
+      size_t blockstart = BitReader_bitpos(reader);
+      if(blockstart == inflator->stop) break; /*the end of the part*/
+      if(!last && blockstart / 8 + MAX_BLOCK_HEADER_BYTES > insize)
+      {
+        /*the stored block check below also needs the block header to be complete*/
+        inflator->resume = blockstart;
+        return 0;
+      }
+      if(blockstart + 2 >= insize * 8) return 52; /*error, bit pointer will jump past memory*/
+      inflator->final = BitReader_read(reader, 1);
+      BTYPE = BitReader_read(reader, 2);
+
+      if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
+      else if(BTYPE == 0) /*no compression*/
+      {
+        if(!last)
+        {
+          /*only start a stored block when all of it is there*/
+          size_t p = (BitReader_bitpos(reader) + 7) / 8;
+          if(p + 4 + (in[p] + 256u * in[p + 1]) >= insize)
+          {
+            inflator->resume = blockstart;
+            return 0;
+          }
+        }
+        error = inflateNoCompression(out, reader, &inflator->pos, inflator->maxpos);
+        if(error) return error;
+        inflator->done = inflator->final;
+        continue;
+      }
+      else if(BTYPE == 1)
+      {
+        if(!inflator->fixed) error = getTreeInflateFixed(&inflator->tree_ll, &inflator->tree_d);
+        inflator->fixed = !error;
+        if(error) return error;
+      }
+      else
+      {
+        /*a failed tree may be partially made, so fixed is cleared before*/
+        inflator->fixed = 0;
+        error = getTreeInflateDynamic(&inflator->tree_ll, &inflator->tree_d, &inflator->tree_cl, reader);
+        if(error)
+        {
+          Inflator_endBlock(inflator);
+          return error;
+        }
+      }
+      inflator->inblock = 1;
+    }
+
+    error = inflateHuffmanBlock(inflator, out, last);
+    if(error == INFLATE_NEED_INPUT) return 0;
+    Inflator_endBlock(inflator);
+    if(error) return error;
+    inflator->done = inflator->final;
+  }
+
+  inflator->resume = BitReader_bitpos(reader);
+  return 0;
+}
+
+#ifdef LODEPNG_COMPILE_PNG
+/*
+Removes the first amount bytes of the output of the inflator, so that a long output
+can be inflated in a small buffer. The last 32768 bytes before pos must stay, they
+can still be referred to. Positions and maxpos are from then on in the smaller buffer.
+*/
+static void Inflator_dropOutput(Inflator* inflator, ucvector* out, size_t amount)
+{
+  if(amount == 0) return;
+  memmove(out->data, &out->data[amount], out->size - amount);
+  out->size -= amount;
+  inflator->pos -= amount;
+  if(inflator->maxpos != (size_t)(-1)) inflator->maxpos -= amount;
+}
+#endif /*LODEPNG_COMPILE_PNG*/
+
 static unsigned lodepng_inflatev(ucvector* out,
                                  const unsigned char* in, size_t insize,
                                  const LodePNGDecompressSettings* settings)
 {
-  /*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte)*/
-  size_t bp = 0;
-  unsigned BFINAL = 0;
-  size_t pos = 0; /*byte position in the out buffer*/
-  unsigned error = 0;
+  unsigned error;
+  Inflator inflator;
+
+  Inflator_init(&inflator, settings->arena);
+  error = inflateRun(&inflator, out, in, insize, 1);
+  Inflator_cleanup(&inflator);
+
+  return error;
+}
 
-  (void)settings;
+/*bytes of the next span added to the seam at first, enough to get past most boundaries*/
+#define SEAM_STEP (2u * MAX_BLOCK_HEADER_BYTES)
 
-  while(!BFINAL)
+/*
+Gives deflate data in spans to an inflator, with the same result as if it were one buffer.
+The spans are inflated where they are. Only at a boundary, the bytes that aren't consumed
+yet are copied into a small seam buffer, followed by as much of the next span as is needed
+to get past the boundary, and then it goes on in the span. Positions, such as stop, are in
+the data of all spans together.
+*/
+typedef struct SpanFeed
+{
+  const LodePNGSpan* spans;
+  size_t index; /*the span the input comes from, or is added to the seam from*/
+  size_t lastspan; /*the last span that has data*/
+  size_t begin; /*where the input of the inflator starts in spans[index], if not in the seam*/
+  size_t fed; /*bytes of spans[index] given to the inflator or added to the seam so far*/
+  size_t offset; /*position of the first byte of the input of the inflator*/
+  size_t step; /*most bytes of a span given at once*/
+  size_t seamstep; /*bytes of the span added to the seam next time*/
+  size_t stop; /*bit position of a block boundary to stop at, see Inflator*/
+  ucvector seam;
+  size_t carry; /*bytes at the start of the seam that are from the spans before, 0 if not in the seam*/
+  unsigned end; /*1 once the inflator got all the input*/
+} SpanFeed;
+
+/*starts skip bytes into the spans, one of which must have data*/
+static void SpanFeed_init(SpanFeed* feed, const LodePNGSpan* spans, size_t numspans, size_t skip,
+                          size_t step, LodePNGArena* arena)
+{
+  size_t i;
+  feed->spans = spans;
+  feed->index = feed->lastspan = 0;
+  for(i = 0; i != numspans; ++i) if(spans[i].size) feed->lastspan = i;
+  feed->offset = 0;
+  while(feed->index < feed->lastspan && skip >= spans[feed->index].size)
   {
-    unsigned BTYPE;
-    if(bp + 2 >= insize * 8) return 52; /*error, bit pointer will jump past memory*/
-    BFINAL = readBitFromStream(&bp, in);
-    BTYPE = 1u * readBitFromStream(&bp, in);
-    BTYPE += 2u * readBitFromStream(&bp, in);
+    skip -= spans[feed->index].size;
+    feed->offset += spans[feed->index].size;
+    ++feed->index;
+  }
+  if(skip > spans[feed->index].size) skip = spans[feed->index].size;
+  feed->begin = feed->fed = skip;
+  feed->offset += skip;
+  feed->step = step;
+  feed->seamstep = SEAM_STEP;
+  feed->stop = (size_t)(-1);
+  ucvector_init_buffer(&feed->seam, 0, 0);
+  feed->seam.arena = arena;
+  feed->carry = 0;
+  feed->end = 0;
+}
 
-    if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
-    else if(BTYPE == 0) error = inflateNoCompression(out, in, &bp, &pos, insize); /*no compression*/
-    else error = inflateHuffmanBlock(out, in, &bp, &pos, insize, BTYPE); /*compression, BTYPE 01 or 10*/
+static void SpanFeed_cleanup(SpanFeed* feed)
+{
+  arena_free(feed->seam.arena, feed->seam.data);
+}
 
-    if(error) return error;
+#ifdef LODEPNG_COMPILE_PNG
+/*the bit position the inflator is at*/
+static size_t SpanFeed_pos(const SpanFeed* feed, const Inflator* inflator)
+{
+  return feed->offset * 8 + inflator->resume;
+}
+#endif /*LODEPNG_COMPILE_PNG*/
+
+/*
+Gives the inflator more input and inflates it to out, returns error. Once feed->end is
+set, inflator->done is too unless there was an error or it stopped at feed->stop.
+*/
+static unsigned SpanFeed_run(SpanFeed* feed, Inflator* inflator, ucvector* out)
+{
+  const LodePNGSpan* span = &feed->spans[feed->index];
+  const unsigned char* in;
+  size_t insize, amount;
+  unsigned error;
+
+  if(feed->carry)
+  {
+    amount = span->size - feed->fed < feed->seamstep ? span->size - feed->fed : feed->seamstep;
+    if(!ucvector_resize(&feed->seam, feed->seam.size + amount)) return 83; /*alloc fail*/
+    memcpy(&feed->seam.data[feed->seam.size - amount], &span->data[feed->fed], amount);
+    feed->seamstep *= 2;
+    in = feed->seam.data;
+    insize = feed->seam.size;
+  }
+  else
+  {
+    amount = span->size - feed->fed < feed->step ? span->size - feed->fed : feed->step;
+    in = &span->data[feed->begin];
+    insize = feed->fed + amount - feed->begin;
+  }
+  feed->fed += amount;
+  feed->end = feed->index == feed->lastspan && feed->fed == span->size;
+  inflator->stop = feed->stop != (size_t)(-1) && feed->stop >= feed->offset * 8
+                 ? feed->stop - feed->offset * 8 : (size_t)(-1);
+  error = inflateRun(inflator, out, in, insize, feed->end);
+  if(error || inflator->done || feed->end) return error;
+
+  if(feed->carry && inflator->resume / 8 >= feed->carry)
+  {
+    /*past the boundary: the position is now in this span*/
+    inflator->resume -= feed->carry * 8;
+    feed->offset += feed->carry;
+    feed->begin = 0;
+    feed->seam.size = feed->carry = 0;
+  }
+  else if(feed->fed == span->size)
+  {
+    /*keeps only what isn't consumed, then the next span with data is joined to it*/
+    size_t consumed = inflator->resume / 8;
+    if(feed->carry) memmove(feed->seam.data, &feed->seam.data[consumed], feed->seam.size - consumed);
+    if(!ucvector_resize(&feed->seam, insize - consumed)) return 83; /*alloc fail*/
+    if(!feed->carry && feed->seam.size) memcpy(feed->seam.data, &in[consumed], feed->seam.size);
+    inflator->resume -= consumed * 8;
+    feed->offset += consumed;
+    feed->carry = feed->seam.size;
+    feed->begin = feed->fed = 0;
+    feed->seamstep = SEAM_STEP;
+    do ++feed->index; while(feed->spans[feed->index].size == 0);
   }
+  return 0;
+}
 
+/*inflates the deflate data that starts skip bytes into the spans, see SpanFeed*/
+static unsigned inflateSpans(ucvector* out, const LodePNGSpan* spans, size_t numspans, size_t skip,
+                             const LodePNGDecompressSettings* settings)
+{
+  unsigned error = 0;
+  Inflator inflator;
+  SpanFeed feed;
+
+  Inflator_init(&inflator, settings->arena);
+  SpanFeed_init(&feed, spans, numspans, skip, (size_t)(-1), settings->arena);
+  while(!error && !inflator.done && !feed.end) error = SpanFeed_run(&feed, &inflator, out);
+  SpanFeed_cleanup(&feed);
+  Inflator_cleanup(&inflator);
   return error;
 }
 
@@ -1264,26 +2122,13 @@ unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
   unsigned error;
   ucvector v;
   ucvector_init_buffer(&v, *out, *outsize);
+  v.arena = settings->arena;
   error = lodepng_inflatev(&v, in, insize, settings);
   *out = v.data;
   *outsize = v.size;
   return error;
 }
 
-static unsigned inflate(unsigned char** out, size_t* outsize,
-                        const unsigned char* in, size_t insize,
-                        const LodePNGDecompressSettings* settings)
-{
-  if(settings->custom_inflate)
-  {
-    return settings->custom_inflate(out, outsize, in, insize, settings);
-  }
-  else
-  {
-    return lodepng_inflate(out, outsize, in, insize, settings);
-  }
-}
-
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -1357,11 +2202,28 @@ typedef struct Hash
   int* headz; /*similar to head, but for chainz*/
   unsigned short* chainz; /*those with same amount of zeros*/
   unsigned short* zeros; /*length of zeros streak, used as a second hash chain*/
+
+  /*for the fast levels instead of all the above: position + 1 of the last 4 bytes with each hash, 0 if none*/
+  size_t* fast;
 } Hash;
 
-static unsigned hash_init(Hash* hash, unsigned windowsize)
+/*the fast levels hash 4 bytes to this many bits*/
+#define FAST_HASH_BITS 15u
+
+static unsigned hash_init(Hash* hash, unsigned windowsize, unsigned fast)
 {
   unsigned i;
+  hash->fast = 0;
+  if(fast)
+  {
+    hash->head = hash->val = hash->headz = 0;
+    hash->chain = hash->chainz = hash->zeros = 0;
+    hash->fast = (size_t*)lodepng_malloc(sizeof(size_t) << FAST_HASH_BITS);
+    if(!hash->fast) return 83; /*alloc fail*/
+    memset(hash->fast, 0, sizeof(size_t) << FAST_HASH_BITS);
+    return 0;
+  }
+
   hash->head = (int*)lodepng_malloc(sizeof(int) * HASH_NUM_VALUES);
   hash->val = (int*)lodepng_malloc(sizeof(int) * windowsize);
   hash->chain = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
@@ -1395,6 +2257,8 @@ static void hash_cleanup(Hash* hash)
   lodepng_free(hash->zeros);
   lodepng_free(hash->headz);
   lodepng_free(hash->chainz);
+
+  lodepng_free(hash->fast);
 }
 
 
@@ -1626,6 +2490,137 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   return error;
 }
 
+/*hash of the 4 bytes at p, of FAST_HASH_BITS bits*/
+static unsigned fastHash(const unsigned char* p)
+{
+  unsigned value = p[0] | ((unsigned)p[1] << 8u) | ((unsigned)p[2] << 16u) | ((unsigned)p[3] << 24u);
+  return ((value * 2654435761u) & 0xffffffffu) >> (32u - FAST_HASH_BITS);
+}
+
+/*amount of equal bytes at the start of a and b, at most max*/
+static unsigned matchLength(const unsigned char* a, const unsigned char* b, unsigned max)
+{
+  unsigned length = 0;
+  while(length != max && a[length] == b[length]) ++length;
+  return length;
+}
+
+#ifdef LODEPNG_SIMD_X86
+static unsigned matchLength_sse2(const unsigned char* a, const unsigned char* b, unsigned max) LODEPNG_TARGET("sse2");
+/*compares 16 bytes at a time, the first different one is the lowest 0 bit of the comparison mask*/
+static unsigned matchLength_sse2(const unsigned char* a, const unsigned char* b, unsigned max)
+{
+  unsigned length = 0;
+  while(length + 16 <= max)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + length));
+    __m128i y = _mm_loadu_si128((const __m128i*)(b + length));
+    unsigned differ = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xffffu;
+    if(differ)
+    {
+#ifdef _MSC_VER
+      unsigned long index;
+      _BitScanForward(&index, differ);
+      return length + (unsigned)index;
+#else /*_MSC_VER*/
+      return length + (unsigned)__builtin_ctz(differ);
+#endif /*_MSC_VER*/
+    }
+    length += 16;
+  }
+  return length + matchLength(a + length, b + length, max - length);
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+/*
+LZ77 of the fast levels 1 to 3: greedy, and every position looks for a match only at the last
+earlier position with the same hash of 4 bytes. Level 1 doesn't add the positions inside a match
+to the hash table, level 2 only those of short matches, and level 3 all of them, which finds
+more matches but costs more time.
+*/
+static unsigned encodeLZ77Fast(uivector* out, Hash* hash, const unsigned char* in,
+                               size_t inpos, size_t insize, unsigned level)
+{
+  size_t pos = inpos;
+  unsigned insertlength = level == 1 ? 0 : level == 2 ? 16 : MAX_SUPPORTED_DEFLATE_LENGTH;
+  unsigned (*match)(const unsigned char*, const unsigned char*, unsigned) = matchLength;
+#ifdef LODEPNG_SIMD_X86
+  if(getCpuFeatures() & CPU_SSE2) match = matchLength_sse2;
+#endif /*LODEPNG_SIMD_X86*/
+
+  while(pos < insize)
+  {
+    unsigned length = 0;
+    size_t distance = 0;
+    if(insize - pos >= 4)
+    {
+      size_t* entry = &hash->fast[fastHash(&in[pos])];
+      size_t candidate = *entry;
+      *entry = pos + 1;
+      if(candidate != 0 && pos - (candidate - 1) <= 32768)
+      {
+        const unsigned char* earlier = &in[candidate - 1];
+        if(earlier[0] == in[pos] && earlier[1] == in[pos + 1] && earlier[2] == in[pos + 2] && earlier[3] == in[pos + 3])
+        {
+          size_t max = insize - pos < MAX_SUPPORTED_DEFLATE_LENGTH ? insize - pos : MAX_SUPPORTED_DEFLATE_LENGTH;
+          length = 4 + match(&in[pos + 4], earlier + 4, (unsigned)max - 4);
+          distance = pos - (candidate - 1);
+        }
+      }
+    }
+
+    if(length != 0)
+    {
+      size_t i;
+      addLengthDistance(out, length, distance);
+      if(length <= insertlength)
+      {
+        for(i = 1; i != length && insize - (pos + i) >= 4; ++i) hash->fast[fastHash(&in[pos + i])] = pos + i + 1;
+      }
+      pos += length;
+    }
+    else
+    {
+      if(!uivector_push_back(out, in[pos])) return 83; /*alloc fail*/
+      ++pos;
+    }
+  }
+  return 0;
+}
+
+/*LZ77-encodes the data with the method of the settings*/
+static unsigned encodeLZ77Settings(uivector* out, Hash* hash, const unsigned char* in,
+                                   size_t inpos, size_t insize, const LodePNGCompressSettings* settings)
+{
+  if(hash->fast) return encodeLZ77Fast(out, hash, in, inpos, insize, settings->level);
+  return encodeLZ77(out, hash, in, inpos, insize, settings->windowsize,
+                    settings->minmatch, settings->nicematch, settings->lazymatching);
+}
+
+/*
+sets the settings the compression level of settings stands for, see level in
+LodePNGCompressSettings. Return value is error.
+*/
+static unsigned applyCompressLevel(LodePNGCompressSettings* settings)
+{
+  /*windowsize, nicematch and lazymatching of levels 4 to 9*/
+  static const unsigned LEVELS[6][3] = {{2048, 32, 0}, {2048, 64, 1}, {2048, 128, 1},
+                                        {8192, 128, 1}, {16384, 258, 1}, {32768, 258, 1}};
+  if(settings->level == LODEPNG_LEVEL_SETTINGS) return 0;
+  if(settings->level > 9) return 99;
+  if(settings->level == 0) settings->btype = 0;
+  settings->use_lz77 = 1;
+  settings->minmatch = 3;
+  /*the fast levels have their own matcher, which doesn't use these*/
+  if(settings->level >= 4)
+  {
+    settings->windowsize = LEVELS[settings->level - 4][0];
+    settings->nicematch = LEVELS[settings->level - 4][1];
+    settings->lazymatching = LEVELS[settings->level - 4][2];
+  }
+  return 0;
+}
+
 /* /////////////////////////////////////////////////////////////////////////// */
 
 static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize)
@@ -1656,10 +2651,10 @@ static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, s
     ucvector_push_back(out, (unsigned char)(NLEN / 256));
 
     /*Decompressed data*/
-    for(j = 0; j < 65535 && datapos < datasize; ++j)
-    {
-      ucvector_push_back(out, data[datapos++]);
-    }
+    j = out->size;
+    if(!ucvector_resize(out, j + LEN)) return 83; /*alloc fail*/
+    if(LEN) memcpy(out->data + j, data + datapos, LEN);
+    datapos += LEN;
   }
 
   return 0;
@@ -1760,8 +2755,7 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   {
     if(settings->use_lz77)
     {
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+      error = encodeLZ77Settings(&lz77_encoded, hash, data, datapos, dataend, settings);
       if(error) break;
     }
     else
@@ -1970,8 +2964,7 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   {
     uivector lz77_encoded;
     uivector_init(&lz77_encoded);
-    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                       settings->minmatch, settings->nicematch, settings->lazymatching);
+    error = encodeLZ77Settings(&lz77_encoded, hash, data, datapos, dataend, settings);
     if(!error) writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
     uivector_cleanup(&lz77_encoded);
   }
@@ -1992,17 +2985,19 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   return error;
 }
 
-static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings)
+/*
+Deflates in[inpos..inend] as fixed or dynamic blocks (btype 1 or 2 of the settings). The
+hash may already contain earlier positions of in, matches can refer to those.
+*/
+static unsigned deflateBlocks(ucvector* out, size_t* bp, Hash* hash, const unsigned char* in,
+                              size_t inpos, size_t inend, const LodePNGCompressSettings* settings,
+                              unsigned final)
 {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
-  size_t bp = 0; /*the bit pointer*/
-  Hash hash;
+  size_t insize = inend - inpos;
 
-  if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
-  else if(settings->btype == 1) blocksize = insize;
+  if(settings->btype == 1) blocksize = insize;
   else /*if(settings->btype == 2)*/
   {
     blocksize = insize / 8 + 8;
@@ -2012,20 +3007,42 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   numdeflateblocks = (insize + blocksize - 1) / blocksize;
   if(numdeflateblocks == 0) numdeflateblocks = 1;
 
-  error = hash_init(&hash, settings->windowsize);
-  if(error) return error;
-
   for(i = 0; i != numdeflateblocks && !error; ++i)
   {
-    unsigned final = (i == numdeflateblocks - 1);
-    size_t start = i * blocksize;
+    unsigned last = (i == numdeflateblocks - 1);
+    size_t start = inpos + i * blocksize;
     size_t end = start + blocksize;
-    if(end > insize) end = insize;
+    if(end > inend) end = inend;
 
-    if(settings->btype == 1) error = deflateFixed(out, &bp, &hash, in, start, end, settings, final);
-    else if(settings->btype == 2) error = deflateDynamic(out, &bp, &hash, in, start, end, settings, final);
+    if(settings->btype == 1) error = deflateFixed(out, bp, hash, in, start, end, settings, final && last);
+    else error = deflateDynamic(out, bp, hash, in, start, end, settings, final && last);
   }
 
+  return error;
+}
+
+/*whether the settings, with their level applied, use the matcher of the fast levels*/
+static unsigned useFastMatcher(const LodePNGCompressSettings* settings)
+{
+  return settings->use_lz77 && settings->level >= 1 && settings->level <= 3;
+}
+
+static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
+                                 const LodePNGCompressSettings* settings)
+{
+  unsigned error = 0;
+  size_t bp = 0; /*the bit pointer*/
+  Hash hash;
+  LodePNGCompressSettings leveled = *settings;
+
+  CERROR_TRY_RETURN(applyCompressLevel(&leveled));
+  settings = &leveled;
+  if(settings->btype > 2) return 61;
+  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
+
+  error = hash_init(&hash, settings->windowsize, useFastMatcher(settings));
+  if(!error) error = deflateBlocks(out, &bp, &hash, in, 0, insize, settings, 1);
+
   hash_cleanup(&hash);
 
   return error;
@@ -2064,10 +3081,68 @@ static unsigned deflate(unsigned char** out, size_t* outsize,
 /* / Adler32                                                                  */
 /* ////////////////////////////////////////////////////////////////////////// */
 
+#ifdef LODEPNG_SIMD_X86
+/*
+Adler32 of 32 bytes per step, of len / 32 * 32 bytes. Per step s1 gets the sum of the
+bytes and s2 the bytes multiplied by 32..1 plus 32 times the earlier s1. At most 5536
+bytes are summed before the modulo, the same bound the plain C loop has.
+*/
+static unsigned update_adler32_ssse3(unsigned adler, const unsigned char* data, size_t len) LODEPNG_TARGET("ssse3");
+static unsigned update_adler32_ssse3(unsigned adler, const unsigned char* data, size_t len)
+{
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+  size_t blocks = len / 32;
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+
+  while(blocks > 0)
+  {
+    unsigned n = blocks > 173 ? 173 : (unsigned)blocks;
+    __m128i ps = _mm_cvtsi32_si128((int)(s1 * n)); /*s1 of the earlier blocks, times 32 at the end*/
+    __m128i v1 = zero;
+    __m128i v2 = _mm_cvtsi32_si128((int)s2);
+    blocks -= n;
+    while(n > 0)
+    {
+      __m128i a = _mm_loadu_si128((const __m128i*)data);
+      __m128i b = _mm_loadu_si128((const __m128i*)(data + 16));
+      ps = _mm_add_epi32(ps, v1);
+      v1 = _mm_add_epi32(v1, _mm_sad_epu8(a, zero));
+      v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_maddubs_epi16(a, tap1), ones));
+      v1 = _mm_add_epi32(v1, _mm_sad_epu8(b, zero));
+      v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_maddubs_epi16(b, tap2), ones));
+      data += 32;
+      --n;
+    }
+    v2 = _mm_add_epi32(v2, _mm_slli_epi32(ps, 5));
+    v1 = _mm_add_epi32(v1, _mm_shuffle_epi32(v1, _MM_SHUFFLE(1, 0, 3, 2)));
+    v2 = _mm_add_epi32(v2, _mm_shuffle_epi32(v2, _MM_SHUFFLE(2, 3, 0, 1)));
+    v2 = _mm_add_epi32(v2, _mm_shuffle_epi32(v2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 = (s1 + (unsigned)_mm_cvtsi128_si32(v1)) % 65521;
+    s2 = (unsigned)_mm_cvtsi128_si32(v2) % 65521;
+  }
+  return (s2 << 16) | s1;
+}
+#endif /*LODEPNG_SIMD_X86*/
+
 static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len)
 {
-   unsigned s1 = adler & 0xffff;
-   unsigned s2 = (adler >> 16) & 0xffff;
+  unsigned s1, s2;
+
+#ifdef LODEPNG_SIMD_X86
+  if(len >= 64 && (getCpuFeatures() & CPU_SSSE3))
+  {
+    adler = update_adler32_ssse3(adler, data, len);
+    data += len & ~31u;
+    len &= 31u;
+  }
+#endif /*LODEPNG_SIMD_X86*/
+
+  s1 = adler & 0xffff;
+  s2 = (adler >> 16) & 0xffff;
 
   while(len > 0)
   {
@@ -2099,13 +3174,11 @@ static unsigned adler32(const unsigned char* data, unsigned len)
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                                 size_t insize, const LodePNGDecompressSettings* settings)
+/*checks the 2 bytes of the zlib header, return value is error*/
+static unsigned zlib_checkHeader(const unsigned char* in)
 {
-  unsigned error = 0;
   unsigned CM, CINFO, FDICT;
 
-  if(insize < 2) return 53; /*error, size of zlib data too small*/
   /*read information from zlib header*/
   if((in[0] * 256 + in[1]) % 31 != 0)
   {
@@ -2131,29 +3204,99 @@ unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const uns
     return 26;
   }
 
-  error = inflate(out, outsize, in + 2, insize - 2, settings);
+  return 0;
+}
+
+/*
+appends the decompressed data of the zlib data in the spans to out, which keeps its capacity
+and allocates from out->arena. A custom inflate gets the data as a plain buffer instead.
+*/
+static unsigned zlib_decompressSpans(ucvector* out, const LodePNGSpan* spans, size_t numspans,
+                                     const LodePNGDecompressSettings* settings)
+{
+  unsigned error = 0;
+  size_t start = out->size;
+  size_t insize = spansSize(spans, numspans);
+  unsigned char bytes[4];
+
+  if(insize < 2) return 53; /*error, size of zlib data too small*/
+  spansCopy(bytes, spans, 0, 2);
+  error = zlib_checkHeader(bytes);
+  if(error) return error;
+
+  if(settings->custom_inflate)
+  {
+    const unsigned char* in;
+    ucvector joined;
+    ucvector_init_buffer(&joined, 0, 0);
+    error = spansJoin(&in, &joined, spans, numspans);
+    if(!error) error = settings->custom_inflate(&out->data, &out->size, in + 2, insize - 2, settings);
+    out->allocsize = out->size;
+    lodepng_free(joined.data);
+  }
+  else error = inflateSpans(out, spans, numspans, 2, settings);
   if(error) return error;
 
   if(!settings->ignore_adler32)
   {
-    unsigned ADLER32 = lodepng_read32bitInt(&in[insize - 4]);
-    unsigned checksum = adler32(*out, (unsigned)(*outsize));
+    unsigned ADLER32, checksum;
+    spansCopy(bytes, spans, insize - 4, 4);
+    ADLER32 = lodepng_read32bitInt(bytes);
+    checksum = adler32(&out->data[start], (unsigned)(out->size - start));
     if(checksum != ADLER32) return 58; /*error, adler checksum not correct, data must be corrupted*/
   }
 
   return 0; /*no error*/
 }
 
-static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
+static unsigned zlib_decompressv(ucvector* out, const unsigned char* in,
+                                 size_t insize, const LodePNGDecompressSettings* settings)
+{
+  LodePNGSpan span;
+  span.data = in;
+  span.size = insize;
+  return zlib_decompressSpans(out, &span, 1, settings);
+}
+
+unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                                 size_t insize, const LodePNGDecompressSettings* settings)
+{
+  unsigned error;
+  ucvector v;
+  ucvector_init_buffer(&v, *out, *outsize);
+  v.arena = settings->arena;
+  error = zlib_decompressv(&v, in, insize, settings);
+  *out = v.data;
+  *outsize = v.size;
+  return error;
+}
+
+unsigned lodepng_zlib_decompress_spans(unsigned char** out, size_t* outsize,
+                                       const LodePNGSpan* spans, size_t numspans,
+                                       const LodePNGDecompressSettings* settings)
+{
+  unsigned error;
+  ucvector v;
+  ucvector_init_buffer(&v, *out, *outsize);
+  v.arena = settings->arena;
+  error = zlib_decompressSpans(&v, spans, numspans, settings);
+  *out = v.data;
+  *outsize = v.size;
+  return error;
+}
+
+static unsigned zlib_decompress(ucvector* out, const unsigned char* in,
                                 size_t insize, const LodePNGDecompressSettings* settings)
 {
   if(settings->custom_zlib)
   {
-    return settings->custom_zlib(out, outsize, in, insize, settings);
+    unsigned error = settings->custom_zlib(&out->data, &out->size, in, insize, settings);
+    out->allocsize = out->size;
+    return error;
   }
   else
   {
-    return lodepng_zlib_decompress(out, outsize, in, insize, settings);
+    return zlib_decompressv(out, in, insize, settings);
   }
 }
 
@@ -2161,6 +3304,20 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsi
 
 #ifdef LODEPNG_COMPILE_ENCODER
 
+/*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
+static void addZlibHeader(ucvector* out)
+{
+  unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
+  unsigned FLEVEL = 0;
+  unsigned FDICT = 0;
+  unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
+  unsigned FCHECK = 31 - CMFFLG % 31;
+  CMFFLG += FCHECK;
+
+  ucvector_push_back(out, (unsigned char)(CMFFLG / 256));
+  ucvector_push_back(out, (unsigned char)(CMFFLG % 256));
+}
+
 unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
                                size_t insize, const LodePNGCompressSettings* settings)
 {
@@ -2172,29 +3329,22 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   unsigned char* deflatedata = 0;
   size_t deflatesize = 0;
 
-  /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
-  unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
-  unsigned FLEVEL = 0;
-  unsigned FDICT = 0;
-  unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
-  unsigned FCHECK = 31 - CMFFLG % 31;
-  CMFFLG += FCHECK;
-
   /*ucvector-controlled version of the output buffer, for dynamic array*/
   ucvector_init_buffer(&outv, *out, *outsize);
 
-  ucvector_push_back(&outv, (unsigned char)(CMFFLG / 256));
-  ucvector_push_back(&outv, (unsigned char)(CMFFLG % 256));
+  addZlibHeader(&outv);
 
   error = deflate(&deflatedata, &deflatesize, in, insize, settings);
 
   if(!error)
   {
     unsigned ADLER32 = adler32(in, (unsigned)insize);
-    for(i = 0; i != deflatesize; ++i) ucvector_push_back(&outv, deflatedata[i]);
-    lodepng_free(deflatedata);
-    lodepng_add32bitInt(&outv, ADLER32);
+    i = outv.size;
+    if(!ucvector_resize(&outv, i + deflatesize)) error = 83; /*alloc fail*/
+    else if(deflatesize) memcpy(outv.data + i, deflatedata, deflatesize);
+    if(!error) lodepng_add32bitInt(&outv, ADLER32);
   }
+  lodepng_free(deflatedata);
 
   *out = outv.data;
   *outsize = outv.size;
@@ -2216,16 +3366,221 @@ static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsign
   }
 }
 
+/*only the PNG encoder compresses on threads*/
+#if defined(LODEPNG_PTHREADS) && defined(LODEPNG_COMPILE_PNG)
+#define LODEPNG_THREADED_ENCODE
+/*
+Multithreaded zlib compression, in the way of pigz. The input is split in parts that are
+deflated at the same time. The hash of each part starts with the window before it, so that
+matches can still refer back into the previous part. The bits of the parts are joined into
+one deflate stream, without flush points, and the adler32 checksums of the parts are combined.
+The parts have a fixed size, so the result is the same for any amount of threads above 1.
+*/
+
+/*input bytes per part, and minimum input size for compressing in parallel*/
+#define DEFLATE_PART_SIZE 262144u
+/*maximum amount of threads used*/
+#define DEFLATE_MAX_THREADS 64u
+
+typedef struct DeflatePart
+{
+  ucvector out;
+  size_t bits; /*amount of bits of out that are deflate data*/
+  unsigned adler; /*adler32 of the input of this part*/
+  unsigned error;
+} DeflatePart;
+
+typedef struct ThreadedDeflate
+{
+  pthread_mutex_t mutex;
+  const unsigned char* in;
+  size_t insize;
+  const LodePNGCompressSettings* settings; /*with the level applied*/
+  DeflatePart* parts;
+  size_t numparts;
+  size_t nextpart; /*the next part a thread can deflate*/
+} ThreadedDeflate;
+
+/*
+Adds the positions pos..end-1 of in to the hash, as if they were encoded before, so that
+data after end can be encoded with matches that refer to them.
+*/
+static void hash_prime(Hash* hash, const unsigned char* in, size_t pos, size_t end, unsigned windowsize)
+{
+  unsigned numzeros = 0;
+  if(hash->fast)
+  {
+    for(; pos + 4 <= end; ++pos) hash->fast[fastHash(&in[pos])] = pos + 1;
+    return;
+  }
+  for(; pos < end; ++pos)
+  {
+    unsigned hashval = getHash(in, end, pos);
+    if(hashval == 0)
+    {
+      if(numzeros == 0) numzeros = countZeros(in, end, pos);
+      else if(pos + numzeros > end || in[pos + numzeros - 1] != 0) --numzeros;
+    }
+    else
+    {
+      numzeros = 0;
+    }
+    updateHashChain(hash, pos & (windowsize - 1), hashval, (unsigned short)numzeros);
+  }
+}
+
+static void deflatePart(ThreadedDeflate* d, size_t index)
+{
+  const LodePNGCompressSettings* settings = d->settings;
+  DeflatePart* part = &d->parts[index];
+  size_t start = index * DEFLATE_PART_SIZE;
+  size_t end = d->insize - start < DEFLATE_PART_SIZE ? d->insize : start + DEFLATE_PART_SIZE;
+  unsigned fast = useFastMatcher(settings);
+  size_t window = fast ? 32768 : settings->windowsize;
+  Hash hash;
+
+  part->adler = adler32(&d->in[start], (unsigned)(end - start));
+  part->error = hash_init(&hash, settings->windowsize, fast);
+  if(!part->error)
+  {
+    if(settings->use_lz77) hash_prime(&hash, d->in, start > window ? start - window : 0, start, settings->windowsize);
+    part->error = deflateBlocks(&part->out, &part->bits, &hash, d->in, start, end, settings,
+                                index + 1 == d->numparts);
+  }
+  hash_cleanup(&hash);
+}
+
+static void* deflateThreadMain(void* arg)
+{
+  ThreadedDeflate* d = (ThreadedDeflate*)arg;
+  for(;;)
+  {
+    size_t index;
+    pthread_mutex_lock(&d->mutex);
+    index = d->nextpart++;
+    pthread_mutex_unlock(&d->mutex);
+    if(index >= d->numparts) break;
+    deflatePart(d, index);
+  }
+  return 0;
+}
+
+/*adds the first bits bits of data to the bitstream*/
+static unsigned addBitsOfBytes(size_t* bitpointer, ucvector* bitstream, const unsigned char* data, size_t bits)
+{
+  size_t i;
+  if(((*bitpointer) & 7) == 0)
+  {
+    size_t size = bitstream->size;
+    if(!ucvector_resize(bitstream, size + (bits + 7) / 8)) return 83; /*alloc fail*/
+    if(bits) memcpy(bitstream->data + size, data, (bits + 7) / 8);
+    *bitpointer += bits;
+    return 0;
+  }
+  for(i = 0; i * 8 < bits; ++i) addBitsToStream(bitpointer, bitstream, data[i], bits - i * 8 < 8 ? bits - i * 8 : 8);
+  return 0;
+}
+
+/*the adler32 of the concatenation of two inputs, from their adler32 and the size of the second*/
+static unsigned adler32Combine(unsigned adler1, unsigned adler2, size_t size2)
+{
+  unsigned rem = (unsigned)(size2 % 65521);
+  unsigned s1 = adler1 & 0xffff;
+  unsigned s2 = (rem * s1) % 65521;
+  s1 += (adler2 & 0xffff) + 65521 - 1;
+  s2 += (adler1 >> 16) + (adler2 >> 16) + 65521 - rem;
+  if(s1 >= 65521) s1 -= 65521;
+  if(s1 >= 65521) s1 -= 65521;
+  if(s2 >= 65521 * 2) s2 -= 65521 * 2;
+  if(s2 >= 65521) s2 -= 65521;
+  return (s2 << 16) | s1;
+}
+
+/*
+Like lodepng_zlib_compress, with up to threads threads. Inputs of one part, and settings
+that store the data uncompressed, are compressed on the calling thread only.
+*/
+static unsigned zlib_compressThreaded(unsigned char** out, size_t* outsize, const unsigned char* in,
+                                      size_t insize, const LodePNGCompressSettings* settings, unsigned threads)
+{
+  ThreadedDeflate d;
+  LodePNGCompressSettings leveled = *settings;
+  pthread_t workers[DEFLATE_MAX_THREADS];
+  unsigned started = 0, error = 0, adler = 1;
+  size_t i, bp = 0;
+  ucvector outv;
+
+  CERROR_TRY_RETURN(applyCompressLevel(&leveled));
+  if(threads <= 1 || insize <= DEFLATE_PART_SIZE || leveled.btype == 0 || leveled.btype > 2)
+  {
+    return lodepng_zlib_compress(out, outsize, in, insize, settings);
+  }
+  if(leveled.use_lz77 && !useFastMatcher(&leveled))
+  {
+    /*the window is checked here since the hash is primed before the LZ77 encoder checks it*/
+    if(leveled.windowsize == 0 || leveled.windowsize > 32768) return 60;
+    if((leveled.windowsize & (leveled.windowsize - 1)) != 0) return 90;
+  }
+
+  d.in = in;
+  d.insize = insize;
+  d.settings = &leveled;
+  d.numparts = (insize + DEFLATE_PART_SIZE - 1) / DEFLATE_PART_SIZE;
+  d.nextpart = 0;
+  d.parts = (DeflatePart*)lodepng_malloc(d.numparts * sizeof(DeflatePart));
+  if(!d.parts) return 83; /*alloc fail*/
+  for(i = 0; i != d.numparts; ++i)
+  {
+    ucvector_init_buffer(&d.parts[i].out, 0, 0);
+    d.parts[i].bits = 0;
+    d.parts[i].error = 0;
+  }
+  if(threads > DEFLATE_MAX_THREADS) threads = DEFLATE_MAX_THREADS;
+  if(threads > d.numparts) threads = (unsigned)d.numparts;
+
+  pthread_mutex_init(&d.mutex, 0);
+  for(; started + 1 < threads; ++started)
+  {
+    if(pthread_create(&workers[started], 0, deflateThreadMain, &d)) break;
+  }
+  deflateThreadMain(&d);
+  for(i = 0; i != started; ++i) pthread_join(workers[i], 0);
+  pthread_mutex_destroy(&d.mutex);
+
+  ucvector_init_buffer(&outv, *out, *outsize);
+  addZlibHeader(&outv);
+  for(i = 0; i != d.numparts; ++i)
+  {
+    DeflatePart* part = &d.parts[i];
+    size_t partsize = d.insize - i * DEFLATE_PART_SIZE < DEFLATE_PART_SIZE ? d.insize - i * DEFLATE_PART_SIZE : DEFLATE_PART_SIZE;
+    if(!error) error = part->error;
+    if(!error) error = addBitsOfBytes(&bp, &outv, part->out.data, part->bits);
+    adler = adler32Combine(adler, part->adler, partsize);
+    lodepng_free(part->out.data);
+  }
+  lodepng_free(d.parts);
+  if(!error) lodepng_add32bitInt(&outv, adler);
+
+  *out = outv.data;
+  *outsize = outv.size;
+
+  return error;
+}
+#endif /*defined(LODEPNG_PTHREADS) && defined(LODEPNG_COMPILE_PNG)*/
+
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #else /*no LODEPNG_COMPILE_ZLIB*/
 
 #ifdef LODEPNG_COMPILE_DECODER
-static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
+static unsigned zlib_decompress(ucvector* out, const unsigned char* in,
                                 size_t insize, const LodePNGDecompressSettings* settings)
 {
+  unsigned error;
   if (!settings->custom_zlib) return 87; /*no custom zlib function provided */
-  return settings->custom_zlib(out, outsize, in, insize, settings);
+  error = settings->custom_zlib(&out->data, &out->size, in, insize, settings);
+  out->allocsize = out->size;
+  return error;
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -2255,13 +3610,15 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings)
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->level = LODEPNG_LEVEL_SETTINGS;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1,
+                                                                   LODEPNG_LEVEL_SETTINGS, 0, 0, 0};
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2275,9 +3632,10 @@ void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings)
   settings->custom_zlib = 0;
   settings->custom_inflate = 0;
   settings->custom_context = 0;
+  settings->arena = 0;
 }
 
-const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0, 0};
+const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0, 0, 0};
 
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -2294,54 +3652,425 @@ const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0,
 /* ////////////////////////////////////////////////////////////////////////// */
 
 /* CRC polynomial: 0xedb88320 */
-static unsigned lodepng_crc32_table[256] = {
-           0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u, 3915621685u, 2657392035u,
-   249268274u, 2044508324u, 3772115230u, 2547177864u,  162941995u, 2125561021u, 3887607047u, 2428444049u,
-   498536548u, 1789927666u, 4089016648u, 2227061214u,  450548861u, 1843258603u, 4107580753u, 2211677639u,
-   325883990u, 1684777152u, 4251122042u, 2321926636u,  335633487u, 1661365465u, 4195302755u, 2366115317u,
-   997073096u, 1281953886u, 3579855332u, 2724688242u, 1006888145u, 1258607687u, 3524101629u, 2768942443u,
-   901097722u, 1119000684u, 3686517206u, 2898065728u,  853044451u, 1172266101u, 3705015759u, 2882616665u,
-   651767980u, 1373503546u, 3369554304u, 3218104598u,  565507253u, 1454621731u, 3485111705u, 3099436303u,
-   671266974u, 1594198024u, 3322730930u, 2970347812u,  795835527u, 1483230225u, 3244367275u, 3060149565u,
-  1994146192u,   31158534u, 2563907772u, 4023717930u, 1907459465u,  112637215u, 2680153253u, 3904427059u,
-  2013776290u,  251722036u, 2517215374u, 3775830040u, 2137656763u,  141376813u, 2439277719u, 3865271297u,
-  1802195444u,  476864866u, 2238001368u, 4066508878u, 1812370925u,  453092731u, 2181625025u, 4111451223u,
-  1706088902u,  314042704u, 2344532202u, 4240017532u, 1658658271u,  366619977u, 2362670323u, 4224994405u,
-  1303535960u,  984961486u, 2747007092u, 3569037538u, 1256170817u, 1037604311u, 2765210733u, 3554079995u,
-  1131014506u,  879679996u, 2909243462u, 3663771856u, 1141124467u,  855842277u, 2852801631u, 3708648649u,
-  1342533948u,  654459306u, 3188396048u, 3373015174u, 1466479909u,  544179635u, 3110523913u, 3462522015u,
-  1591671054u,  702138776u, 2966460450u, 3352799412u, 1504918807u,  783551873u, 3082640443u, 3233442989u,
-  3988292384u, 2596254646u,   62317068u, 1957810842u, 3939845945u, 2647816111u,   81470997u, 1943803523u,
-  3814918930u, 2489596804u,  225274430u, 2053790376u, 3826175755u, 2466906013u,  167816743u, 2097651377u,
-  4027552580u, 2265490386u,  503444072u, 1762050814u, 4150417245u, 2154129355u,  426522225u, 1852507879u,
-  4275313526u, 2312317920u,  282753626u, 1742555852u, 4189708143u, 2394877945u,  397917763u, 1622183637u,
-  3604390888u, 2714866558u,  953729732u, 1340076626u, 3518719985u, 2797360999u, 1068828381u, 1219638859u,
-  3624741850u, 2936675148u,  906185462u, 1090812512u, 3747672003u, 2825379669u,  829329135u, 1181335161u,
-  3412177804u, 3160834842u,  628085408u, 1382605366u, 3423369109u, 3138078467u,  570562233u, 1426400815u,
-  3317316542u, 2998733608u,  733239954u, 1555261956u, 3268935591u, 3050360625u,  752459403u, 1541320221u,
-  2607071920u, 3965973030u, 1969922972u,   40735498u, 2617837225u, 3943577151u, 1913087877u,   83908371u,
-  2512341634u, 3803740692u, 2075208622u,  213261112u, 2463272603u, 3855990285u, 2094854071u,  198958881u,
-  2262029012u, 4057260610u, 1759359992u,  534414190u, 2176718541u, 4139329115u, 1873836001u,  414664567u,
-  2282248934u, 4279200368u, 1711684554u,  285281116u, 2405801727u, 4167216745u, 1634467795u,  376229701u,
-  2685067896u, 3608007406u, 1308918612u,  956543938u, 2808555105u, 3495958263u, 1231636301u, 1047427035u,
-  2932959818u, 3654703836u, 1088359270u,  936918000u, 2847714899u, 3736837829u, 1202900863u,  817233897u,
-  3183342108u, 3401237130u, 1404277552u,  615818150u, 3134207493u, 3453421203u, 1423857449u,  601450431u,
-  3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
+/*
+lodepng_crc32_table[k][b] is the CRC of byte b followed by k zero bytes. Only the
+first table is needed to go byte per byte, all 8 to go 8 bytes per step (slice-by-8).
+*/
+static const unsigned lodepng_crc32_table[8][256] = {
+  {
+             0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u, 3915621685u, 2657392035u,
+     249268274u, 2044508324u, 3772115230u, 2547177864u,  162941995u, 2125561021u, 3887607047u, 2428444049u,
+     498536548u, 1789927666u, 4089016648u, 2227061214u,  450548861u, 1843258603u, 4107580753u, 2211677639u,
+     325883990u, 1684777152u, 4251122042u, 2321926636u,  335633487u, 1661365465u, 4195302755u, 2366115317u,
+     997073096u, 1281953886u, 3579855332u, 2724688242u, 1006888145u, 1258607687u, 3524101629u, 2768942443u,
+     901097722u, 1119000684u, 3686517206u, 2898065728u,  853044451u, 1172266101u, 3705015759u, 2882616665u,
+     651767980u, 1373503546u, 3369554304u, 3218104598u,  565507253u, 1454621731u, 3485111705u, 3099436303u,
+     671266974u, 1594198024u, 3322730930u, 2970347812u,  795835527u, 1483230225u, 3244367275u, 3060149565u,
+    1994146192u,   31158534u, 2563907772u, 4023717930u, 1907459465u,  112637215u, 2680153253u, 3904427059u,
+    2013776290u,  251722036u, 2517215374u, 3775830040u, 2137656763u,  141376813u, 2439277719u, 3865271297u,
+    1802195444u,  476864866u, 2238001368u, 4066508878u, 1812370925u,  453092731u, 2181625025u, 4111451223u,
+    1706088902u,  314042704u, 2344532202u, 4240017532u, 1658658271u,  366619977u, 2362670323u, 4224994405u,
+    1303535960u,  984961486u, 2747007092u, 3569037538u, 1256170817u, 1037604311u, 2765210733u, 3554079995u,
+    1131014506u,  879679996u, 2909243462u, 3663771856u, 1141124467u,  855842277u, 2852801631u, 3708648649u,
+    1342533948u,  654459306u, 3188396048u, 3373015174u, 1466479909u,  544179635u, 3110523913u, 3462522015u,
+    1591671054u,  702138776u, 2966460450u, 3352799412u, 1504918807u,  783551873u, 3082640443u, 3233442989u,
+    3988292384u, 2596254646u,   62317068u, 1957810842u, 3939845945u, 2647816111u,   81470997u, 1943803523u,
+    3814918930u, 2489596804u,  225274430u, 2053790376u, 3826175755u, 2466906013u,  167816743u, 2097651377u,
+    4027552580u, 2265490386u,  503444072u, 1762050814u, 4150417245u, 2154129355u,  426522225u, 1852507879u,
+    4275313526u, 2312317920u,  282753626u, 1742555852u, 4189708143u, 2394877945u,  397917763u, 1622183637u,
+    3604390888u, 2714866558u,  953729732u, 1340076626u, 3518719985u, 2797360999u, 1068828381u, 1219638859u,
+    3624741850u, 2936675148u,  906185462u, 1090812512u, 3747672003u, 2825379669u,  829329135u, 1181335161u,
+    3412177804u, 3160834842u,  628085408u, 1382605366u, 3423369109u, 3138078467u,  570562233u, 1426400815u,
+    3317316542u, 2998733608u,  733239954u, 1555261956u, 3268935591u, 3050360625u,  752459403u, 1541320221u,
+    2607071920u, 3965973030u, 1969922972u,   40735498u, 2617837225u, 3943577151u, 1913087877u,   83908371u,
+    2512341634u, 3803740692u, 2075208622u,  213261112u, 2463272603u, 3855990285u, 2094854071u,  198958881u,
+    2262029012u, 4057260610u, 1759359992u,  534414190u, 2176718541u, 4139329115u, 1873836001u,  414664567u,
+    2282248934u, 4279200368u, 1711684554u,  285281116u, 2405801727u, 4167216745u, 1634467795u,  376229701u,
+    2685067896u, 3608007406u, 1308918612u,  956543938u, 2808555105u, 3495958263u, 1231636301u, 1047427035u,
+    2932959818u, 3654703836u, 1088359270u,  936918000u, 2847714899u, 3736837829u, 1202900863u,  817233897u,
+    3183342108u, 3401237130u, 1404277552u,  615818150u, 3134207493u, 3453421203u, 1423857449u,  601450431u,
+    3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
+  },
+  {
+             0u,  421212481u,  842424962u,  724390851u, 1684849924u, 2105013317u, 1448781702u, 1329698503u,
+    3369699848u, 3519200073u, 4210026634u, 3824474571u, 2897563404u, 3048111693u, 2659397006u, 2274893007u,
+    1254232657u, 1406739216u, 2029285587u, 1643069842u,  783210325u,  934667796u,  479770071u,   92505238u,
+    2182846553u, 2600511768u, 2955803355u, 2838940570u, 3866582365u, 4285295644u, 3561045983u, 3445231262u,
+    2508465314u, 2359236067u, 2813478432u, 3198777185u, 4058571174u, 3908292839u, 3286139684u, 3670389349u,
+    1566420650u, 1145479147u, 1869335592u, 1987116393u,  959540142u,  539646703u,  185010476u,  303839341u,
+    3745920755u, 3327985586u, 3983561841u, 4100678960u, 3140154359u, 2721170102u, 2300350837u, 2416418868u,
+     396344571u,  243568058u,  631889529u, 1018359608u, 1945336319u, 1793607870u, 1103436669u, 1490954812u,
+    4034481925u, 3915546180u, 3259968903u, 3679722694u, 2484439553u, 2366552896u, 2787371139u, 3208174018u,
+     950060301u,  565965900u,  177645455u,  328046286u, 1556873225u, 1171730760u, 1861902987u, 2011255754u,
+    3132841300u, 2745199637u, 2290958294u, 2442530455u, 3738671184u, 3352078609u, 3974232786u, 4126854035u,
+    1919080284u, 1803150877u, 1079293406u, 1498383519u,  370020952u,  253043481u,  607678682u, 1025720731u,
+    1711106983u, 2095471334u, 1472923941u, 1322268772u,   26324643u,  411738082u,  866634785u,  717028704u,
+    2904875439u, 3024081134u, 2668790573u, 2248782444u, 3376948395u, 3495106026u, 4219356713u, 3798300520u,
+     792689142u,  908347575u,  487136116u,   68299317u, 1263779058u, 1380486579u, 2036719216u, 1618931505u,
+    3890672638u, 4278043327u, 3587215740u, 3435896893u, 2206873338u, 2593195963u, 2981909624u, 2829542713u,
+     998479947u,  580430090u,  162921161u,  279890824u, 1609522511u, 1190423566u, 1842954189u, 1958874764u,
+    4082766403u, 3930137346u, 3245109441u, 3631694208u, 2536953671u, 2385372678u, 2768287173u, 3155920004u,
+    1900120602u, 1750776667u, 1131931800u, 1517083097u,  355290910u,  204897887u,  656092572u, 1040194781u,
+    3113746450u, 2692952403u, 2343461520u, 2461357009u, 3723805974u, 3304059991u, 4022511508u, 4141455061u,
+    2919742697u, 3072101800u, 2620513899u, 2234183466u, 3396041197u, 3547351212u, 4166851439u, 3779471918u,
+    1725839073u, 2143618976u, 1424512099u, 1307796770u,   45282277u,  464110244u,  813994343u,  698327078u,
+    3838160568u, 4259225593u, 3606301754u, 3488152955u, 2158586812u, 2578602749u, 2996767038u, 2877569151u,
+     740041904u,  889656817u,  506086962u,  120682355u, 1215357364u, 1366020341u, 2051441462u, 1667084919u,
+    3422213966u, 3538019855u, 4190942668u, 3772220557u, 2945847882u, 3062702859u, 2644537544u, 2226864521u,
+      52649286u,  439905287u,  823476164u,  672009861u, 1733269570u, 2119477507u, 1434057408u, 1281543041u,
+    2167981343u, 2552493150u, 3004082077u, 2853541596u, 3847487515u, 4233048410u, 3613549209u, 3464057816u,
+    1239502615u, 1358593622u, 2077699477u, 1657543892u,  764250643u,  882293586u,  532408465u,  111204816u,
+    1585378284u, 1197851309u, 1816695150u, 1968414767u,  974272232u,  587794345u,  136598634u,  289367339u,
+    2527558116u, 2411481253u, 2760973158u, 3179948583u, 4073438432u, 3956313505u, 3237863010u, 3655790371u,
+     347922877u,  229101820u,  646611775u, 1066513022u, 1892689081u, 1774917112u, 1122387515u, 1543337850u,
+    3697634229u, 3313392372u, 3998419255u, 4148705398u, 3087642289u, 2702352368u, 2319436851u, 2468674930u
+  },
+  {
+             0u,   29518391u,   59036782u,   38190681u,  118073564u,  114017003u,   76381362u,   89069189u,
+     236147128u,  265370511u,  228034006u,  206958561u,  152762724u,  148411219u,  178138378u,  190596925u,
+     472294256u,  501532999u,  530741022u,  509615401u,  456068012u,  451764635u,  413917122u,  426358261u,
+     305525448u,  334993663u,  296822438u,  275991697u,  356276756u,  352202787u,  381193850u,  393929805u,
+     944588512u,  965684439u, 1003065998u,  973863097u, 1061482044u, 1049003019u, 1019230802u, 1023561829u,
+     912136024u,  933002607u,  903529270u,  874031361u,  827834244u,  815125939u,  852716522u,  856752605u,
+     611050896u,  631869351u,  669987326u,  640506825u,  593644876u,  580921211u,  551983394u,  556069653u,
+     712553512u,  733666847u,  704405574u,  675154545u,  762387700u,  749958851u,  787859610u,  792175277u,
+    1889177024u, 1901651959u, 1931368878u, 1927033753u, 2006131996u, 1985040171u, 1947726194u, 1976933189u,
+    2122964088u, 2135668303u, 2098006038u, 2093965857u, 2038461604u, 2017599123u, 2047123658u, 2076625661u,
+    1824272048u, 1836991623u, 1866005214u, 1861914857u, 1807058540u, 1786244187u, 1748062722u, 1777547317u,
+    1655668488u, 1668093247u, 1630251878u, 1625932113u, 1705433044u, 1684323811u, 1713505210u, 1742760333u,
+    1222101792u, 1226154263u, 1263738702u, 1251046777u, 1339974652u, 1310460363u, 1281013650u, 1301863845u,
+    1187289752u, 1191637167u, 1161842422u, 1149379777u, 1103966788u, 1074747507u, 1112139306u, 1133218845u,
+    1425107024u, 1429406311u, 1467333694u, 1454888457u, 1408811148u, 1379576507u, 1350309090u, 1371438805u,
+    1524775400u, 1528845279u, 1499917702u, 1487177649u, 1575719220u, 1546255107u, 1584350554u, 1605185389u,
+    3778354048u, 3774312887u, 3803303918u, 3816007129u, 3862737756u, 3892238699u, 3854067506u, 3833203973u,
+    4012263992u, 4007927823u, 3970080342u, 3982554209u, 3895452388u, 3924658387u, 3953866378u, 3932773565u,
+    4245928176u, 4241609415u, 4271336606u, 4283762345u, 4196012076u, 4225268251u, 4187931714u, 4166823541u,
+    4076923208u, 4072833919u, 4035198246u, 4047918865u, 4094247316u, 4123732899u, 4153251322u, 4132437965u,
+    3648544096u, 3636082519u, 3673983246u, 3678331705u, 3732010428u, 3753090955u, 3723829714u, 3694611429u,
+    3614117080u, 3601426159u, 3572488374u, 3576541825u, 3496125444u, 3516976691u, 3555094634u, 3525581405u,
+    3311336976u, 3298595879u, 3336186494u, 3340255305u, 3260503756u, 3281337595u, 3251864226u, 3222399125u,
+    3410866088u, 3398419871u, 3368647622u, 3372945905u, 3427010420u, 3448139075u, 3485520666u, 3456284973u,
+    2444203584u, 2423127159u, 2452308526u, 2481530905u, 2527477404u, 2539934891u, 2502093554u, 2497740997u,
+    2679949304u, 2659102159u, 2620920726u, 2650438049u, 2562027300u, 2574714131u, 2603727690u, 2599670141u,
+    2374579504u, 2353749767u, 2383274334u, 2412743529u, 2323684844u, 2336421851u, 2298759554u, 2294686645u,
+    2207933576u, 2186809023u, 2149495014u, 2178734801u, 2224278612u, 2236720739u, 2266437690u, 2262135309u,
+    2850214048u, 2820717207u, 2858812622u, 2879680249u, 2934667388u, 2938704459u, 2909776914u, 2897069605u,
+    2817622296u, 2788420399u, 2759153014u, 2780249921u, 2700618180u, 2704950259u, 2742877610u, 2730399645u,
+    3049550800u, 3020298727u, 3057690558u, 3078802825u, 2999835404u, 3004150075u, 2974355298u, 2961925461u,
+    3151438440u, 3121956959u, 3092510214u, 3113327665u, 3168701108u, 3172786307u, 3210370778u, 3197646061u
+  },
+  {
+             0u, 3099354981u, 2852767883u,  313896942u, 2405603159u,  937357362u,  627793884u, 2648127673u,
+    3316918511u, 2097696650u, 1874714724u, 3607201537u, 1255587768u, 4067088605u, 3772741427u, 1482887254u,
+    1343838111u, 3903140090u, 4195393300u, 1118632049u, 3749429448u, 1741137837u, 1970407491u, 3452858150u,
+    2511175536u,  756094997u, 1067759611u, 2266550430u,  449832999u, 2725482306u, 2965774508u,  142231497u,
+    2687676222u,  412010587u,  171665333u, 2995192016u,  793786473u, 2548850444u, 2237264098u, 1038456711u,
+    1703315409u, 3711623348u, 3482275674u, 1999841343u, 3940814982u, 1381529571u, 1089329165u, 4166106984u,
+    4029413537u, 1217896388u, 1512189994u, 3802027855u, 2135519222u, 3354724499u, 3577784189u, 1845280792u,
+     899665998u, 2367928107u, 2677414085u,  657096608u, 3137160985u,   37822588u,  284462994u, 2823350519u,
+    2601801789u,  598228824u,  824021174u, 2309093331u,  343330666u, 2898962447u, 3195996129u,  113467524u,
+    1587572946u, 3860600759u, 4104763481u, 1276501820u, 3519211397u, 1769898208u, 2076913422u, 3279374443u,
+    3406630818u, 1941006535u, 1627703081u, 3652755532u, 1148164341u, 4241751952u, 3999682686u, 1457141531u,
+     247015245u, 3053797416u, 2763059142u,  470583459u, 2178658330u,  963106687u,  735213713u, 2473467892u,
+     992409347u, 2207944806u, 2435792776u,  697522413u, 3024379988u,  217581361u,  508405983u, 2800865210u,
+    4271038444u, 1177467017u, 1419450215u, 3962007554u, 1911572667u, 3377213406u, 3690561584u, 1665525589u,
+    1799331996u, 3548628985u, 3241568279u, 2039091058u, 3831314379u, 1558270126u, 1314193216u, 4142438437u,
+    2928380019u,  372764438u,   75645176u, 3158189981u,  568925988u, 2572515393u, 2346768303u,  861712586u,
+    3982079547u, 1441124702u, 1196457648u, 4293663189u, 1648042348u, 3666298377u, 3358779879u, 1888390786u,
+     686661332u, 2421291441u, 2196002399u,  978858298u, 2811169155u,  523464422u,  226935048u, 3040519789u,
+    3175145892u,  100435649u,  390670639u, 2952089162u,  841119475u, 2325614998u, 2553003640u,  546822429u,
+    2029308235u, 3225988654u, 3539796416u, 1782671013u, 4153826844u, 1328167289u, 1570739863u, 3844338162u,
+    1298864389u, 4124540512u, 3882013070u, 1608431339u, 3255406162u, 2058742071u, 1744848601u, 3501990332u,
+    2296328682u,  811816591u,  584513889u, 2590678532u,  129869501u, 3204563416u, 2914283062u,  352848211u,
+     494030490u, 2781751807u, 3078325777u,  264757620u, 2450577869u,  715964072u,  941166918u, 2158327331u,
+    3636881013u, 1618608400u, 1926213374u, 3396585883u, 1470427426u, 4011365959u, 4255988137u, 1158766284u,
+    1984818694u, 3471935843u, 3695453837u, 1693991400u, 4180638033u, 1100160564u, 1395044826u, 3952793279u,
+    3019491049u,  189112716u,  435162722u, 2706139399u, 1016811966u, 2217162459u, 2526189877u,  774831696u,
+     643086745u, 2666061564u, 2354934034u,  887166583u, 2838900430u,  294275499u,   54519365u, 3145957664u,
+    3823145334u, 1532818963u, 1240029693u, 4048895640u, 1820460577u, 3560857924u, 3331051178u, 2117577167u,
+    3598663992u, 1858283101u, 2088143283u, 3301633750u, 1495127663u, 3785470218u, 4078182116u, 1269332353u,
+     332098007u, 2876706482u, 3116540252u,   25085497u, 2628386432u,  605395429u,  916469259u, 2384220526u,
+    2254837415u, 1054503362u,  745528876u, 2496903497u,  151290352u, 2981684885u, 2735556987u,  464596510u,
+    1137851976u, 4218313005u, 3923506883u, 1365741990u, 3434129695u, 1946996346u, 1723425172u, 3724871409u
+  },
+  {
+             0u, 1029712304u, 2059424608u, 1201699536u, 4118849216u, 3370159984u, 2403399072u, 2988497936u,
+     812665793u,  219177585u, 1253054625u, 2010132753u, 3320900865u, 4170237105u, 3207642721u, 2186319825u,
+    1625331586u, 1568718386u,  438355170u,  658566482u, 2506109250u, 2818578674u, 4020265506u, 3535817618u,
+    1351670851u, 1844508147u,  709922595u,  389064339u, 2769320579u, 2557498163u, 3754961379u, 3803185235u,
+    3250663172u, 4238411444u, 3137436772u, 2254525908u,  876710340u,  153198708u, 1317132964u, 1944187668u,
+    4054934725u, 3436268917u, 2339452837u, 3054575125u,   70369797u,  961670069u, 2129760613u, 1133623509u,
+    2703341702u, 2621542710u, 3689016294u, 3867263574u, 1419845190u, 1774270454u,  778128678u,  318858390u,
+    2438067015u, 2888948471u, 3952189479u, 3606153623u, 1691440519u, 1504803895u,  504432359u,  594620247u,
+    1492342857u, 1704161785u,  573770537u,  525542041u, 2910060169u, 2417219385u, 3618876905u, 3939730521u,
+    1753420680u, 1440954936u,  306397416u,  790849880u, 2634265928u, 2690882808u, 3888375336u, 3668168600u,
+     940822475u,   91481723u, 1121164459u, 2142483739u, 3448989963u, 4042473659u, 3075684971u, 2318603227u,
+     140739594u,  889433530u, 1923340138u, 1338244826u, 4259521226u, 3229813626u, 2267247018u, 3124975642u,
+    2570221389u, 2756861693u, 3824297005u, 3734113693u, 1823658381u, 1372780605u,  376603373u,  722643805u,
+    2839690380u, 2485261628u, 3548540908u, 4007806556u, 1556257356u, 1638052860u,  637716780u,  459464860u,
+    4191346895u, 3300051327u, 2199040943u, 3195181599u,  206718479u,  825388991u, 1989285231u, 1274166495u,
+    3382881038u, 4106388158u, 3009607790u, 2382549470u, 1008864718u,   21111934u, 1189240494u, 2072147742u,
+    2984685714u, 2357631266u, 3408323570u, 4131834434u, 1147541074u, 2030452706u, 1051084082u,   63335554u,
+    2174155603u, 3170292451u, 4216760371u, 3325460867u, 1947622803u, 1232499747u,  248909555u,  867575619u,
+    3506841360u, 3966111392u, 2881909872u, 2527485376u,  612794832u,  434546784u, 1581699760u, 1663499008u,
+    3782634705u, 3692447073u, 2612412337u, 2799048193u,  351717905u,  697754529u, 1849071985u, 1398190273u,
+    1881644950u, 1296545318u,  182963446u,  931652934u, 2242328918u, 3100053734u, 4284967478u, 3255255942u,
+    1079497815u, 2100821479u,  983009079u,  133672583u, 3050795671u, 2293717799u, 3474399735u, 4067887175u,
+     281479188u,  765927844u, 1778867060u, 1466397380u, 3846680276u, 3626469220u, 2676489652u, 2733102084u,
+     548881365u,  500656741u, 1517752501u, 1729575173u, 3577210133u, 3898068133u, 2952246901u, 2459410373u,
+    3910527195u, 3564487019u, 2480257979u, 2931134987u,  479546907u,  569730987u, 1716854139u, 1530213579u,
+    3647316762u, 3825568426u, 2745561210u, 2663766474u,  753206746u,  293940330u, 1445287610u, 1799716618u,
+    2314567513u, 3029685993u, 4080348217u, 3461678473u, 2088098201u, 1091956777u,  112560889u, 1003856713u,
+    3112514712u, 2229607720u, 3276105720u, 4263857736u, 1275433560u, 1902492648u,  918929720u,  195422344u,
+     685033439u,  364179055u, 1377080511u, 1869921551u, 3713294623u, 3761522863u, 2811507327u, 2599689167u,
+     413436958u,  633644462u, 1650777982u, 1594160846u, 3978570462u, 3494118254u, 2548332990u, 2860797966u,
+    1211387997u, 1968470509u,  854852413u,  261368461u, 3182753437u, 2161434413u, 3346310653u, 4195650637u,
+    2017729436u, 1160000044u,   42223868u, 1071931724u, 2378480988u, 2963576044u, 4144295484u, 3395602316u
+  },
+  {
+             0u, 3411858341u, 1304994059u, 2257875630u, 2609988118u, 1355649459u, 3596215069u,  486879416u,
+    3964895853u,  655315400u, 2711298918u, 1791488195u, 2009251963u, 3164476382u,  973758832u, 4048990933u,
+      64357019u, 3364540734u, 1310630800u, 2235723829u, 2554806413u, 1394316072u, 3582976390u,  517157411u,
+    4018503926u,  618222419u, 2722963965u, 1762783832u, 1947517664u, 3209171269u,  970744811u, 4068520014u,
+     128714038u, 3438335635u, 1248109629u, 2167961496u, 2621261600u, 1466012805u, 3522553387u,  447296910u,
+    3959392091u,  547575038u, 2788632144u, 1835791861u, 1886307661u, 3140622056u, 1034314822u, 4143626211u,
+      75106221u, 3475428360u, 1236444838u, 2196665603u, 2682996155u, 1421317662u, 3525567664u,  427767573u,
+    3895035328u,  594892389u, 2782995659u, 1857943406u, 1941489622u, 3101955187u, 1047553757u, 4113347960u,
+     257428076u, 3288652233u, 1116777319u, 2311878850u, 2496219258u, 1603640287u, 3640781169u,  308099796u,
+    3809183745u,  676813732u, 2932025610u, 1704983215u, 2023410199u, 3016104370u,  894593820u, 4262377657u,
+     210634999u, 3352484690u, 1095150076u, 2316991065u, 2535410401u, 1547934020u, 3671583722u,  294336591u,
+    3772615322u,  729897279u, 2903845777u, 1716123700u, 2068629644u, 2953845545u,  914647431u, 4258839074u,
+     150212442u, 3282623743u, 1161604689u, 2388688372u, 2472889676u, 1480171241u, 3735940167u,  368132066u,
+    3836185911u,  805002898u, 2842635324u, 1647574937u, 2134298401u, 3026852996u,  855535146u, 4188192143u,
+     186781121u, 3229539940u, 1189784778u, 2377547631u, 2427670487u, 1542429810u, 3715886812u,  371670393u,
+    3882979244u,  741170185u, 2864262823u, 1642462466u, 2095107514u, 3082559007u,  824732849u, 4201955092u,
+     514856152u, 3589064573u, 1400419795u, 2552522358u, 2233554638u, 1316849003u, 3370776517u,   62202976u,
+    4075001525u,  968836368u, 3207280574u, 1954014235u, 1769133219u, 2720925446u,  616199592u, 4024870413u,
+     493229635u, 3594175974u, 1353627464u, 2616354029u, 2264355925u, 1303087088u, 3409966430u,    6498043u,
+    4046820398u,  979978123u, 3170710821u, 2007099008u, 1789187640u, 2717386141u,  661419827u, 3962610838u,
+     421269998u, 3527459403u, 1423225061u, 2676515648u, 2190300152u, 1238466653u, 3477467891u,   68755798u,
+    4115633027u, 1041448998u, 3095868040u, 1943789869u, 1860096405u, 2776760880u,  588673182u, 3897205563u,
+     449450869u, 3516317904u, 1459794558u, 2623431131u, 2170245475u, 1242006214u, 3432247400u,  131015629u,
+    4137259288u, 1036337853u, 3142660115u, 1879958454u, 1829294862u, 2790523051u,  549483013u, 3952910752u,
+     300424884u, 3669282065u, 1545650111u, 2541513754u, 2323209378u, 1092980487u, 3350330793u,  216870412u,
+    4256931033u,  921128828u, 2960342482u, 2066738807u, 1714085583u, 2910195050u,  736264132u, 3770592353u,
+     306060335u, 3647131530u, 1610005796u, 2494197377u, 2309971513u, 1123257756u, 3295149874u,  255536279u,
+    4268596802u,  892423655u, 3013951305u, 2029645036u, 1711070292u, 2929725425u,  674528607u, 3815288570u,
+     373562242u, 3709388839u, 1535949449u, 2429577516u, 2379569556u, 1183418929u, 3223189663u,  188820282u,
+    4195850735u,  827017802u, 3084859620u, 2089020225u, 1636228089u, 2866415708u,  743340786u, 3876759895u,
+     361896217u, 3738094268u, 1482340370u, 2466671543u, 2382584591u, 1163888810u, 3284924932u,  144124321u,
+    4190215028u,  849168593u, 3020503679u, 2136336858u, 1649465698u, 2836138695u,  798521449u, 3838094284u
+  },
+  {
+             0u, 2792819636u, 2543784233u,  837294749u, 4098827283u, 1379413927u, 1674589498u, 3316072078u,
+     871321191u, 2509784531u, 2758827854u,   34034938u, 3349178996u, 1641505216u, 1346337629u, 4131942633u,
+    1742642382u, 3249117050u, 4030828007u, 1446413907u, 2475800797u,  904311657u,   68069876u, 2725880384u,
+    1412551337u, 4064729373u, 3283010432u, 1708771380u, 2692675258u,  101317902u,  937551763u, 2442587175u,
+    3485284764u, 1774858792u, 1478633653u, 4266992385u, 1005723023u, 2642744891u, 2892827814u,  169477906u,
+    4233263099u, 1512406095u, 1808623314u, 3451546982u,  136139752u, 2926205020u, 2676114113u,  972376437u,
+    2825102674u,  236236518u, 1073525883u, 2576072655u, 1546420545u, 4200303349u, 3417542760u, 1841601500u,
+    2609703733u, 1039917185u,  202635804u, 2858742184u, 1875103526u, 3384067218u, 4166835727u, 1579931067u,
+    1141601657u, 3799809741u, 3549717584u, 1977839588u, 2957267306u,  372464350u,  668680259u, 2175552503u,
+    2011446046u, 3516084394u, 3766168119u, 1175200131u, 2209029901u,  635180217u,  338955812u, 2990736784u,
+     601221559u, 2242044419u, 3024812190u,  306049834u, 3617246628u, 1911408144u, 1074125965u, 3866285881u,
+     272279504u, 3058543716u, 2275784441u,  567459149u, 3832906691u, 1107462263u, 1944752874u, 3583875422u,
+    2343980261u,  767641425u,  472473036u, 3126744696u, 2147051766u, 3649987394u, 3899029983u, 1309766251u,
+    3092841090u,  506333494u,  801510315u, 2310084639u, 1276520081u, 3932237093u, 3683203000u, 2113813516u,
+    3966292011u, 1243601823u, 2079834370u, 3716205238u,  405271608u, 3192979340u, 2411259153u,  701492901u,
+    3750207052u, 2045810168u, 1209569125u, 4000285905u,  734575199u, 2378150379u, 3159862134u,  438345922u,
+    2283203314u,  778166598u,  529136603u, 3120492655u, 2086260449u, 3660498261u, 3955679176u, 1303499900u,
+    3153699989u,  495890209u,  744928700u, 2316418568u, 1337360518u, 3921775410u, 3626602927u, 2120129051u,
+    4022892092u, 1237286280u, 2018993941u, 3726666913u,  461853231u, 3186645403u, 2350400262u,  711936178u,
+    3693557851u, 2052076527u, 1270360434u, 3989775046u,  677911624u, 2384402428u, 3220639073u,  427820757u,
+    1202443118u, 3789347034u, 3493118535u, 1984154099u, 3018127229u,  362020041u,  612099668u, 2181885408u,
+    1950653705u, 3526596285u, 3822816288u, 1168934804u, 2148251930u,  645706414u,  395618355u, 2984485767u,
+     544559008u, 2248295444u, 3085590153u,  295523645u, 3560598451u, 1917673479u, 1134918298u, 3855773998u,
+     328860103u, 3052210803u, 2214924526u,  577903450u, 3889505748u, 1101147744u, 1883911421u, 3594338121u,
+    3424493451u, 1785369663u, 1535282850u, 4260726038u,  944946072u, 2653270060u, 2949491377u,  163225861u,
+    4294103532u, 1501944408u, 1752023237u, 3457862513u,  196998655u, 2915761739u, 2619532502u,  978710370u,
+    2881684293u,  229902577u, 1012666988u, 2586515928u, 1603020630u, 4193987810u, 3356702335u, 1852063179u,
+    2553040162u, 1046169238u,  263412747u, 2848217023u, 1818454321u, 3390333573u, 4227627032u, 1569420204u,
+      60859927u, 2782375331u, 2487203646u,  843627658u, 4159668740u, 1368951216u, 1617990445u, 3322386585u,
+     810543216u, 2520310724u, 2815490393u,   27783917u, 3288386659u, 1652017111u, 1402985802u, 4125677310u,
+    1685994201u, 3255382381u, 4091620336u, 1435902020u, 2419138250u,  910562686u,  128847843u, 2715354199u,
+    1469150398u, 4058414858u, 3222168983u, 1719234083u, 2749255853u,   94984985u,  876691844u, 2453031472u
+  },
+  {
+             0u, 3433693342u, 1109723005u, 2391738339u, 2219446010u, 1222643300u, 3329165703u,  180685081u,
+    3555007413u,  525277995u, 2445286600u, 1567235158u, 1471092047u, 2600801745u,  361370162u, 3642757804u,
+    2092642603u, 2953916853u, 1050555990u, 4063508168u, 4176560081u,  878395215u, 3134470316u, 1987983410u,
+    2942184094u, 1676945920u, 3984272867u,  567356797u,  722740324u, 3887998202u, 1764827929u, 2778407815u,
+    4185285206u,  903635656u, 3142804779u, 2012833205u, 2101111980u, 2979425330u, 1058630609u, 4088621903u,
+     714308067u, 3862526333u, 1756790430u, 2753330688u, 2933487385u, 1651734407u, 3975966820u,  542535930u,
+    2244825981u, 1231508451u, 3353891840u,  188896414u,   25648519u, 3442302233u, 1134713594u, 2399689316u,
+    1445480648u, 2592229462u,  336416693u, 3634843435u, 3529655858u,  516441772u, 2420588879u, 1559052753u,
+     698204909u, 3845636723u, 1807271312u, 2803025166u, 2916600855u, 1635634313u, 4025666410u,  593021940u,
+    4202223960u,  919787974u, 3093159461u, 1962401467u, 2117261218u, 2996361020u, 1008193759u, 4038971457u,
+    1428616134u, 2576151384u,  386135227u, 3685348389u, 3513580860u,  499580322u, 2471098945u, 1608776415u,
+    2260985971u, 1248454893u, 3303468814u,  139259792u,   42591881u, 3458459159u, 1085071860u, 2349261162u,
+    3505103035u,  474062885u, 2463016902u, 1583654744u, 1419882049u, 2550902495u,  377792828u, 3660491170u,
+      51297038u, 3483679632u, 1093385331u, 2374089965u, 2269427188u, 1273935210u, 3311514249u,  164344343u,
+    2890961296u, 1627033870u, 4000683757u,  585078387u,  672833386u, 3836780532u, 1782552599u, 2794821769u,
+    2142603813u, 3005188795u, 1032883544u, 4047146438u, 4227826911u,  928351297u, 3118105506u, 1970307900u,
+    1396409818u, 2677114180u,  287212199u, 3719594553u, 3614542624u,  467372990u, 2505346141u, 1509854403u,
+    2162073199u, 1282711281u, 3271268626u,  240228748u,   76845205u, 3359543307u, 1186043880u, 2317064054u,
+     796964081u, 3811226735u, 1839575948u, 2702160658u, 2882189835u, 1734392469u, 3924802934u,  625327592u,
+    4234522436u,  818917338u, 3191908409u, 1927981223u, 2016387518u, 3028656416u,  973776579u, 4137723485u,
+    2857232268u, 1726474002u, 3899187441u,  616751215u,  772270454u, 3803048424u, 1814228491u, 2693328533u,
+    2041117753u, 3036871847u,  999160644u, 4146592730u, 4259508931u,  826864221u, 3217552830u, 1936586016u,
+    3606501031u,  442291769u, 2496909786u, 1484378436u, 1388107869u, 2652297411u,  278519584u, 3694387134u,
+      85183762u, 3384397196u, 1194773103u, 2342308593u, 2170143720u, 1307820918u, 3279733909u,  265733131u,
+    2057717559u, 3054258089u,  948125770u, 4096344276u, 4276898253u,  843467091u, 3167309488u, 1885556270u,
+    2839764098u, 1709792284u, 3949353983u,  667704161u,  755585656u, 3785577190u, 1865176325u, 2743489947u,
+     102594076u, 3401021058u, 1144549729u, 2291298815u, 2186770662u, 1325234296u, 3228729243u,  215514885u,
+    3589828009u,  424832311u, 2547870420u, 1534552650u, 1370645331u, 2635621325u,  328688686u, 3745342640u,
+    2211456353u, 1333405183u, 3254067740u,  224338562u,  127544219u, 3408931589u, 1170156774u, 2299866232u,
+    1345666772u, 2627681866u,  303053225u, 3736746295u, 3565105198u,  416624816u, 2522494803u, 1525692365u,
+    4285207626u,  868291796u, 3176010551u, 1910772649u, 2065767088u, 3079346734u,  956571085u, 4121828691u,
+     747507711u, 3760459617u, 1856702594u, 2717976604u, 2831417605u, 1684930971u, 3940615800u,  642451174u
+  }
 };
 
-/*Return the CRC of the bytes buf[0..len-1].*/
-unsigned lodepng_crc32(const unsigned char* buf, size_t len)
+#ifdef LODEPNG_SIMD_X86
+/*
+CRC by folding 64 bytes per step with carry-less multiplication, then reducing the
+128-bit remainder to 32 bits (Gopal et al., "Fast CRC Computation for Generic
+Polynomials Using PCLMULQDQ Instruction"). c is the inverted CRC as in update_crc32,
+len must be at least 64 and a multiple of 16.
+*/
+static unsigned crc32_pclmul(unsigned c, const unsigned char* buf, size_t len) LODEPNG_TARGET("sse2,pclmul");
+static unsigned crc32_pclmul(unsigned c, const unsigned char* buf, size_t len)
+{
+  /*x^(4*128+32) and x^(4*128-32), x^(128+32) and x^(128-32), x^64 modulo the polynomial, bit-reflected*/
+  const __m128i k1k2 = _mm_setr_epi32(0x54442bd4, 1, 0xc6e41596, 1);
+  const __m128i k3k4 = _mm_setr_epi32(0x751997d0, 1, 0xccaa009e, 0);
+  const __m128i k5 = _mm_setr_epi32(0x63cd6124, 1, 0, 0);
+  /*Barrett reduction: the polynomial and floor(x^64 / polynomial), bit-reflected*/
+  const __m128i poly = _mm_setr_epi32(0xdb710641, 1, 0xf7011641, 1);
+  const __m128i mask32 = _mm_setr_epi32(-1, 0, -1, 0);
+  __m128i x1 = _mm_loadu_si128((const __m128i*)(buf + 0));
+  __m128i x2 = _mm_loadu_si128((const __m128i*)(buf + 16));
+  __m128i x3 = _mm_loadu_si128((const __m128i*)(buf + 32));
+  __m128i x4 = _mm_loadu_si128((const __m128i*)(buf + 48));
+  __m128i t;
+
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+  buf += 64;
+  len -= 64;
+
+  while(len >= 64)
+  {
+    __m128i l1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    __m128i l2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    __m128i l3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    __m128i l4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x11), l1);
+    x2 = _mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x11), l2);
+    x3 = _mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x11), l3);
+    x4 = _mm_xor_si128(_mm_clmulepi64_si128(x4, k1k2, 0x11), l4);
+    x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)(buf + 0)));
+    x2 = _mm_xor_si128(x2, _mm_loadu_si128((const __m128i*)(buf + 16)));
+    x3 = _mm_xor_si128(x3, _mm_loadu_si128((const __m128i*)(buf + 32)));
+    x4 = _mm_xor_si128(x4, _mm_loadu_si128((const __m128i*)(buf + 48)));
+    buf += 64;
+    len -= 64;
+  }
+
+  /*fold the 4 registers into one, then the remaining 16-byte blocks into it*/
+  t = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), t);
+  t = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), t);
+  t = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), t);
+  while(len >= 16)
+  {
+    t = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t);
+    x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)buf));
+    buf += 16;
+    len -= 16;
+  }
+
+  /*128 to 64 bits*/
+  t = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t);
+  t = _mm_srli_si128(x1, 4);
+  x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5, 0x00), t);
+
+  /*64 to 32 bits*/
+  t = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+  t = _mm_clmulepi64_si128(_mm_and_si128(t, mask32), poly, 0x00);
+  x1 = _mm_xor_si128(x1, t);
+  return (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_ARM
+/*CRC with the ARMv8 CRC32 instructions, which use the same polynomial as PNG. c is the
+inverted CRC as in update_crc32.*/
+static unsigned crc32_armv8(unsigned c, const unsigned char* buf, size_t len)
+{
+  while(len >= 8)
+  {
+    uint64_t v = 0;
+    unsigned i;
+    for(i = 0; i != 8; ++i) v |= (uint64_t)buf[i] << (8 * i); /*one load on little endian*/
+    c = __crc32d(c, v);
+    buf += 8;
+    len -= 8;
+  }
+  while(len > 0)
+  {
+    c = __crc32b(c, *buf++);
+    --len;
+  }
+  return c;
+}
+#endif /*LODEPNG_SIMD_ARM*/
+
+/*Return the CRC of the earlier bytes, whose CRC is crc (0 for none), followed by buf[0..len-1].*/
+static unsigned update_crc32(unsigned crc, const unsigned char* buf, size_t len)
 {
-  unsigned c = 0xffffffffL;
-  size_t n;
+  unsigned c = crc ^ 0xffffffffL;
+
+#ifdef LODEPNG_SIMD_ARM
+  if(getCpuFeatures() & CPU_CRC32) return crc32_armv8(c, buf, len) ^ 0xffffffffL;
+#endif /*LODEPNG_SIMD_ARM*/
+
+#ifdef LODEPNG_SIMD_X86
+  if(len >= 64 && (getCpuFeatures() & CPU_PCLMUL))
+  {
+    c = crc32_pclmul(c, buf, len & ~(size_t)15);
+    buf += len & ~(size_t)15;
+    len &= 15;
+  }
+#endif /*LODEPNG_SIMD_X86*/
 
-  for(n = 0; n < len; ++n)
+  while(len >= 8)
+  {
+    c ^= buf[0] | ((unsigned)buf[1] << 8) | ((unsigned)buf[2] << 16) | ((unsigned)buf[3] << 24);
+    c = lodepng_crc32_table[7][c & 255] ^ lodepng_crc32_table[6][(c >> 8) & 255]
+      ^ lodepng_crc32_table[5][(c >> 16) & 255] ^ lodepng_crc32_table[4][c >> 24]
+      ^ lodepng_crc32_table[3][buf[4]] ^ lodepng_crc32_table[2][buf[5]]
+      ^ lodepng_crc32_table[1][buf[6]] ^ lodepng_crc32_table[0][buf[7]];
+    buf += 8;
+    len -= 8;
+  }
+  while(len > 0)
   {
-    c = lodepng_crc32_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+    c = lodepng_crc32_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+    --len;
   }
   return c ^ 0xffffffffL;
 }
 
+/*Return the CRC of the bytes buf[0..len-1].*/
+unsigned lodepng_crc32(const unsigned char* buf, size_t len)
+{
+  return update_crc32(0, buf, len);
+}
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / Reading and writing single bits and bytes from/to stream for LodePNG   / */
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -3412,11 +5141,137 @@ static void getPixelColorRGBA16(unsigned short* r, unsigned short* g, unsigned s
   }
 }
 
+#ifdef LODEPNG_SIMD_X86
+/*
+SIMD versions of the most used conversions of lodepng_convert, they give exactly the
+same result as the plain C code. All of them return the amount of pixels done, the
+plain C code does the rest.
+*/
+
+/*8-bit RGB to RGBA without color key: 4 pixels per step, from 16 loaded bytes of which 12 are used*/
+static size_t convertRGB8ToRGBA8_ssse3(unsigned char* out, const unsigned char* in, size_t numpixels) LODEPNG_TARGET("ssse3");
+static size_t convertRGB8ToRGBA8_ssse3(unsigned char* out, const unsigned char* in, size_t numpixels)
+{
+  size_t i;
+  const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  const __m128i alpha = _mm_set1_epi32((int)0xff000000u);
+  for(i = 0; i + 6 <= numpixels; i += 4)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)&in[i * 3]);
+    _mm_storeu_si128((__m128i*)&out[i * 4], _mm_or_si128(_mm_shuffle_epi8(x, shuffle), alpha));
+  }
+  return i;
+}
+
+/*8-bit grey to RGBA without color key: the grey bytes are doubled, then interleaved with grey and 255*/
+static size_t convertGrey8ToRGBA8_sse2(unsigned char* out, const unsigned char* in, size_t numpixels) LODEPNG_TARGET("sse2");
+static size_t convertGrey8ToRGBA8_sse2(unsigned char* out, const unsigned char* in, size_t numpixels)
+{
+  size_t i;
+  const __m128i alpha = _mm_set1_epi8(-1);
+  for(i = 0; i + 16 <= numpixels; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)&in[i]);
+    __m128i gg_lo = _mm_unpacklo_epi8(x, x), gg_hi = _mm_unpackhi_epi8(x, x);
+    __m128i ga_lo = _mm_unpacklo_epi8(x, alpha), ga_hi = _mm_unpackhi_epi8(x, alpha);
+    _mm_storeu_si128((__m128i*)&out[i * 4 + 0], _mm_unpacklo_epi16(gg_lo, ga_lo));
+    _mm_storeu_si128((__m128i*)&out[i * 4 + 16], _mm_unpackhi_epi16(gg_lo, ga_lo));
+    _mm_storeu_si128((__m128i*)&out[i * 4 + 32], _mm_unpacklo_epi16(gg_hi, ga_hi));
+    _mm_storeu_si128((__m128i*)&out[i * 4 + 48], _mm_unpackhi_epi16(gg_hi, ga_hi));
+  }
+  return i;
+}
+
+/*8-bit grey to RGB: 16 pixels are 48 output bytes, 3 shuffles of the same 16 loaded bytes*/
+static size_t convertGrey8ToRGB8_ssse3(unsigned char* out, const unsigned char* in, size_t numpixels) LODEPNG_TARGET("ssse3");
+static size_t convertGrey8ToRGB8_ssse3(unsigned char* out, const unsigned char* in, size_t numpixels)
+{
+  size_t i;
+  const __m128i shuffle0 = _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5);
+  const __m128i shuffle1 = _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10);
+  const __m128i shuffle2 = _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15);
+  for(i = 0; i + 16 <= numpixels; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)&in[i]);
+    _mm_storeu_si128((__m128i*)&out[i * 3 + 0], _mm_shuffle_epi8(x, shuffle0));
+    _mm_storeu_si128((__m128i*)&out[i * 3 + 16], _mm_shuffle_epi8(x, shuffle1));
+    _mm_storeu_si128((__m128i*)&out[i * 3 + 32], _mm_shuffle_epi8(x, shuffle2));
+  }
+  return i;
+}
+
+/*
+8-bit palette to RGBA: a gather of 8 pixels per step from a table of all 256 indices,
+in which the indices that aren't in the palette are black like in getPixelColorsRGBA8
+*/
+static size_t convertPalette8ToRGBA8_avx2(unsigned char* out, const unsigned char* in, size_t numpixels,
+                                          const LodePNGColorMode* mode) LODEPNG_TARGET("avx2");
+static size_t convertPalette8ToRGBA8_avx2(unsigned char* out, const unsigned char* in, size_t numpixels,
+                                          const LodePNGColorMode* mode)
+{
+  static const unsigned char black[4] = {0, 0, 0, 255};
+  unsigned table[256];
+  size_t i;
+  for(i = 0; i != 256; ++i) memcpy(&table[i], i < mode->palettesize ? &mode->palette[i * 4] : black, 4);
+  for(i = 0; i + 8 <= numpixels; i += 8)
+  {
+    __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&in[i]));
+    _mm256_storeu_si256((__m256i*)&out[i * 4], _mm256_i32gather_epi32((const int*)table, index, 4));
+  }
+  return i;
+}
+
+/*16-bit to 8-bit of the same color type: the first (most significant) byte of each value*/
+static size_t convert16To8_sse2(unsigned char* out, const unsigned char* in, size_t numpixels,
+                                unsigned channels) LODEPNG_TARGET("sse2");
+static size_t convert16To8_sse2(unsigned char* out, const unsigned char* in, size_t numpixels,
+                                unsigned channels)
+{
+  size_t i, numbytes = numpixels * channels;
+  const __m128i mask = _mm_set1_epi16(255);
+  for(i = 0; i + 16 <= numbytes; i += 16)
+  {
+    __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)&in[i * 2]), mask);
+    __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)&in[i * 2 + 16]), mask);
+    _mm_storeu_si128((__m128i*)&out[i], _mm_packus_epi16(a, b));
+  }
+  return i / channels;
+}
+
+/*returns how many pixels the SIMD code converted, given the CPU_ flags*/
+static size_t convertPixelsSIMD(unsigned char* out, const unsigned char* in, const LodePNGColorMode* mode_out,
+                                const LodePNGColorMode* mode_in, size_t numpixels, unsigned cpu)
+{
+  if(!(cpu & CPU_SSE2) || mode_out->colortype == LCT_PALETTE || mode_out->bitdepth != 8) return 0;
+  if(mode_in->bitdepth == 16 && mode_in->colortype == mode_out->colortype)
+  {
+    return convert16To8_sse2(out, in, numpixels, lodepng_get_channels(mode_in));
+  }
+  if(mode_in->bitdepth != 8) return 0;
+  if(mode_out->colortype == LCT_RGBA)
+  {
+    switch(mode_in->colortype)
+    {
+      case LCT_RGB: return !mode_in->key_defined && (cpu & CPU_SSSE3) ? convertRGB8ToRGBA8_ssse3(out, in, numpixels) : 0;
+      case LCT_GREY: return !mode_in->key_defined ? convertGrey8ToRGBA8_sse2(out, in, numpixels) : 0;
+      /*filling the table takes about as long as converting a few hundred pixels*/
+      case LCT_PALETTE: return numpixels >= 256 && (cpu & CPU_AVX2) ? convertPalette8ToRGBA8_avx2(out, in, numpixels, mode_in) : 0;
+      default: return 0;
+    }
+  }
+  if(mode_out->colortype == LCT_RGB && mode_in->colortype == LCT_GREY && (cpu & CPU_SSSE3))
+  {
+    return convertGrey8ToRGB8_ssse3(out, in, numpixels);
+  }
+  return 0;
+}
+#endif /*LODEPNG_SIMD_X86*/
+
 unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
                          LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
                          unsigned w, unsigned h)
 {
-  size_t i;
+  size_t i, start = 0;
   ColorTree tree;
   size_t numpixels = w * h;
 
@@ -3439,6 +5294,11 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
     }
   }
 
+  /*the SIMD code only converts whole bytes per pixel, so the rest starts at a byte*/
+#ifdef LODEPNG_SIMD_X86
+  start = convertPixelsSIMD(out, in, mode_out, mode_in, numpixels, getCpuFeatures());
+#endif /*LODEPNG_SIMD_X86*/
+
   if(mode_in->bitdepth == 16 && mode_out->bitdepth == 16)
   {
     for(i = 0; i != numpixels; ++i)
@@ -3450,16 +5310,16 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
   }
   else if(mode_out->bitdepth == 8 && mode_out->colortype == LCT_RGBA)
   {
-    getPixelColorsRGBA8(out, numpixels, 1, in, mode_in);
+    getPixelColorsRGBA8(&out[start * 4], numpixels - start, 1, &in[start * lodepng_get_bpp(mode_in) / 8], mode_in);
   }
   else if(mode_out->bitdepth == 8 && mode_out->colortype == LCT_RGB)
   {
-    getPixelColorsRGBA8(out, numpixels, 0, in, mode_in);
+    getPixelColorsRGBA8(&out[start * 3], numpixels - start, 0, &in[start * lodepng_get_bpp(mode_in) / 8], mode_in);
   }
   else
   {
     unsigned char r = 0, g = 0, b = 0, a = 0;
-    for(i = 0; i != numpixels; ++i)
+    for(i = start; i != numpixels; ++i)
     {
       getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in);
       rgba8ToPixel(out, i, mode_out, &tree, r, g, b, a);
@@ -3874,32 +5734,209 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
   return state->error;
 }
 
-static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
-                                 size_t bytewidth, unsigned char filterType, size_t length)
-{
-  /*
-  For PNG filter method 0
-  unfilter a PNG image scanline by scanline. when the pixels are smaller than 1 byte,
-  the filter works byte per byte (bytewidth = 1)
-  precon is the previous unfiltered scanline, recon the result, scanline the current one
-  the incoming scanlines do NOT include the filtertype byte, that one is given in the parameter filterType instead
-  recon and scanline MAY be the same memory address! precon must be disjoint.
-  */
+#ifdef LODEPNG_SIMD_X86
+/*
+SIMD versions of unfilterScanline for a scanline with a previous scanline, they
+give exactly the same result as the plain C code in unfilterScanline. Up works
+for any bytewidth, the others for bytewidth 3 and 4 (8-bit RGB and RGBA). Sub,
+Average and Paeth depend on the pixel to the left, so they handle a pixel per
+step, except Sub which is a prefix sum within a register. All of them return the
+amount of bytes done, unfilterScanline does the rest.
+recon and scanline may be the same memory address (or recon may be a bit before
+scanline), that is fine since each step loads its input before storing.
+*/
 
+static size_t unfilterUp_sse2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                              size_t length) LODEPNG_TARGET("sse2");
+static size_t unfilterUp_sse2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                              size_t length)
+{
   size_t i;
+  for(i = 0; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+    __m128i b = _mm_loadu_si128((const __m128i*)&precon[i]);
+    _mm_storeu_si128((__m128i*)&recon[i], _mm_add_epi8(x, b));
+  }
+  return i;
+}
+
+static size_t unfilterUp_avx2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                              size_t length) LODEPNG_TARGET("avx2");
+static size_t unfilterUp_avx2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                              size_t length)
+{
+  size_t i;
+  for(i = 0; i + 32 <= length; i += 32)
+  {
+    __m256i x = _mm256_loadu_si256((const __m256i*)&scanline[i]);
+    __m256i b = _mm256_loadu_si256((const __m256i*)&precon[i]);
+    _mm256_storeu_si256((__m256i*)&recon[i], _mm256_add_epi8(x, b));
+  }
+  return i;
+}
+
+/*adds every pixel to the ones after it: 4 pixels per step, with the last pixel of the previous step added to the first*/
+static size_t unfilterSub_sse2(unsigned char* recon, const unsigned char* scanline,
+                               size_t bytewidth, size_t length) LODEPNG_TARGET("sse2");
+static size_t unfilterSub_sse2(unsigned char* recon, const unsigned char* scanline,
+                               size_t bytewidth, size_t length)
+{
+  size_t i = 0;
+  __m128i last = _mm_setzero_si128();
+  if(bytewidth == 4)
+  {
+    for(; i + 16 <= length; i += 16)
+    {
+      __m128i x = _mm_add_epi8(_mm_loadu_si128((const __m128i*)&scanline[i]), last);
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+      _mm_storeu_si128((__m128i*)&recon[i], x);
+      last = _mm_srli_si128(x, 12);
+    }
+  }
+  else /*bytewidth 3: 4 pixels are 12 of the 16 loaded bytes*/
+  {
+    const __m128i mask = _mm_cvtsi32_si128(0xffffff);
+    for(; i + 16 <= length; i += 12)
+    {
+      __m128i x = _mm_add_epi8(_mm_loadu_si128((const __m128i*)&scanline[i]), last);
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+      _mm_storel_epi64((__m128i*)&recon[i], x);
+      store32(&recon[i + 8], (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(x, 8)));
+      last = _mm_and_si128(_mm_srli_si128(x, 9), mask);
+    }
+  }
+  return i;
+}
+
+/*recon = scanline + floor((left + up) / 2). _mm_avg_epu8 rounds up, so the lowest bit of left ^ up is subtracted*/
+static size_t unfilterAverage_sse2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                   size_t bytewidth, size_t length) LODEPNG_TARGET("sse2");
+static size_t unfilterAverage_sse2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                   size_t bytewidth, size_t length)
+{
+  size_t i;
+  const __m128i ones = _mm_set1_epi8(1);
+  __m128i a = _mm_setzero_si128(); /*the reconstructed pixel to the left*/
+  /*4 bytes are loaded and stored per pixel, for bytewidth 3 the 4th is overwritten by the next pixel*/
+  for(i = 0; i + 4 <= length; i += bytewidth)
+  {
+    __m128i x = _mm_cvtsi32_si128((int)load32(&scanline[i]));
+    __m128i b = _mm_cvtsi32_si128((int)load32(&precon[i]));
+    __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), ones));
+    a = _mm_add_epi8(x, avg);
+    store32(&recon[i], (unsigned)_mm_cvtsi128_si32(a));
+  }
+  return i;
+}
+
+/*
+Paeth in 16-bit lanes: with p = a + b - c, |p - a| = |b - c|, |p - b| = |a - c|
+and |p - c| = |(b - c) + (a - c)|. Like paethPredictor, ties go to a, then b.
+*/
+#define UNFILTER_PAETH_SIMD(abs_epi16)\
+{\
+  size_t i;\
+  const __m128i zero = _mm_setzero_si128();\
+  __m128i a = zero; /*the reconstructed pixel to the left*/\
+  __m128i c = zero; /*the pixel to the upper left*/\
+  for(i = 0; i + 4 <= length; i += bytewidth)\
+  {\
+    __m128i x = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)load32(&scanline[i])), zero);\
+    __m128i b = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)load32(&precon[i])), zero);\
+    __m128i pa = _mm_sub_epi16(b, c);\
+    __m128i pb = _mm_sub_epi16(a, c);\
+    __m128i pc = _mm_add_epi16(pa, pb);\
+    __m128i smallest, choose_a, choose_b, pred;\
+    pa = abs_epi16(pa);\
+    pb = abs_epi16(pb);\
+    pc = abs_epi16(pc);\
+    smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));\
+    choose_a = _mm_cmpeq_epi16(pa, smallest);\
+    choose_b = _mm_andnot_si128(choose_a, _mm_cmpeq_epi16(pb, smallest));\
+    pred = _mm_or_si128(_mm_and_si128(choose_a, a), _mm_and_si128(choose_b, b));\
+    pred = _mm_or_si128(pred, _mm_andnot_si128(_mm_or_si128(choose_a, choose_b), c));\
+    a = _mm_and_si128(_mm_add_epi16(x, pred), _mm_set1_epi16(255));\
+    c = b;\
+    store32(&recon[i], (unsigned)_mm_cvtsi128_si32(_mm_packus_epi16(a, a)));\
+  }\
+  return i;\
+}
+
+/*SSE2 has no 16-bit absolute value, but max(x, -x) is one*/
+#define ABS_EPI16_SSE2(x) _mm_max_epi16(x, _mm_sub_epi16(zero, x))
+
+static size_t unfilterPaeth_sse2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                 size_t bytewidth, size_t length) LODEPNG_TARGET("sse2");
+static size_t unfilterPaeth_sse2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                 size_t bytewidth, size_t length)
+UNFILTER_PAETH_SIMD(ABS_EPI16_SSE2)
+
+static size_t unfilterPaeth_ssse3(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                  size_t bytewidth, size_t length) LODEPNG_TARGET("ssse3");
+static size_t unfilterPaeth_ssse3(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                  size_t bytewidth, size_t length)
+UNFILTER_PAETH_SIMD(_mm_abs_epi16)
+
+#undef ABS_EPI16_SSE2
+#undef UNFILTER_PAETH_SIMD
+
+/*returns how many bytes of the scanline the SIMD code handled, given the CPU_ flags*/
+static size_t unfilterScanlineSIMD(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                   size_t bytewidth, unsigned char filterType, size_t length, unsigned cpu)
+{
+  if(!(cpu & CPU_SSE2)) return 0;
+  if(!precon) return filterType == 1 && (bytewidth == 3 || bytewidth == 4) ? unfilterSub_sse2(recon, scanline, bytewidth, length) : 0;
+  if(filterType == 2) return (cpu & CPU_AVX2) ? unfilterUp_avx2(recon, scanline, precon, length)
+                                              : unfilterUp_sse2(recon, scanline, precon, length);
+  if(bytewidth != 3 && bytewidth != 4) return 0;
+  switch(filterType)
+  {
+    case 1: return unfilterSub_sse2(recon, scanline, bytewidth, length);
+    case 3: return unfilterAverage_sse2(recon, scanline, precon, bytewidth, length);
+    case 4: return (cpu & CPU_SSSE3) ? unfilterPaeth_ssse3(recon, scanline, precon, bytewidth, length)
+                                     : unfilterPaeth_sse2(recon, scanline, precon, bytewidth, length);
+    default: return 0;
+  }
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                 size_t bytewidth, unsigned char filterType, size_t length, unsigned cpu)
+{
+  /*
+  For PNG filter method 0
+  unfilter a PNG image scanline by scanline. when the pixels are smaller than 1 byte,
+  the filter works byte per byte (bytewidth = 1)
+  precon is the previous unfiltered scanline, recon the result, scanline the current one
+  the incoming scanlines do NOT include the filtertype byte, that one is given in the parameter filterType instead
+  recon and scanline MAY be the same memory address! precon must be disjoint.
+  cpu are the CPU_ flags for the SIMD code, which does as much of the scanline as
+  it can (start bytes), the plain C code below continues from there.
+  */
+
+  size_t i, start = 0;
+#ifdef LODEPNG_SIMD_X86
+  start = unfilterScanlineSIMD(recon, scanline, precon, bytewidth, filterType, length, cpu);
+#else /*LODEPNG_SIMD_X86*/
+  (void)cpu;
+#endif /*LODEPNG_SIMD_X86*/
+
   switch(filterType)
   {
     case 0:
       for(i = 0; i != length; ++i) recon[i] = scanline[i];
       break;
     case 1:
-      for(i = 0; i != bytewidth; ++i) recon[i] = scanline[i];
-      for(i = bytewidth; i < length; ++i) recon[i] = scanline[i] + recon[i - bytewidth];
+      for(i = start; i < bytewidth; ++i) recon[i] = scanline[i];
+      for(; i < length; ++i) recon[i] = scanline[i] + recon[i - bytewidth];
       break;
     case 2:
       if(precon)
       {
-        for(i = 0; i != length; ++i) recon[i] = scanline[i] + precon[i];
+        for(i = start; i < length; ++i) recon[i] = scanline[i] + precon[i];
       }
       else
       {
@@ -3909,8 +5946,8 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
     case 3:
       if(precon)
       {
-        for(i = 0; i != bytewidth; ++i) recon[i] = scanline[i] + precon[i] / 2;
-        for(i = bytewidth; i < length; ++i) recon[i] = scanline[i] + ((recon[i - bytewidth] + precon[i]) / 2);
+        for(i = start; i < bytewidth; ++i) recon[i] = scanline[i] + precon[i] / 2;
+        for(; i < length; ++i) recon[i] = scanline[i] + ((recon[i - bytewidth] + precon[i]) / 2);
       }
       else
       {
@@ -3921,11 +5958,11 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
     case 4:
       if(precon)
       {
-        for(i = 0; i != bytewidth; ++i)
+        for(i = start; i < bytewidth; ++i)
         {
           recon[i] = (scanline[i] + precon[i]); /*paethPredictor(0, precon[i], 0) is always precon[i]*/
         }
-        for(i = bytewidth; i < length; ++i)
+        for(; i < length; ++i)
         {
           recon[i] = (scanline[i] + paethPredictor(recon[i - bytewidth], precon[i], precon[i - bytewidth]));
         }
@@ -3948,7 +5985,50 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
   return 0;
 }
 
-static unsigned unfilter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h, unsigned bpp)
+/*swaps red and blue of the w 8-bit RGB or RGBA pixels of row, channels is 3 or 4*/
+static void swapRedBlue(unsigned char* row, unsigned w, unsigned channels)
+{
+  size_t i, size = (size_t)w * channels;
+  for(i = 0; i != size; i += channels)
+  {
+    unsigned char r = row[i];
+    row[i] = row[i + 2];
+    row[i + 2] = r;
+  }
+}
+
+/*
+Puts a decoded image of color type mode in the layout of flip_vertical and bgr, for when
+that couldn't be done while decoding it. Rows are swapped in place, without another buffer.
+*/
+static void layoutImage(unsigned char* image, unsigned w, unsigned h, const LodePNGColorMode* mode,
+                        unsigned flip, unsigned bgr)
+{
+  size_t linebytes = lodepng_get_raw_size(w, 1, mode);
+  unsigned y;
+  size_t i;
+  if(flip)
+  {
+    for(y = 0; y < h / 2; ++y)
+    {
+      unsigned char* a = &image[y * linebytes];
+      unsigned char* b = &image[(h - 1 - y) * linebytes];
+      for(i = 0; i != linebytes; ++i)
+      {
+        unsigned char c = a[i];
+        a[i] = b[i];
+        b[i] = c;
+      }
+    }
+  }
+  if(bgr)
+  {
+    for(y = 0; y != h; ++y) swapRedBlue(&image[y * linebytes], w, lodepng_get_channels(mode));
+  }
+}
+
+static unsigned unfilter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h, unsigned bpp,
+                         unsigned flip, unsigned bgr)
 {
   /*
   For PNG filter method 0
@@ -3956,29 +6036,73 @@ static unsigned unfilter(unsigned char* out, const unsigned char* in, unsigned w
   out must have enough bytes allocated already, in must have the scanlines + 1 filtertype byte per scanline
   w and h are image dimensions or dimensions of reduced image, bpp is bits per pixel
   in and out are allowed to be the same memory address (but aren't the same size since in has the extra filter bytes)
+  flip stores the rows bottom-up, bgr swaps red and blue of 8-bit RGB or RGBA (bpp 24 or 32), see
+  LodePNGDecoderSettings. A row is swapped once the next one, which refers to it, is unfiltered.
   */
 
   unsigned y;
   unsigned char* prevline = 0;
+  unsigned cpu = 0;
 
   /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
   size_t bytewidth = (bpp + 7) / 8;
   size_t linebytes = (w * bpp + 7) / 8;
 
+#ifdef LODEPNG_SIMD_X86
+  cpu = getCpuFeatures();
+#endif /*LODEPNG_SIMD_X86*/
+
   for(y = 0; y < h; ++y)
   {
-    size_t outindex = linebytes * y;
+    size_t outindex = linebytes * (flip ? h - 1 - y : y);
     size_t inindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
     unsigned char filterType = in[inindex];
 
-    CERROR_TRY_RETURN(unfilterScanline(&out[outindex], &in[inindex + 1], prevline, bytewidth, filterType, linebytes));
+    CERROR_TRY_RETURN(unfilterScanline(&out[outindex], &in[inindex + 1], prevline, bytewidth, filterType, linebytes, cpu));
 
+    if(bgr && prevline) swapRedBlue(prevline, w, bpp / 8);
     prevline = &out[outindex];
   }
+  if(bgr && prevline) swapRedBlue(prevline, w, bpp / 8);
 
   return 0;
 }
 
+/*
+Adam7_deinterlace of 8-bit RGB or RGBA pixels. Works per row of a pass with pointers instead
+of computing the position of every pixel, copies the pixels with stores of their size, and
+the 7th pass, which is every odd row of the image, with one memcpy per row.
+*/
+static void Adam7_deinterlaceBytes(unsigned char* out, const unsigned char* in, unsigned w,
+                                   const unsigned passw[7], const unsigned passh[7],
+                                   const size_t passstart[8], size_t bytewidth)
+{
+  unsigned i, x, y;
+  for(i = 0; i != 7; ++i)
+  {
+    const unsigned char* src = &in[passstart[i]];
+    size_t step = ADAM7_DX[i] * bytewidth;
+    size_t srclinebytes = passw[i] * bytewidth;
+    for(y = 0; y < passh[i]; ++y, src += srclinebytes)
+    {
+      unsigned char* dst = &out[((size_t)(ADAM7_IY[i] + y * ADAM7_DY[i]) * w + ADAM7_IX[i]) * bytewidth];
+      const unsigned char* pixel = src;
+      if(i == 6)
+      {
+        memcpy(dst, src, srclinebytes);
+      }
+      else if(bytewidth == 4)
+      {
+        for(x = 0; x < passw[i]; ++x, dst += step, pixel += 4) memcpy(dst, pixel, 4);
+      }
+      else
+      {
+        for(x = 0; x < passw[i]; ++x, dst += step, pixel += 3) memcpy(dst, pixel, 3);
+      }
+    }
+  }
+}
+
 /*
 in: Adam7 interlaced image, with no padding bits between scanlines, but between
  reduced images so that each reduced image starts at a byte.
@@ -3998,7 +6122,8 @@ static void Adam7_deinterlace(unsigned char* out, const unsigned char* in, unsig
 
   Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
 
-  if(bpp >= 8)
+  if(bpp == 24 || bpp == 32) Adam7_deinterlaceBytes(out, in, w, passw, passh, passstart, bpp / 8);
+  else if(bpp >= 8)
   {
     for(i = 0; i != 7; ++i)
     {
@@ -4068,10 +6193,12 @@ static void removePaddingBits(unsigned char* out, const unsigned char* in,
 }
 
 /*out must be buffer big enough to contain full image, and in must contain the full decompressed data from
-the IDAT chunks (with filter index bytes and possible padding bits)
+the IDAT chunks (with filter index bytes and possible padding bits). flip and bgr are the layout
+of LodePNGDecoderSettings, bgr only if the PNG is 8-bit RGB or RGBA.
 return value is error*/
 static unsigned postProcessScanlines(unsigned char* out, unsigned char* in,
-                                     unsigned w, unsigned h, const LodePNGInfo* info_png)
+                                     unsigned w, unsigned h, const LodePNGInfo* info_png,
+                                     unsigned flip, unsigned bgr)
 {
   /*
   This function converts the filtered-padded-interlaced data into pure 2D image buffer with the PNG's colortype.
@@ -4087,11 +6214,12 @@ static unsigned postProcessScanlines(unsigned char* out, unsigned char* in,
   {
     if(bpp < 8 && w * bpp != ((w * bpp + 7) / 8) * 8)
     {
-      CERROR_TRY_RETURN(unfilter(in, in, w, h, bpp));
+      CERROR_TRY_RETURN(unfilter(in, in, w, h, bpp, 0, 0));
       removePaddingBits(out, in, w * bpp, ((w * bpp + 7) / 8) * 8, h);
+      layoutImage(out, w, h, &info_png->color, flip, bgr);
     }
     /*we can immediatly filter into the out buffer, no other steps needed*/
-    else CERROR_TRY_RETURN(unfilter(out, in, w, h, bpp));
+    else CERROR_TRY_RETURN(unfilter(out, in, w, h, bpp, flip, bgr));
   }
   else /*interlace_method is 1 (Adam7)*/
   {
@@ -4102,7 +6230,7 @@ static unsigned postProcessScanlines(unsigned char* out, unsigned char* in,
 
     for(i = 0; i != 7; ++i)
     {
-      CERROR_TRY_RETURN(unfilter(&in[padded_passstart[i]], &in[filter_passstart[i]], passw[i], passh[i], bpp));
+      CERROR_TRY_RETURN(unfilter(&in[padded_passstart[i]], &in[filter_passstart[i]], passw[i], passh[i], bpp, 0, 0));
       /*TODO: possible efficiency improvement: if in this reduced image the bits fit nicely in 1 scanline,
       move bytes instead of bits or move not at all*/
       if(bpp < 8)
@@ -4115,6 +6243,7 @@ static unsigned postProcessScanlines(unsigned char* out, unsigned char* in,
     }
 
     Adam7_deinterlace(out, in, w, h, bpp);
+    layoutImage(out, w, h, &info_png->color, flip, bgr);
   }
 
   return 0;
@@ -4287,9 +6416,7 @@ static unsigned readChunk_zTXt(LodePNGInfo* info, const LodePNGDecompressSetting
 
     length = chunkLength - string2_begin;
     /*will fail if zlib error, e.g. if length is too small*/
-    error = zlib_decompress(&decoded.data, &decoded.size,
-                            (unsigned char*)(&data[string2_begin]),
-                            length, zlibsettings);
+    error = zlib_decompress(&decoded, (unsigned char*)(&data[string2_begin]), length, zlibsettings);
     if(error) break;
     ucvector_push_back(&decoded, 0);
 
@@ -4370,9 +6497,7 @@ static unsigned readChunk_iTXt(LodePNGInfo* info, const LodePNGDecompressSetting
     if(compressed)
     {
       /*will fail if zlib error, e.g. if length is too small*/
-      error = zlib_decompress(&decoded.data, &decoded.size,
-                              (unsigned char*)(&data[begin]),
-                              length, zlibsettings);
+      error = zlib_decompress(&decoded, (unsigned char*)(&data[begin]), length, zlibsettings);
       if(error) break;
       if(decoded.allocsize < decoded.size) decoded.allocsize = decoded.size;
       ucvector_push_back(&decoded, 0);
@@ -4426,40 +6551,216 @@ static unsigned readChunk_pHYs(LodePNGInfo* info, const unsigned char* data, siz
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-/*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
-static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
-                          LodePNGState* state,
-                          const unsigned char* in, size_t insize)
+/*checks that the pixels of a w * h image can be counted without overflow, return value is error*/
+static unsigned checkImageSize(unsigned w, unsigned h)
 {
-  unsigned char IEND = 0;
-  const unsigned char* chunk;
-  size_t i;
-  ucvector idat; /*the data from idat chunks*/
-  ucvector scanlines;
-  size_t predict;
-  size_t numpixels;
+  size_t numpixels = (size_t)w * h;
 
-  /*for unknown chunk order*/
+  /*multiplication overflow*/
+  if(h != 0 && numpixels / h != w) return 92;
+  /*multiplication overflow possible further below. Allows up to 2^31-1 pixel
+  bytes with 16-bit RGBA, the rest is room for filter bytes.*/
+  if(numpixels > 268435455) return 92;
+  return 0;
+}
+
+/*size of the decompressed IDAT data: all scanlines including their filter bytes*/
+static size_t getIdatSize(unsigned w, unsigned h, const LodePNGInfo* info)
+{
+  const LodePNGColorMode* color = &info->color;
+  size_t size = 0;
+
+  if(info->interlace_method == 0)
+  {
+    /*The extra h is added because this are the filter bytes every scanline starts with*/
+    return lodepng_get_raw_size_idat(w, h, color) + h;
+  }
+
+  /*Adam-7 interlaced: the size is the sum of the 7 sub-images sizes*/
+  size += lodepng_get_raw_size_idat((w + 7) / 8, (h + 7) / 8, color) + (h + 7) / 8;
+  if(w > 4) size += lodepng_get_raw_size_idat((w + 3) / 8, (h + 7) / 8, color) + (h + 7) / 8;
+  size += lodepng_get_raw_size_idat((w + 3) / 4, (h + 3) / 8, color) + (h + 3) / 8;
+  if(w > 2) size += lodepng_get_raw_size_idat((w + 1) / 4, (h + 3) / 4, color) + (h + 3) / 4;
+  size += lodepng_get_raw_size_idat((w + 1) / 2, (h + 1) / 4, color) + (h + 1) / 4;
+  if(w > 1) size += lodepng_get_raw_size_idat((w + 0) / 2, (h + 1) / 2, color) + (h + 1) / 2;
+  size += lodepng_get_raw_size_idat((w + 0) / 1, (h + 0) / 2, color) + (h + 0) / 2;
+  return size;
+}
+
+/*
+Reads a complete chunk other than IHDR and IDAT into state->info_png, or skips it if it is
+not an implemented type. critical_pos is where unknown chunks are remembered (1 = after IHDR,
+2 = after PLTE, 3 = after IDAT), it's updated for PLTE. Sets *iend at the IEND chunk.
+Return value is error.
+*/
+static unsigned readChunk(LodePNGState* state, const unsigned char* chunk,
+                          unsigned* critical_pos, unsigned char* iend)
+{
+  unsigned error = 0;
+  unsigned chunkLength = lodepng_chunk_length(chunk);
+  const unsigned char* data = lodepng_chunk_data_const(chunk); /*the data in the chunk*/
   unsigned unknown = 0;
+
+  /*IEND chunk*/
+  if(lodepng_chunk_type_equals(chunk, "IEND"))
+  {
+    *iend = 1;
+  }
+  /*palette chunk (PLTE)*/
+  else if(lodepng_chunk_type_equals(chunk, "PLTE"))
+  {
+    error = readChunk_PLTE(&state->info_png.color, data, chunkLength);
+    *critical_pos = 2;
+  }
+  /*palette transparency chunk (tRNS)*/
+  else if(lodepng_chunk_type_equals(chunk, "tRNS"))
+  {
+    error = readChunk_tRNS(&state->info_png.color, data, chunkLength);
+  }
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-  unsigned critical_pos = 1; /*1 = after IHDR, 2 = after PLTE, 3 = after IDAT*/
+  /*background color chunk (bKGD)*/
+  else if(lodepng_chunk_type_equals(chunk, "bKGD"))
+  {
+    error = readChunk_bKGD(&state->info_png, data, chunkLength);
+  }
+  /*text chunk (tEXt)*/
+  else if(lodepng_chunk_type_equals(chunk, "tEXt"))
+  {
+    if(state->decoder.read_text_chunks)
+    {
+      error = readChunk_tEXt(&state->info_png, data, chunkLength);
+    }
+  }
+  /*compressed text chunk (zTXt)*/
+  else if(lodepng_chunk_type_equals(chunk, "zTXt"))
+  {
+    if(state->decoder.read_text_chunks)
+    {
+      error = readChunk_zTXt(&state->info_png, &state->decoder.zlibsettings, data, chunkLength);
+    }
+  }
+  /*international text chunk (iTXt)*/
+  else if(lodepng_chunk_type_equals(chunk, "iTXt"))
+  {
+    if(state->decoder.read_text_chunks)
+    {
+      error = readChunk_iTXt(&state->info_png, &state->decoder.zlibsettings, data, chunkLength);
+    }
+  }
+  else if(lodepng_chunk_type_equals(chunk, "tIME"))
+  {
+    error = readChunk_tIME(&state->info_png, data, chunkLength);
+  }
+  else if(lodepng_chunk_type_equals(chunk, "pHYs"))
+  {
+    error = readChunk_pHYs(&state->info_png, data, chunkLength);
+  }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  else /*it's not an implemented chunk type, so ignore it: skip over the data*/
+  {
+    /*error: unknown critical chunk (5th bit of first byte of chunk type is 0)*/
+    if(!lodepng_chunk_ancillary(chunk)) return 69;
 
-  /*provide some proper output values if error will happen*/
-  *out = 0;
+    unknown = 1;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+    if(state->decoder.remember_unknown_chunks)
+    {
+      error = lodepng_chunk_append(&state->info_png.unknown_chunks_data[*critical_pos - 1],
+                                   &state->info_png.unknown_chunks_size[*critical_pos - 1], chunk);
+    }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  }
+  if(error) return error;
+
+  if(!state->decoder.ignore_crc && !unknown) /*check CRC if wanted, only on known chunk types*/
+  {
+    if(lodepng_chunk_check_crc(chunk)) return 57; /*invalid CRC*/
+  }
+  return 0;
+}
+
+/*
+The IDAT data of a PNG: where the data of each IDAT chunk is in the input, so that it's
+inflated from there without being copied. Only a custom zlib gets it joined, which is
+only a copy if there is more than one IDAT chunk.
+*/
+typedef struct IdatSpans
+{
+  LodePNGSpan* spans;
+  size_t numspans, allocspans;
+  size_t size; /*total size of the data*/
+  ucvector joined; /*the data in one piece, if it's needed and there are several chunks*/
+  LodePNGArena* arena;
+} IdatSpans;
+
+static void IdatSpans_init(IdatSpans* idat, LodePNGArena* arena)
+{
+  idat->spans = 0;
+  idat->numspans = idat->allocspans = 0;
+  idat->size = 0;
+  ucvector_init(&idat->joined);
+  idat->joined.arena = arena;
+  idat->arena = arena;
+}
+
+static void IdatSpans_cleanup(IdatSpans* idat)
+{
+  ucvector_cleanup(&idat->joined);
+  arena_free(idat->arena, idat->spans);
+}
+
+/*returns 1 if success, 0 if failure ==> nothing done*/
+static unsigned IdatSpans_add(IdatSpans* idat, const unsigned char* data, size_t size)
+{
+  if(idat->numspans == idat->allocspans)
+  {
+    size_t allocspans = idat->allocspans ? idat->allocspans * 2 : 8;
+    void* spans = arena_realloc(idat->arena, idat->spans, idat->allocspans * sizeof(LodePNGSpan),
+                                allocspans * sizeof(LodePNGSpan));
+    if(!spans) return 0;
+    idat->spans = (LodePNGSpan*)spans;
+    idat->allocspans = allocspans;
+  }
+  idat->spans[idat->numspans].data = data;
+  idat->spans[idat->numspans].size = size;
+  ++idat->numspans;
+  idat->size += size;
+  return 1;
+}
+
+/*the data in one piece, see spansJoin. Return value is error*/
+static unsigned IdatSpans_join(const unsigned char** out, IdatSpans* idat)
+{
+  return spansJoin(out, &idat->joined, idat->spans, idat->numspans);
+}
+
+/*like zlib_decompress, the built in zlib reads the IDAT chunks where they are, a custom one gets them joined*/
+static unsigned zlib_decompressIdat(ucvector* out, IdatSpans* idat, const LodePNGDecompressSettings* settings)
+{
+  const unsigned char* in;
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(!settings->custom_zlib) return zlib_decompressSpans(out, idat->spans, idat->numspans, settings);
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  CERROR_TRY_RETURN(IdatSpans_join(&in, idat));
+  return zlib_decompress(out, in, idat->size, settings);
+}
+
+/*reads the header and all chunks of a PNG into the state, the IDAT chunks are added to idat*/
+static void decodeChunks(unsigned* w, unsigned* h, IdatSpans* idat, LodePNGState* state,
+                         const unsigned char* in, size_t insize)
+{
+  unsigned char IEND = 0;
+  const unsigned char* chunk;
+
+  /*for unknown chunk order*/
+  unsigned critical_pos = 1; /*1 = after IHDR, 2 = after PLTE, 3 = after IDAT*/
 
   state->error = lodepng_inspect(w, h, state, in, insize); /*reads header and resets other parameters in state->info_png*/
   if(state->error) return;
 
-  numpixels = *w * *h;
-
-  /*multiplication overflow*/
-  if(*h != 0 && numpixels / *h != *w) CERROR_RETURN(state->error, 92);
-  /*multiplication overflow possible further below. Allows up to 2^31-1 pixel
-  bytes with 16-bit RGBA, the rest is room for filter bytes.*/
-  if(numpixels > 268435455) CERROR_RETURN(state->error, 92);
+  state->error = checkImageSize(*w, *h);
+  if(state->error) return;
 
-  ucvector_init(&idat);
   chunk = &in[33]; /*first byte of the first chunk after the header*/
 
   /*loop through the chunks, ignoring unknown chunks and stopping at IEND chunk.
@@ -4487,188 +6788,1362 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     /*IDAT chunk, containing compressed image data*/
     if(lodepng_chunk_type_equals(chunk, "IDAT"))
     {
-      size_t oldsize = idat.size;
-      if(!ucvector_resize(&idat, oldsize + chunkLength)) CERROR_BREAK(state->error, 83 /*alloc fail*/);
-      for(i = 0; i != chunkLength; ++i) idat.data[oldsize + i] = data[i];
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+      if(!IdatSpans_add(idat, data, chunkLength)) CERROR_BREAK(state->error, 83 /*alloc fail*/);
       critical_pos = 3;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    }
-    /*IEND chunk*/
-    else if(lodepng_chunk_type_equals(chunk, "IEND"))
-    {
-      IEND = 1;
-    }
-    /*palette chunk (PLTE)*/
-    else if(lodepng_chunk_type_equals(chunk, "PLTE"))
-    {
-      state->error = readChunk_PLTE(&state->info_png.color, data, chunkLength);
-      if(state->error) break;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-      critical_pos = 2;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    }
-    /*palette transparency chunk (tRNS)*/
-    else if(lodepng_chunk_type_equals(chunk, "tRNS"))
-    {
-      state->error = readChunk_tRNS(&state->info_png.color, data, chunkLength);
-      if(state->error) break;
-    }
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*background color chunk (bKGD)*/
-    else if(lodepng_chunk_type_equals(chunk, "bKGD"))
-    {
-      state->error = readChunk_bKGD(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    }
-    /*text chunk (tEXt)*/
-    else if(lodepng_chunk_type_equals(chunk, "tEXt"))
-    {
-      if(state->decoder.read_text_chunks)
-      {
-        state->error = readChunk_tEXt(&state->info_png, data, chunkLength);
-        if(state->error) break;
-      }
-    }
-    /*compressed text chunk (zTXt)*/
-    else if(lodepng_chunk_type_equals(chunk, "zTXt"))
-    {
-      if(state->decoder.read_text_chunks)
-      {
-        state->error = readChunk_zTXt(&state->info_png, &state->decoder.zlibsettings, data, chunkLength);
-        if(state->error) break;
-      }
-    }
-    /*international text chunk (iTXt)*/
-    else if(lodepng_chunk_type_equals(chunk, "iTXt"))
-    {
-      if(state->decoder.read_text_chunks)
-      {
-        state->error = readChunk_iTXt(&state->info_png, &state->decoder.zlibsettings, data, chunkLength);
-        if(state->error) break;
-      }
-    }
-    else if(lodepng_chunk_type_equals(chunk, "tIME"))
-    {
-      state->error = readChunk_tIME(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    }
-    else if(lodepng_chunk_type_equals(chunk, "pHYs"))
-    {
-      state->error = readChunk_pHYs(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    else /*it's not an implemented chunk type, so ignore it: skip over the data*/
-    {
-      /*error: unknown critical chunk (5th bit of first byte of chunk type is 0)*/
-      if(!lodepng_chunk_ancillary(chunk)) CERROR_BREAK(state->error, 69);
 
-      unknown = 1;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-      if(state->decoder.remember_unknown_chunks)
+      if(!state->decoder.ignore_crc) /*check CRC if wanted*/
       {
-        state->error = lodepng_chunk_append(&state->info_png.unknown_chunks_data[critical_pos - 1],
-                                            &state->info_png.unknown_chunks_size[critical_pos - 1], chunk);
-        if(state->error) break;
+        if(lodepng_chunk_check_crc(chunk)) CERROR_BREAK(state->error, 57); /*invalid CRC*/
       }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     }
-
-    if(!state->decoder.ignore_crc && !unknown) /*check CRC if wanted, only on known chunk types*/
+    else
     {
-      if(lodepng_chunk_check_crc(chunk)) CERROR_BREAK(state->error, 57); /*invalid CRC*/
+      state->error = readChunk(state, chunk, &critical_pos, &IEND);
+      if(state->error) break;
     }
 
     if(!IEND) chunk = lodepng_chunk_next_const(chunk);
   }
+}
+
+/*
+inflates and unfilters the IDAT data, the result will be in the same color type as the PNG (hence "generic").
+The result is written to dest if it's not 0, else to a new buffer, with the rows flipped and red and
+blue swapped if flip and bgr are set.
+*/
+static void decodeIdat(unsigned char** out, unsigned char* dest, unsigned w, unsigned h,
+                       LodePNGState* state, IdatSpans* idat, unsigned flip, unsigned bgr)
+{
+  ucvector scanlines;
+  size_t predict;
 
   ucvector_init(&scanlines);
-  /*predict output size, to allocate exact size for output buffer to avoid more dynamic allocation.
-  If the decompressed size does not match the prediction, the image must be corrupt.*/
-  if(state->info_png.interlace_method == 0)
+  /*custom decoders reallocate the data with their own allocator*/
+  if(!state->decoder.zlibsettings.custom_zlib && !state->decoder.zlibsettings.custom_inflate)
   {
-    /*The extra *h is added because this are the filter bytes every scanline starts with*/
-    predict = lodepng_get_raw_size_idat(*w, *h, &state->info_png.color) + *h;
+    scanlines.arena = state->decoder.zlibsettings.arena;
   }
-  else
-  {
-    /*Adam-7 interlaced: predicted size is the sum of the 7 sub-images sizes*/
-    const LodePNGColorMode* color = &state->info_png.color;
-    predict = 0;
-    predict += lodepng_get_raw_size_idat((*w + 7) / 8, (*h + 7) / 8, color) + (*h + 7) / 8;
-    if(*w > 4) predict += lodepng_get_raw_size_idat((*w + 3) / 8, (*h + 7) / 8, color) + (*h + 7) / 8;
-    predict += lodepng_get_raw_size_idat((*w + 3) / 4, (*h + 3) / 8, color) + (*h + 3) / 8;
-    if(*w > 2) predict += lodepng_get_raw_size_idat((*w + 1) / 4, (*h + 3) / 4, color) + (*h + 3) / 4;
-    predict += lodepng_get_raw_size_idat((*w + 1) / 2, (*h + 1) / 4, color) + (*h + 1) / 4;
-    if(*w > 1) predict += lodepng_get_raw_size_idat((*w + 0) / 2, (*h + 1) / 2, color) + (*h + 1) / 2;
-    predict += lodepng_get_raw_size_idat((*w + 0) / 1, (*h + 0) / 2, color) + (*h + 0) / 2;
-  }
-  if(!state->error && !ucvector_reserve(&scanlines, predict)) state->error = 83; /*alloc fail*/
+  /*predict output size, to allocate exact size for output buffer to avoid more dynamic allocation.
+  If the decompressed size does not match the prediction, the image must be corrupt.*/
+  predict = getIdatSize(w, h, &state->info_png);
+  if(!ucvector_reserve(&scanlines, predict)) state->error = 83; /*alloc fail*/
   if(!state->error)
   {
-    state->error = zlib_decompress(&scanlines.data, &scanlines.size, idat.data,
-                                   idat.size, &state->decoder.zlibsettings);
+    state->error = zlib_decompressIdat(&scanlines, idat, &state->decoder.zlibsettings);
     if(!state->error && scanlines.size != predict) state->error = 91; /*decompressed size doesn't match prediction*/
   }
-  ucvector_cleanup(&idat);
 
-  if(!state->error)
+  if(!state->error && dest)
+  {
+    /*Adam7 of less than 8 bits per pixel only sets the 1 bits*/
+    if(state->info_png.interlace_method != 0 && lodepng_get_bpp(&state->info_png.color) < 8)
+    {
+      memset(dest, 0, lodepng_get_raw_size(w, h, &state->info_png.color));
+    }
+    state->error = postProcessScanlines(dest, scanlines.data, w, h, &state->info_png, flip, bgr);
+    *out = dest;
+  }
+  else if(!state->error)
   {
-    size_t outsize = lodepng_get_raw_size(*w, *h, &state->info_png.color);
+    size_t outsize = lodepng_get_raw_size(w, h, &state->info_png.color);
     ucvector outv;
     ucvector_init(&outv);
     if(!ucvector_resizev(&outv, outsize, 0)) state->error = 83; /*alloc fail*/
-    if(!state->error) state->error = postProcessScanlines(outv.data, scanlines.data, *w, *h, &state->info_png);
+    if(!state->error) state->error = postProcessScanlines(outv.data, scanlines.data, w, h, &state->info_png, flip, bgr);
     *out = outv.data;
   }
   ucvector_cleanup(&scanlines);
 }
 
-unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
-                        LodePNGState* state,
-                        const unsigned char* in, size_t insize)
+/*
+Sets *convert if the decoded image must still be converted to the color type of info_raw. If
+not, the info_png color settings are stored on the info_raw so that the info_raw still reflects
+what colortype the raw image has to the end user. Return value is error.
+*/
+static unsigned prepareColorConvert(unsigned* convert, LodePNGState* state)
 {
-  *out = 0;
-  decodeGeneric(out, w, h, state, in, insize);
-  if(state->error) return state->error;
+  *convert = 0;
   if(!state->decoder.color_convert || lodepng_color_mode_equal(&state->info_raw, &state->info_png.color))
   {
-    /*same color type, no copying or converting of data needed*/
-    /*store the info_png color settings on the info_raw so that the info_raw still reflects what colortype
-    the raw image has to the end user*/
-    if(!state->decoder.color_convert)
+    /*same color type, no copying or converting of data needed*/
+    if(!state->decoder.color_convert) return lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
+    return 0;
+  }
+
+  /*TODO: check if this works according to the statement in the documentation: "The converter can convert
+  from greyscale input color type, to 8-bit greyscale or greyscale with alpha"*/
+  if(!(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
+     && !(state->info_raw.bitdepth == 8))
+  {
+    return 56; /*unsupported color mode conversion*/
+  }
+  *convert = 1;
+  return 0;
+}
+
+/*checks that the decoder can give the image in the layout of flip and bgr, returns error*/
+static unsigned checkLayout(unsigned w, const LodePNGColorMode* mode_raw, unsigned flip, unsigned bgr)
+{
+  if(bgr && !((mode_raw->colortype == LCT_RGB || mode_raw->colortype == LCT_RGBA)
+                       && mode_raw->bitdepth == 8))
+  {
+    return 95; /*bgr needs 8-bit RGB or RGBA*/
+  }
+  if(flip && ((size_t)w * lodepng_get_bpp(mode_raw)) % 8 != 0) return 96;
+  return 0;
+}
+
+/*
+converts the rows y to y + rows of an image of h rows from mode_png to mode_raw, writing them to
+row h - 1 - y instead of y if flip is set. The rows of both color modes must end at byte boundaries.
+*/
+static unsigned convertRows(unsigned char* out, const unsigned char* in, unsigned y, unsigned rows,
+                            unsigned w, unsigned h, LodePNGColorMode* mode_raw,
+                            const LodePNGColorMode* mode_png, unsigned flip, unsigned bgr)
+{
+  size_t linebytes_raw = lodepng_get_raw_size(w, 1, mode_raw);
+  size_t linebytes_png = lodepng_get_raw_size(w, 1, mode_png);
+  unsigned error = 0, i;
+  if(!flip)
+  {
+    error = lodepng_convert(&out[y * linebytes_raw], &in[y * linebytes_png], mode_raw, mode_png, w, rows);
+    if(bgr) for(i = 0; i != rows; ++i) swapRedBlue(&out[(y + i) * linebytes_raw], w, lodepng_get_channels(mode_raw));
+    return error;
+  }
+  for(i = 0; i != rows && !error; ++i)
+  {
+    unsigned char* row = &out[(h - 1 - y - i) * linebytes_raw];
+    error = lodepng_convert(row, &in[(y + i) * linebytes_png], mode_raw, mode_png, w, 1);
+    if(bgr) swapRedBlue(row, w, lodepng_get_channels(mode_raw));
+  }
+  return error;
+}
+
+/*
+converts the decoded image in *out, from the arena, from the color type of the PNG to info_raw,
+into dest if it's not 0, in the layout of flip_vertical and bgr
+*/
+static unsigned convertDecoded(unsigned char** out, unsigned char* dest, unsigned w, unsigned h, LodePNGState* state)
+{
+  unsigned error;
+  unsigned char* data = *out;
+
+  /*color conversion needed; sort of copy of the data*/
+  *out = dest ? dest : (unsigned char*)lodepng_malloc(lodepng_get_raw_size(w, h, &state->info_raw));
+  if(!(*out))
+  {
+    error = 83; /*alloc fail*/
+  }
+  else if(((size_t)w * lodepng_get_bpp(&state->info_png.color)) % 8 == 0
+          && ((size_t)w * lodepng_get_bpp(&state->info_raw)) % 8 == 0)
+  {
+    error = convertRows(*out, data, 0, h, w, h, &state->info_raw, &state->info_png.color,
+                        state->decoder.flip_vertical, state->decoder.bgr);
+  }
+  else
+  {
+    error = lodepng_convert(*out, data, &state->info_raw, &state->info_png.color, w, h);
+    layoutImage(*out, w, h, &state->info_raw, state->decoder.flip_vertical, state->decoder.bgr);
+  }
+  arena_free(state->decoder.zlibsettings.arena, data);
+  return error;
+}
+
+#if defined(LODEPNG_PTHREADS) && defined(LODEPNG_COMPILE_ZLIB)
+#define LODEPNG_THREADED_DECODE
+/*
+Multithreaded decoding of non-interlaced images. The calling thread inflates, while
+the other threads unfilter the rows that are inflated and convert bands of unfiltered
+rows. If the zlib data has full flush points, the parts between them have no references
+to earlier data and are inflated in parallel. Anything unexpected, such as an error or
+a full flush point that turns out not to be one, makes it give up: the other threads
+stop at their next step, and the serial decoder decodes the image again, so that the
+result and errors are exactly the same.
+*/
+
+/*images with less inflated data than this are decoded serially*/
+#define THREADED_MIN_SIZE 262144u
+/*input bytes per serial inflate step, and minimum size of a part between full flush points*/
+#define THREADED_STEP 65536u
+/*maximum amount of threads used*/
+#define THREADED_MAX 64u
+
+typedef struct InflatePart
+{
+  size_t begin, end; /*byte positions in the deflate data, both at a block boundary*/
+  ucvector out;
+  unsigned done;
+} InflatePart;
+
+typedef struct ThreadedDecode
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond; /*broadcast at every progress*/
+  unsigned failed; /*1 after an error, the serial decoder must decode the image*/
+
+  const LodePNGSpan* spans; /*the zlib data, the deflate data starts 2 bytes in*/
+  size_t numspans;
+  size_t deflatesize; /*with the adler32 checksum after it*/
+  unsigned adler; /*the expected adler32 checksum*/
+  unsigned ignore_adler32;
+  InflatePart* parts; /*0 if the calling thread inflates serially*/
+  unsigned numparts;
+  unsigned nextpart; /*the next part a thread can inflate*/
+  unsigned copiedparts; /*parts that are copied to the scanlines*/
+  unsigned inflating; /*1 while the calling thread inflates serially*/
+
+  ucvector scanlines; /*never reallocated while the threads run*/
+  size_t predict;
+  size_t inflated; /*bytes at the start of scanlines that are final*/
+  size_t adlerpos; /*bytes of scanlines in the adler32 checksum so far*/
+  unsigned adlersum;
+  unsigned checked; /*1 once all data is inflated and its size and checksum are checked*/
+
+  unsigned w, h, cpu;
+  size_t bytewidth, linebytes;
+  const LodePNGColorMode* mode_png;
+  LodePNGColorMode* mode_raw;
+  unsigned char* image; /*the unfiltered image, in the color type of the PNG*/
+  unsigned unfiltered; /*rows of image that are done*/
+  unsigned unfiltering; /*1 while a thread unfilters*/
+
+  unsigned char* converted; /*the image in the color type of info_raw, 0 if no conversion is needed*/
+  unsigned bandrows, numbands, nextband, convertedbands;
+  unsigned flip, bgr; /*layout of the image in info_raw, done by the conversion if there is one*/
+
+  LodePNGArena* arena; /*only used by the calling thread*/
+} ThreadedDecode;
+
+/*
+Splits the deflate data at full flush points, where an empty stored block (0000ffff
+after its header) ends. Parts are at least minpart bytes. Returns the amount of parts.
+The 3 header bits, not final and BTYPE 00, and the padding up to the byte boundary
+are zero as encoders write them, so the byte before LEN has at least its top 3 bits
+zero (the header at bits 5 to 7, without padding). That rules out most 0000ffff that
+are just a part of compressed data, the others fail when their part is inflated.
+The positions are in the deflate data, which starts 2 bytes into the spans.
+*/
+static unsigned findInflateParts(InflatePart* parts, unsigned maxparts,
+                                 const LodePNGSpan* spans, size_t size, size_t minpart)
+{
+  unsigned num = 1;
+  size_t i, index = 0, start = 0; /*start is the position of spans[index] in the zlib data*/
+
+  parts[0].begin = 0;
+  for(i = minpart; i + 4 < size && num < maxparts; ++i)
+  {
+    size_t pos = i + 2 - 5; /*of the 5 bytes before i, in the zlib data*/
+    const unsigned char* b;
+    unsigned char bytes[5];
+    while(pos >= start + spans[index].size) start += spans[index++].size;
+    if(pos + 5 <= start + spans[index].size) b = &spans[index].data[pos - start];
+    else
+    {
+      spansCopy(bytes, &spans[index], pos - start, 5);
+      b = bytes;
+    }
+    if(b[4] == 255 && b[3] == 255 && b[2] == 0 && b[1] == 0 && b[0] < 32)
+    {
+      parts[num - 1].end = i;
+      parts[num].begin = i;
+      ++num;
+      i += minpart - 1;
+    }
+  }
+  parts[num - 1].end = size;
+  return num;
+}
+
+/*
+Inflates one part in steps, returns nonzero if the part isn't exactly a sequence of
+complete blocks, or if the decoding failed elsewhere meanwhile.
+*/
+static unsigned inflatePart(ThreadedDecode* d, InflatePart* part, unsigned last)
+{
+  unsigned error = 0, stop = 0;
+  Inflator inflator;
+  SpanFeed feed;
+
+  /*any thread can get here, so the arena isn't used*/
+  Inflator_init(&inflator, 0);
+  inflator.maxpos = d->predict;
+  /*the input goes on after the part: a stored block at the end needs to see more than its own bytes*/
+  SpanFeed_init(&feed, d->spans, d->numspans, 2 + part->begin, THREADED_STEP, 0);
+  if(!last) feed.stop = (2 + part->end) * 8;
+  while(!stop)
+  {
+    error = SpanFeed_run(&feed, &inflator, &part->out);
+    stop = error || feed.end || inflator.done || (!inflator.inblock && SpanFeed_pos(&feed, &inflator) == feed.stop);
+    if(!stop)
+    {
+      /*once anything failed the serial decoder takes over, the rest of the part isn't needed*/
+      pthread_mutex_lock(&d->mutex);
+      stop = error = d->failed;
+      pthread_mutex_unlock(&d->mutex);
+    }
+  }
+  /*a part other than the last must end exactly at its end, without final block*/
+  if(!error && !last && (inflator.done || SpanFeed_pos(&feed, &inflator) != feed.stop)) error = 1;
+  SpanFeed_cleanup(&feed);
+  Inflator_cleanup(&inflator);
+  return error;
+}
+
+/*the calling thread inflates the data in steps, making every step available to the other threads*/
+static void inflateSerialThreaded(ThreadedDecode* d)
+{
+  unsigned error = 0, stop = 0;
+  Inflator inflator;
+  SpanFeed feed;
+
+  Inflator_init(&inflator, d->arena);
+  inflator.maxpos = d->predict;
+  SpanFeed_init(&feed, d->spans, d->numspans, 2, THREADED_STEP, d->arena);
+  while(!stop)
+  {
+    /*the data of small IDAT chunks is inflated together, the other threads are woken once per step*/
+    size_t pos = SpanFeed_pos(&feed, &inflator);
+    do error = SpanFeed_run(&feed, &inflator, &d->scanlines);
+    while(!error && !feed.end && !inflator.done && SpanFeed_pos(&feed, &inflator) - pos < THREADED_STEP * 8);
+
+    pthread_mutex_lock(&d->mutex);
+    d->inflated = inflator.pos;
+    if(error) d->failed = 1;
+    stop = d->failed || feed.end || inflator.done;
+    if(stop) d->inflating = 0;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->mutex);
+  }
+  SpanFeed_cleanup(&feed);
+  Inflator_cleanup(&inflator);
+}
+
+/*
+Takes the new inflated data: copies finished parts to the scanlines, adds it to
+the checksum and unfilters the rows that are complete. Only one thread at a time
+does this, without the mutex locked, and copiedparts only changes afterwards.
+Returns nonzero on error.
+*/
+static unsigned unfilterThreaded(ThreadedDecode* d, unsigned copyparts, size_t inflated, unsigned complete)
+{
+  unsigned y, end, i;
+  /*without conversion, the unfiltered image is the result*/
+  unsigned flip = d->converted ? 0 : d->flip, bgr = d->converted ? 0 : d->bgr;
+
+  for(i = 0; i != copyparts; ++i)
+  {
+    InflatePart* part = &d->parts[d->copiedparts + i];
+    size_t j;
+    if(part->out.size > d->predict - d->scanlines.size) return 91; /*decompressed size doesn't match prediction*/
+    for(j = 0; j != part->out.size; ++j) d->scanlines.data[d->scanlines.size + j] = part->out.data[j];
+    d->scanlines.size += part->out.size;
+    ucvector_cleanup(&part->out);
+    inflated = d->scanlines.size;
+  }
+
+  if(!d->ignore_adler32)
+  {
+    d->adlersum = update_adler32(d->adlersum, &d->scanlines.data[d->adlerpos], (unsigned)(inflated - d->adlerpos));
+  }
+  d->adlerpos = inflated;
+
+  end = (unsigned)(inflated / (d->linebytes + 1));
+  if(end > d->h) end = d->h;
+  for(y = d->unfiltered; y < end; ++y)
+  {
+    const unsigned char* scanline = &d->scanlines.data[y * (d->linebytes + 1)];
+    unsigned char* recon = &d->image[(flip ? d->h - 1 - y : y) * d->linebytes];
+    unsigned char* precon = y == 0 ? 0 : &d->image[(flip ? d->h - y : y - 1) * d->linebytes];
+    CERROR_TRY_RETURN(unfilterScanline(recon, scanline + 1, precon, d->bytewidth, scanline[0], d->linebytes, d->cpu));
+    /*the previous row is only swapped once it isn't needed to unfilter anymore*/
+    if(bgr && precon) swapRedBlue(precon, d->w, (unsigned)d->bytewidth);
+  }
+  if(bgr && end == d->h && d->unfiltered < end)
+  {
+    swapRedBlue(&d->image[(flip ? 0 : d->h - 1) * d->linebytes], d->w, (unsigned)d->bytewidth);
+  }
+
+  if(complete)
+  {
+    if(inflated != d->predict) return 91; /*decompressed size doesn't match prediction*/
+    if(!d->ignore_adler32 && d->adlersum != d->adler) return 58; /*error, adler checksum not correct, data must be corrupted*/
+  }
+  return 0;
+}
+
+/*the work of every thread: takes tasks until the image is done or failed*/
+static void workThreaded(ThreadedDecode* d)
+{
+  pthread_mutex_lock(&d->mutex);
+  while(!d->failed && !(d->checked && (d->converted ? d->convertedbands == d->numbands : d->unfiltered == d->h)))
+  {
+    unsigned error = 0;
+    unsigned copyparts = 0;
+    unsigned bandend = (d->nextband + 1) * d->bandrows < d->h ? (d->nextband + 1) * d->bandrows : d->h;
+    while(d->copiedparts + copyparts < d->numparts && d->parts[d->copiedparts + copyparts].done) ++copyparts;
+
+    if(d->nextpart < d->numparts)
+    {
+      unsigned i = d->nextpart++;
+      pthread_mutex_unlock(&d->mutex);
+      error = inflatePart(d, &d->parts[i], i + 1 == d->numparts);
+      pthread_mutex_lock(&d->mutex);
+      d->parts[i].done = 1;
+    }
+    else if(!d->unfiltering && !d->checked
+            && (copyparts > 0 || d->inflated / (d->linebytes + 1) > d->unfiltered
+                || (!d->inflating && d->copiedparts == d->numparts)))
+    {
+      /*after this, the data is complete if nothing is being inflated anymore*/
+      unsigned complete = !d->inflating && d->copiedparts + copyparts == d->numparts;
+      size_t inflated = d->inflated;
+      d->unfiltering = 1;
+      pthread_mutex_unlock(&d->mutex);
+      error = unfilterThreaded(d, copyparts, inflated, complete);
+      pthread_mutex_lock(&d->mutex);
+      d->unfiltering = 0;
+      d->copiedparts += copyparts;
+      if(d->parts) d->inflated = d->scanlines.size;
+      d->unfiltered = (unsigned)(d->adlerpos / (d->linebytes + 1));
+      if(d->unfiltered > d->h) d->unfiltered = d->h;
+      d->checked = complete;
+    }
+    else if(d->converted && d->nextband < d->numbands && bandend <= d->unfiltered)
+    {
+      unsigned y = d->nextband++ * d->bandrows;
+      unsigned rows = bandend - y;
+      pthread_mutex_unlock(&d->mutex);
+      error = convertRows(d->converted, d->image, y, rows, d->w, d->h, d->mode_raw, d->mode_png, d->flip, d->bgr);
+      pthread_mutex_lock(&d->mutex);
+      ++d->convertedbands;
+    }
+    else
+    {
+      pthread_cond_wait(&d->cond, &d->mutex);
+      continue;
+    }
+
+    if(error) d->failed = 1;
+    pthread_cond_broadcast(&d->cond);
+  }
+  pthread_mutex_unlock(&d->mutex);
+}
+
+static void* threadMain(void* arg)
+{
+  workThreaded((ThreadedDecode*)arg);
+  return 0;
+}
+
+/*
+Decodes the IDAT data to info_raw with state->decoder.threads threads. Returns 1 if
+it did, or 0 if the image must be decoded serially, then *out is unchanged. The
+image is decoded into dest if it's not 0.
+*/
+static unsigned decodeThreaded(unsigned char** out, unsigned char* dest, unsigned w, unsigned h,
+                               LodePNGState* state, IdatSpans* idat)
+{
+  ThreadedDecode d;
+  unsigned char bytes[4];
+  pthread_t threads[THREADED_MAX];
+  unsigned numthreads = state->decoder.threads < THREADED_MAX ? state->decoder.threads : THREADED_MAX;
+  unsigned started = 0, maxparts = numthreads * 4, convert, i;
+  unsigned bpp = lodepng_get_bpp(&state->info_png.color);
+  size_t minpart;
+  LodePNGArena* imagearena; /*for d.image, the arena if it's temporary*/
+
+  /*cases the threaded decoder doesn't handle*/
+  if(state->info_png.interlace_method != 0) return 0;
+  if(state->decoder.zlibsettings.custom_zlib || state->decoder.zlibsettings.custom_inflate) return 0;
+  if(idat->size < 6) return 0;
+  spansCopy(bytes, idat->spans, 0, 2);
+  if(zlib_checkHeader(bytes)) return 0;
+  if(prepareColorConvert(&convert, state)) return 0;
+  /*rows that don't end at a byte boundary can't be unfiltered or converted in bands*/
+  if(((size_t)w * bpp) % 8 != 0 || ((size_t)w * lodepng_get_bpp(&state->info_raw)) % 8 != 0) return 0;
+  d.predict = getIdatSize(w, h, &state->info_png);
+  if(d.predict < THREADED_MIN_SIZE) return 0;
+
+  d.failed = 0;
+  d.spans = idat->spans;
+  d.numspans = idat->numspans;
+  d.deflatesize = idat->size - 2;
+  spansCopy(bytes, idat->spans, idat->size - 4, 4);
+  d.adler = lodepng_read32bitInt(bytes);
+  d.ignore_adler32 = state->decoder.zlibsettings.ignore_adler32;
+  d.parts = 0;
+  d.numparts = d.nextpart = d.copiedparts = 0;
+  d.inflating = 1;
+  d.arena = state->decoder.zlibsettings.arena;
+  ucvector_init(&d.scanlines);
+  d.scanlines.arena = d.arena;
+  d.inflated = d.adlerpos = 0;
+  d.adlersum = 1;
+  d.checked = 0;
+  d.w = w;
+  d.h = h;
+  d.cpu = 0;
+#ifdef LODEPNG_SIMD_X86
+  d.cpu = getCpuFeatures();
+#endif /*LODEPNG_SIMD_X86*/
+  d.bytewidth = (bpp + 7) / 8;
+  d.linebytes = lodepng_get_raw_size(w, 1, &state->info_png.color);
+  d.mode_png = &state->info_png.color;
+  d.mode_raw = &state->info_raw;
+  imagearena = convert ? d.arena : 0;
+  if(dest && !convert) d.image = dest;
+  else d.image = (unsigned char*)arena_malloc(imagearena, lodepng_get_raw_size(w, h, &state->info_png.color));
+  d.unfiltered = 0;
+  d.unfiltering = 0;
+  d.converted = 0;
+  /*bands of about 64K pixel bytes, enough to make the locking cheap*/
+  d.bandrows = (unsigned)(THREADED_STEP / d.linebytes + 1);
+  d.numbands = (h + d.bandrows - 1) / d.bandrows;
+  d.nextband = d.convertedbands = 0;
+  d.flip = state->decoder.flip_vertical;
+  d.bgr = state->decoder.bgr;
+
+  if(convert) d.converted = dest ? dest : (unsigned char*)lodepng_malloc(lodepng_get_raw_size(w, h, &state->info_raw));
+  if(!d.image || (convert && !d.converted) || !ucvector_reserve(&d.scanlines, d.predict)) d.failed = 1;
+
+  /*parts between full flush points, if there are*/
+  minpart = d.deflatesize / maxparts > THREADED_STEP ? d.deflatesize / maxparts : THREADED_STEP;
+  if(!d.failed) d.parts = (InflatePart*)arena_malloc(d.arena, maxparts * sizeof(InflatePart));
+  if(d.parts)
+  {
+    d.numparts = findInflateParts(d.parts, maxparts, d.spans, d.deflatesize, minpart);
+    if(d.numparts > 1)
+    {
+      for(i = 0; i != d.numparts; ++i)
+      {
+        ucvector_init(&d.parts[i].out);
+        d.parts[i].done = 0;
+      }
+      d.inflating = 0;
+    }
+    else
+    {
+      arena_free(d.arena, d.parts);
+      d.parts = 0;
+      d.numparts = 0;
+    }
+  }
+
+  if(!d.failed)
+  {
+    pthread_mutex_init(&d.mutex, 0);
+    pthread_cond_init(&d.cond, 0);
+    for(; started + 1 < numthreads; ++started)
+    {
+      if(pthread_create(&threads[started], 0, threadMain, &d)) break;
+    }
+    if(d.inflating) inflateSerialThreaded(&d);
+    workThreaded(&d);
+    for(i = 0; i != started; ++i) pthread_join(threads[i], 0);
+    pthread_cond_destroy(&d.cond);
+    pthread_mutex_destroy(&d.mutex);
+  }
+
+  if(d.parts)
+  {
+    for(i = 0; i != d.numparts; ++i) ucvector_cleanup(&d.parts[i].out);
+    arena_free(d.arena, d.parts);
+  }
+  ucvector_cleanup(&d.scanlines);
+  if(d.failed)
+  {
+    if(d.image != dest) arena_free(imagearena, d.image);
+    if(d.converted != dest) lodepng_free(d.converted);
+    return 0;
+  }
+  if(convert)
+  {
+    arena_free(imagearena, d.image);
+    *out = d.converted;
+  }
+  else *out = d.image;
+  return 1;
+}
+#endif /*defined(LODEPNG_PTHREADS) && defined(LODEPNG_COMPILE_ZLIB)*/
+
+/*decodes the PNG to *out, which is dest if that's not 0, else a new buffer*/
+static unsigned decodeImage(unsigned char** out, unsigned char* dest, size_t destsize,
+                            unsigned* w, unsigned* h, LodePNGState* state,
+                            const unsigned char* in, size_t insize)
+{
+  IdatSpans idat; /*the data from idat chunks*/
+  unsigned threaded = 0, convert = 0;
+
+  /*provide some proper output values if error will happen*/
+  *out = 0;
+
+  IdatSpans_init(&idat, state->decoder.zlibsettings.arena);
+  decodeChunks(w, h, &idat, state, in, insize);
+  if(!state->error) state->error = prepareColorConvert(&convert, state);
+  if(!state->error) state->error = checkLayout(*w, &state->info_raw, state->decoder.flip_vertical, state->decoder.bgr);
+  if(!state->error && dest && destsize < lodepng_get_raw_size(*w, *h, &state->info_raw))
+  {
+    state->error = 94; /*the output buffer is too small*/
+  }
+#ifdef LODEPNG_THREADED_DECODE
+  if(!state->error && state->decoder.threads > 1) threaded = decodeThreaded(out, dest, *w, *h, state, &idat);
+#endif /*LODEPNG_THREADED_DECODE*/
+  if(!state->error && !threaded && convert)
+  {
+    /*the image in the color type of the PNG is temporary*/
+    LodePNGArena* arena = state->decoder.zlibsettings.arena;
+    unsigned char* image = (unsigned char*)arena_malloc(arena, lodepng_get_raw_size(*w, *h, &state->info_png.color));
+    if(!image) state->error = 83; /*alloc fail*/
+    else decodeIdat(out, image, *w, *h, state, &idat, 0, 0);
+    if(!state->error) state->error = convertDecoded(out, dest, *w, *h, state);
+    else
+    {
+      arena_free(arena, image);
+      *out = 0;
+    }
+  }
+  else if(!state->error && !threaded)
+  {
+    decodeIdat(out, dest, *w, *h, state, &idat, state->decoder.flip_vertical, state->decoder.bgr);
+  }
+  IdatSpans_cleanup(&idat);
+  if(state->error && *out != dest) lodepng_free(*out);
+  if(state->error) *out = 0;
+  return state->error;
+}
+
+unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
+                        LodePNGState* state,
+                        const unsigned char* in, size_t insize)
+{
+  return decodeImage(out, 0, 0, w, h, state, in, insize);
+}
+
+unsigned lodepng_decode_into(unsigned char* out, size_t outsize, unsigned* w, unsigned* h,
+                             LodePNGState* state,
+                             const unsigned char* in, size_t insize)
+{
+  unsigned char* image;
+  return decodeImage(&image, out, outsize, w, h, state, in, insize);
+}
+
+/*
+Decoding of a region of the image, optionally downscaled. The rows of the image, or of
+the passes of an interlaced image, are unfiltered one by one while they're inflated, and
+only the pixels inside the region are converted, so the full image is never in memory.
+*/
+
+/*input bytes per inflate step, small enough to keep the inflated data of a step small*/
+#define REGION_STEP 16384u
+/*the most the image can be downscaled, with larger blocks the 32-bit sums could overflow*/
+#define REGION_MAX_DOWNSCALE 12u
+
+typedef struct RegionDecode
+{
+  unsigned x, y, w, h; /*the region, in pixels of the image*/
+  unsigned shift; /*blocks of 1 << shift by 1 << shift pixels are averaged to one*/
+  unsigned outw, outh; /*size of the result*/
+  const LodePNGColorMode* mode_png;
+  LodePNGColorMode* mode_raw;
+  unsigned flip, bgr;
+  unsigned char* out;
+  unsigned char* bits; /*the pixels of a row inside the region, moved to a byte boundary*/
+  unsigned char* converted; /*the pixels of a row inside the region in info_raw*/
+  /*
+  the sums of the channels of the blocks of the current output row. The rows of a block of
+  an interlaced image come in different passes, then there are sums for every output row.
+  */
+  unsigned* sums;
+  unsigned interlaced; /*then the rows don't come in order, and sums has all output rows*/
+} RegionDecode;
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*sets output row oy, counted from the top of the region, to the averages of the sums of its blocks*/
+static void regionAverage(RegionDecode* rd, unsigned oy, unsigned* sums)
+{
+  unsigned channels = lodepng_get_channels(rd->mode_raw);
+  unsigned size = 1u << rd->shift;
+  unsigned char* row = &rd->out[(size_t)(rd->flip ? rd->outh - 1 - oy : oy) * rd->outw * channels];
+  unsigned blockrows = rd->h - (oy << rd->shift) < size ? rd->h - (oy << rd->shift) : size;
+  unsigned x, c;
+  for(x = 0; x != rd->outw; ++x)
+  {
+    unsigned blockcols = rd->w - (x << rd->shift) < size ? rd->w - (x << rd->shift) : size;
+    unsigned count = blockrows * blockcols;
+    for(c = 0; c != channels; ++c)
+    {
+      row[x * channels + c] = (unsigned char)((sums[x * channels + c] + count / 2) / count);
+      sums[x * channels + c] = 0;
+    }
+  }
+  if(rd->bgr) swapRedBlue(row, rd->outw, channels);
+}
+
+/*
+takes the n pixels at x0, x0 + dx, x0 + 2 * dx, ... of row y of the image, which start at bit
+0 of pixels, in the color type of the PNG. dx is more than 1 for the passes of an interlaced image.
+*/
+static unsigned regionRow(RegionDecode* rd, const unsigned char* pixels, unsigned y,
+                          unsigned x0, unsigned dx, unsigned n)
+{
+  unsigned bpp = lodepng_get_bpp(rd->mode_png);
+  unsigned channels = lodepng_get_channels(rd->mode_raw);
+  unsigned pixelbytes = lodepng_get_bpp(rd->mode_raw) / 8;
+  unsigned first, end, count, oy, i, c;
+  const unsigned char* src;
+
+  if(y < rd->y || y - rd->y >= rd->h) return 0;
+  /*the pixels from first to end are inside the region*/
+  first = x0 >= rd->x ? 0 : (rd->x - x0 + dx - 1) / dx;
+  end = x0 >= rd->x + rd->w ? 0 : (rd->x + rd->w - x0 + dx - 1) / dx;
+  if(end > n) end = n;
+  if(first >= end) return 0;
+  count = end - first;
+  x0 = x0 + first * dx - rd->x; /*from here on in the region*/
+  if(((size_t)first * bpp) % 8 == 0) src = &pixels[(size_t)first * bpp / 8];
+  else
+  {
+    size_t bitpos = (size_t)first * bpp, obp = 0, bitend = bitpos + (size_t)count * bpp;
+    while(bitpos != bitend) setBitOfReversedStream(&obp, rd->bits, readBitFromReversedStream(&bitpos, pixels));
+    src = rd->bits;
+  }
+  oy = (y - rd->y) >> rd->shift;
+
+  if(rd->shift == 0)
+  {
+    unsigned char* dst = &rd->out[((size_t)(rd->flip ? rd->outh - 1 - oy : oy) * rd->outw + x0) * pixelbytes];
+    if(dx == 1)
+    {
+      CERROR_TRY_RETURN(lodepng_convert(dst, src, rd->mode_raw, rd->mode_png, count, 1));
+      if(rd->bgr) swapRedBlue(dst, count, pixelbytes);
+      return 0;
+    }
+    CERROR_TRY_RETURN(lodepng_convert(rd->converted, src, rd->mode_raw, rd->mode_png, count, 1));
+    if(rd->bgr) swapRedBlue(rd->converted, count, pixelbytes);
+    for(i = 0; i != count; ++i)
+    {
+      memcpy(&dst[(size_t)i * dx * pixelbytes], &rd->converted[(size_t)i * pixelbytes], pixelbytes);
+    }
+    return 0;
+  }
+
+  CERROR_TRY_RETURN(lodepng_convert(rd->converted, src, rd->mode_raw, rd->mode_png, count, 1));
+  {
+    unsigned* sums = &rd->sums[rd->interlaced ? (size_t)oy * rd->outw * channels : 0];
+    for(i = 0; i != count; ++i)
+    {
+      unsigned* sum = &sums[((x0 + i * dx) >> rd->shift) * channels];
+      for(c = 0; c != channels; ++c) sum[c] += rd->converted[i * channels + c];
+    }
+    /*rows in order: at the last row of a block, or of the region, the output row is done*/
+    if(!rd->interlaced && (((y - rd->y + 1) & ((1u << rd->shift) - 1)) == 0 || y - rd->y + 1 == rd->h))
+    {
+      regionAverage(rd, oy, sums);
+    }
+  }
+  return 0;
+}
+
+/*
+Inflates the IDAT data in steps and unfilters the rows of each step, keeping only the
+32K window of the inflated data. The rows of an interlaced image come pass by pass. It
+stops after the last row of the region, then the rest of the data is not checked, unless
+that is the last row of the data.
+*/
+static unsigned regionInflate(RegionDecode* rd, LodePNGState* state, const IdatSpans* idat,
+                              unsigned w, unsigned h)
+{
+  unsigned error = 0, adler = 1, cpu = 0;
+  unsigned bpp = lodepng_get_bpp(&state->info_png.color);
+  size_t bytewidth = (bpp + 7) / 8;
+  size_t linebytes = lodepng_get_raw_size(w, 1, &state->info_png.color); /*the longest row of any pass*/
+  size_t passlinebytes = 0, rowpos = 0, dropped = 0;
+  /*a non-interlaced image is one pass of all pixels*/
+  unsigned numpasses = state->info_png.interlace_method == 0 ? 1 : 7;
+  unsigned ix[7] = {0}, iy[7] = {0}, dx[7] = {1}, dy[7] = {1}, passw[7], passh[7];
+  unsigned pass, passy = 0, row = 0, rows = 0, needed = 0; /*row counts all rows of all passes*/
+  unsigned checkend; /*whether the data is inflated and checked to the end*/
+  LodePNGArena* arena = state->decoder.zlibsettings.arena;
+  Inflator inflator;
+  SpanFeed feed;
+  ucvector scanlines;
+  unsigned char* rowbuffer = (unsigned char*)arena_malloc(arena, 2 * linebytes);
+
+  if(!rowbuffer) return 83; /*alloc fail*/
+  if(numpasses == 1)
+  {
+    passw[0] = w;
+    passh[0] = h;
+  }
+  else
+  {
+    size_t filter_passstart[8], padded_passstart[8], passstart[8];
+    Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
+    for(pass = 0; pass != 7; ++pass)
+    {
+      ix[pass] = ADAM7_IX[pass];
+      iy[pass] = ADAM7_IY[pass];
+      dx[pass] = ADAM7_DX[pass];
+      dy[pass] = ADAM7_DY[pass];
+    }
+  }
+  /*the rows up to the last one of the region*/
+  for(pass = 0; pass != numpasses; ++pass)
+  {
+    if(passh[pass] != 0 && rd->y + rd->h > iy[pass])
+    {
+      unsigned last = (rd->y + rd->h - 1 - iy[pass]) / dy[pass];
+      if(last >= passh[pass]) last = passh[pass] - 1;
+      if(iy[pass] + last * dy[pass] >= rd->y) needed = rows + last + 1;
+    }
+    rows += passh[pass];
+  }
+  checkend = needed == rows;
+  for(pass = 0; pass != numpasses && passh[pass] == 0; ++pass) {}
+  if(pass != numpasses) passlinebytes = lodepng_get_raw_size(passw[pass], 1, &state->info_png.color);
+
+#ifdef LODEPNG_SIMD_X86
+  cpu = getCpuFeatures();
+#endif /*LODEPNG_SIMD_X86*/
+  Inflator_init(&inflator, arena);
+  inflator.maxpos = getIdatSize(w, h, &state->info_png);
+  SpanFeed_init(&feed, idat->spans, idat->numspans, 2, REGION_STEP, arena);
+  ucvector_init(&scanlines);
+  scanlines.arena = arena;
+
+  while(!error && !inflator.done && !feed.end && (checkend || row < needed))
+  {
+    error = SpanFeed_run(&feed, &inflator, &scanlines);
+
+    while(!error && row < rows && rowpos + passlinebytes + 1 <= scanlines.size)
+    {
+      const unsigned char* scanline = &scanlines.data[rowpos];
+      unsigned char* recon = &rowbuffer[(passy & 1) * linebytes];
+      const unsigned char* precon = passy == 0 ? 0 : &rowbuffer[((passy + 1) & 1) * linebytes];
+      error = unfilterScanline(recon, scanline + 1, precon, bytewidth, scanline[0], passlinebytes, cpu);
+      if(!error) error = regionRow(rd, recon, iy[pass] + passy * dy[pass], ix[pass], dx[pass], passw[pass]);
+      rowpos += passlinebytes + 1;
+      ++row;
+      if(++passy == passh[pass])
+      {
+        passy = 0;
+        for(++pass; pass < numpasses && passh[pass] == 0; ++pass) {}
+        if(pass != numpasses) passlinebytes = lodepng_get_raw_size(passw[pass], 1, &state->info_png.color);
+      }
+    }
+
+    if(!error && scanlines.size > 32768 + REGION_STEP)
+    {
+      /*keeps the window and the rows that aren't complete*/
+      size_t amount = scanlines.size - 32768 < rowpos ? scanlines.size - 32768 : rowpos;
+      if(checkend && !state->decoder.zlibsettings.ignore_adler32)
+      {
+        adler = update_adler32(adler, scanlines.data, (unsigned)amount);
+      }
+      Inflator_dropOutput(&inflator, &scanlines, amount);
+      rowpos -= amount;
+      dropped += amount;
+    }
+  }
+
+  if(!error && row < needed) error = 91; /*decompressed size doesn't match prediction*/
+  if(!error && checkend)
+  {
+    if(dropped + scanlines.size != getIdatSize(w, h, &state->info_png)) error = 91;
+    else if(!state->decoder.zlibsettings.ignore_adler32)
+    {
+      size_t p = (SpanFeed_pos(&feed, &inflator) + 7) / 8;
+      unsigned char bytes[4];
+      adler = update_adler32(adler, scanlines.data, (unsigned)scanlines.size);
+      if(p + 4 > idat->size) error = 53; /*error, size of zlib data too small*/
+      else
+      {
+        spansCopy(bytes, idat->spans, p, 4);
+        if(adler != lodepng_read32bitInt(bytes)) error = 58; /*adler checksum not correct*/
+      }
+    }
+  }
+  /*the blocks of an interlaced image are only complete now*/
+  if(!error && rd->interlaced && rd->shift)
+  {
+    unsigned oy;
+    for(oy = 0; oy != rd->outh; ++oy)
+    {
+      regionAverage(rd, oy, &rd->sums[(size_t)oy * rd->outw * lodepng_get_channels(rd->mode_raw)]);
+    }
+  }
+  SpanFeed_cleanup(&feed);
+  Inflator_cleanup(&inflator);
+  ucvector_cleanup(&scanlines);
+  arena_free(arena, rowbuffer);
+  return error;
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
+unsigned lodepng_decode_region(unsigned char** out, unsigned* w, unsigned* h,
+                               LodePNGState* state,
+                               const unsigned char* in, size_t insize,
+                               unsigned x, unsigned y, unsigned width, unsigned height,
+                               unsigned downscale)
+{
+  RegionDecode rd;
+  IdatSpans idat;
+  unsigned imagew = 0, imageh = 0, convert, interlaced;
+  LodePNGArena* arena = state->decoder.zlibsettings.arena;
+
+  *out = 0;
+  *w = *h = 0;
+  rd.outw = rd.outh = 0;
+  rd.bits = rd.converted = 0;
+  rd.sums = 0;
+  IdatSpans_init(&idat, arena);
+  decodeChunks(&imagew, &imageh, &idat, state, in, insize);
+  if(!state->error) state->error = prepareColorConvert(&convert, state);
+  if(!state->error)
+  {
+    if(width == 0 && x < imagew) width = imagew - x;
+    if(height == 0 && y < imageh) height = imageh - y;
+    if(x >= imagew || y >= imageh || width > imagew - x || height > imageh - y) state->error = 97;
+    else if(lodepng_get_bpp(&state->info_raw) % 8 != 0 || downscale > REGION_MAX_DOWNSCALE
+            || (downscale && (state->info_raw.bitdepth != 8 || state->info_raw.colortype == LCT_PALETTE)))
+    {
+      state->error = 98;
+    }
+#ifdef LODEPNG_COMPILE_ZLIB
+    else if(state->decoder.zlibsettings.custom_zlib || state->decoder.zlibsettings.custom_inflate)
+#else /*LODEPNG_COMPILE_ZLIB*/
+    else
+#endif /*LODEPNG_COMPILE_ZLIB*/
+    {
+      state->error = 101; /*the data must be inflated in steps, which only the built in inflate does*/
+    }
+  }
+  interlaced = state->info_png.interlace_method != 0;
+  if(!state->error)
+  {
+    rd.x = x;
+    rd.y = y;
+    rd.w = width;
+    rd.h = height;
+    rd.shift = downscale;
+    rd.outw = ((width - 1) >> downscale) + 1;
+    rd.outh = ((height - 1) >> downscale) + 1;
+    rd.mode_png = &state->info_png.color;
+    rd.mode_raw = &state->info_raw;
+    rd.flip = state->decoder.flip_vertical;
+    rd.bgr = state->decoder.bgr;
+    rd.interlaced = interlaced;
+    state->error = checkLayout(rd.outw, &state->info_raw, rd.flip, rd.bgr);
+  }
+  if(!state->error)
+  {
+    size_t sumsize = (size_t)rd.outw * (interlaced ? rd.outh : 1) * lodepng_get_channels(&state->info_raw) * sizeof(unsigned);
+    rd.out = (unsigned char*)lodepng_malloc(lodepng_get_raw_size(rd.outw, rd.outh, &state->info_raw));
+    rd.bits = (unsigned char*)arena_malloc(arena, lodepng_get_raw_size(width, 1, &state->info_png.color));
+    if(downscale || interlaced)
+    {
+      rd.converted = (unsigned char*)arena_malloc(arena, lodepng_get_raw_size(width, 1, &state->info_raw));
+    }
+    if(downscale)
+    {
+      rd.sums = (unsigned*)arena_malloc(arena, sumsize);
+      if(rd.sums) memset(rd.sums, 0, sumsize);
+    }
+    *out = rd.out;
+    if(!rd.out || !rd.bits || ((downscale || interlaced) && !rd.converted) || (downscale && !rd.sums))
+    {
+      state->error = 83; /*alloc fail*/
+    }
+  }
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(!state->error)
+  {
+    unsigned char bytes[2];
+    if(idat.size < 2) state->error = 53; /*error, size of zlib data too small*/
+    else
+    {
+      spansCopy(bytes, idat.spans, 0, 2);
+      state->error = zlib_checkHeader(bytes);
+    }
+    if(!state->error) state->error = regionInflate(&rd, state, &idat, imagew, imageh);
+  }
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  IdatSpans_cleanup(&idat);
+  arena_free(arena, rd.sums);
+  arena_free(arena, rd.converted);
+  arena_free(arena, rd.bits);
+  if(state->error)
+  {
+    lodepng_free(*out);
+    *out = 0;
+  }
+  else
+  {
+    *w = rd.outw;
+    *h = rd.outh;
+  }
+  return state->error;
+}
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*stages of a LodePNGDecoderStream*/
+#define STREAM_HEADER 0 /*waiting for the signature and IHDR chunk*/
+#define STREAM_CHUNK 1 /*at the start of a chunk*/
+#define STREAM_IDAT 2 /*inside the data or CRC of an IDAT chunk*/
+#define STREAM_END 3 /*the IEND chunk was read, the rest of the input is ignored*/
+
+struct LodePNGStreamInternal
+{
+  ucvector input; /*fed bytes that are not handled yet, such as an incomplete chunk*/
+  unsigned stage; /*one of the STREAM_ values*/
+  unsigned critical_pos; /*1 = after IHDR, 2 = after PLTE, 3 = after IDAT*/
+  unsigned idatleft; /*data bytes of the current IDAT chunk that didn't come yet*/
+  unsigned idatcrc; /*CRC of the current IDAT chunk so far*/
+  ucvector zdata; /*the zlib data from the IDAT chunks, without what the inflator doesn't need anymore*/
+  unsigned zheader; /*1 once the zlib header was checked and removed from zdata*/
+  Inflator inflator;
+  ucvector scanlines; /*the inflated data*/
+  size_t predict; /*size the inflated data must have*/
+  unsigned convert; /*1 if the rows must be converted to info_raw*/
+  unsigned cpu; /*CPU_ flags for unfilterScanline*/
+  unsigned y; /*the next row to give to the callback*/
+  ucvector rows; /*the previous and current unfiltered row, then a row converted to info_raw*/
+};
+
+/*removes the first amount bytes of the vector*/
+static void dropFront(ucvector* p, size_t amount)
+{
+  size_t i;
+  if(amount == 0) return;
+  for(i = amount; i < p->size; ++i) p->data[i - amount] = p->data[i];
+  p->size -= amount;
+}
+
+static unsigned appendBytes(ucvector* p, const unsigned char* data, size_t size)
+{
+  size_t i, oldsize = p->size;
+  if(!ucvector_resize(p, oldsize + size)) return 83; /*alloc fail*/
+  for(i = 0; i != size; ++i) p->data[oldsize + i] = data[i];
+  return 0;
+}
+
+void lodepng_decoder_stream_init(LodePNGDecoderStream* stream, LodePNGRowCallback row_callback, void* user)
+{
+  struct LodePNGStreamInternal* s;
+
+  lodepng_state_init(&stream->state);
+  stream->state.error = 0; /*it's the error of the stream, so far there is none*/
+  stream->row_callback = row_callback;
+  stream->user = user;
+  stream->w = stream->h = 0;
+
+  s = (struct LodePNGStreamInternal*)lodepng_malloc(sizeof(struct LodePNGStreamInternal));
+  stream->internal = s;
+  if(!s)
+  {
+    stream->state.error = 83; /*alloc fail, returned by the first feed*/
+    return;
+  }
+  ucvector_init(&s->input);
+  s->stage = STREAM_HEADER;
+  s->critical_pos = 1;
+  s->idatleft = 0;
+  s->idatcrc = 0;
+  ucvector_init(&s->zdata);
+  s->zheader = 0;
+  Inflator_init(&s->inflator, 0);
+  ucvector_init(&s->scanlines);
+  s->predict = 0;
+  s->convert = 0;
+  s->cpu = 0;
+  s->y = 0;
+  ucvector_init(&s->rows);
+}
+
+void lodepng_decoder_stream_cleanup(LodePNGDecoderStream* stream)
+{
+  struct LodePNGStreamInternal* s = stream->internal;
+  if(s)
+  {
+    ucvector_cleanup(&s->input);
+    ucvector_cleanup(&s->zdata);
+    Inflator_cleanup(&s->inflator);
+    ucvector_cleanup(&s->scanlines);
+    ucvector_cleanup(&s->rows);
+    lodepng_free(s);
+    stream->internal = 0;
+  }
+  lodepng_state_cleanup(&stream->state);
+}
+
+/*called at the first IDAT chunk, when the PLTE chunk that color conversion may need is known*/
+static unsigned streamStartImage(LodePNGDecoderStream* stream)
+{
+  LodePNGState* state = &stream->state;
+  struct LodePNGStreamInternal* s = stream->internal;
+  unsigned error = prepareColorConvert(&s->convert, state);
+  if(!error) error = checkLayout(stream->w, &state->info_raw, 0, state->decoder.bgr);
+  if(error) return error;
+
+  s->predict = getIdatSize(stream->w, stream->h, &state->info_png);
+  if(!ucvector_reserve(&s->scanlines, s->predict)) return 83; /*alloc fail*/
+  if(!ucvector_resize(&s->rows, 2 * lodepng_get_raw_size(stream->w, 1, &state->info_png.color)
+                                + lodepng_get_raw_size(stream->w, 1, &state->info_raw)))
+  {
+    return 83; /*alloc fail*/
+  }
+#ifdef LODEPNG_SIMD_X86
+  s->cpu = getCpuFeatures();
+#endif /*LODEPNG_SIMD_X86*/
+  return 0;
+}
+
+/*gives the rows of a non-interlaced image that are completely inflated to the callback*/
+static unsigned streamRows(LodePNGDecoderStream* stream)
+{
+  LodePNGState* state = &stream->state;
+  struct LodePNGStreamInternal* s = stream->internal;
+  unsigned bpp = lodepng_get_bpp(&state->info_png.color);
+  size_t bytewidth = (bpp + 7) / 8;
+  size_t linebytes = lodepng_get_raw_size(stream->w, 1, &state->info_png.color);
+
+  while(s->y < stream->h && (s->y + 1) * (linebytes + 1) <= s->scanlines.size)
+  {
+    /*the scanlines can't be unfiltered in place: the inflator still refers to the filtered bytes*/
+    const unsigned char* scanline = &s->scanlines.data[s->y * (linebytes + 1)];
+    unsigned char* recon = &s->rows.data[(s->y & 1) * linebytes];
+    const unsigned char* precon = s->y == 0 ? 0 : &s->rows.data[((s->y + 1) & 1) * linebytes];
+    unsigned char* row = recon;
+
+    CERROR_TRY_RETURN(unfilterScanline(recon, scanline + 1, precon, bytewidth, scanline[0], linebytes, s->cpu));
+    if(s->convert)
+    {
+      row = &s->rows.data[2 * linebytes];
+      CERROR_TRY_RETURN(lodepng_convert(row, recon, &state->info_raw, &state->info_png.color, stream->w, 1));
+    }
+    if(state->decoder.bgr)
+    {
+      /*recon is the previous row of the next one, so it's swapped in a copy*/
+      if(!s->convert)
+      {
+        row = &s->rows.data[2 * linebytes];
+        memcpy(row, recon, linebytes);
+      }
+      swapRedBlue(row, stream->w, lodepng_get_channels(&state->info_raw));
+    }
+    stream->row_callback(stream->user, row, s->y, stream->w, stream->h);
+    ++s->y;
+  }
+  return 0;
+}
+
+/*gives all rows of an interlaced image to the callback, once all of its data is inflated*/
+static unsigned streamInterlacedRows(LodePNGDecoderStream* stream)
+{
+  LodePNGState* state = &stream->state;
+  struct LodePNGStreamInternal* s = stream->internal;
+  unsigned error = 0;
+  unsigned bpp = lodepng_get_bpp(&state->info_raw);
+  size_t linebytes = lodepng_get_raw_size(stream->w, 1, &state->info_raw);
+  unsigned char* rowbuffer = &s->rows.data[s->rows.size - linebytes];
+  ucvector image, converted;
+  unsigned char* pixels;
+  unsigned y;
+
+  ucvector_init(&image);
+  ucvector_init(&converted);
+  if(!ucvector_resizev(&image, lodepng_get_raw_size(stream->w, stream->h, &state->info_png.color), 0))
+  {
+    error = 83; /*alloc fail*/
+  }
+  if(!error) error = postProcessScanlines(image.data, s->scanlines.data, stream->w, stream->h, &state->info_png, 0, 0);
+  pixels = image.data;
+  if(!error && s->convert)
+  {
+    if(!ucvector_resize(&converted, lodepng_get_raw_size(stream->w, stream->h, &state->info_raw))) error = 83;
+    if(!error) error = lodepng_convert(converted.data, image.data, &state->info_raw,
+                                       &state->info_png.color, stream->w, stream->h);
+    pixels = converted.data;
+  }
+  if(!error) layoutImage(pixels, stream->w, stream->h, &state->info_raw, 0, state->decoder.bgr);
+
+  for(y = 0; !error && y < stream->h; ++y)
+  {
+    if(bpp >= 8 || (stream->w * bpp) % 8 == 0)
+    {
+      stream->row_callback(stream->user, &pixels[y * linebytes], y, stream->w, stream->h);
+    }
+    else
+    {
+      /*the rows of the image are not at byte boundaries, give a copy of the row that starts at one*/
+      size_t ibp = (size_t)y * stream->w * bpp, obp = 0;
+      unsigned x;
+      for(x = 0; x < stream->w * bpp; ++x)
+      {
+        setBitOfReversedStream(&obp, rowbuffer, readBitFromReversedStream(&ibp, pixels));
+      }
+      stream->row_callback(stream->user, rowbuffer, y, stream->w, stream->h);
+    }
+  }
+
+  ucvector_cleanup(&image);
+  ucvector_cleanup(&converted);
+  return error;
+}
+
+/*inflates what it can of the zlib data and gives the rows that are complete, last is 1 at the IEND chunk*/
+static unsigned streamInflate(LodePNGDecoderStream* stream, unsigned last)
+{
+  struct LodePNGStreamInternal* s = stream->internal;
+  Inflator* inflator = &s->inflator;
+
+  if(!s->zheader)
+  {
+    if(s->zdata.size < 2) return last ? 53 : 0; /*error, size of zlib data too small*/
+    CERROR_TRY_RETURN(zlib_checkHeader(s->zdata.data));
+    dropFront(&s->zdata, 2);
+    s->zheader = 1;
+  }
+
+  if(!inflator->done)
+  {
+    CERROR_TRY_RETURN(inflateRun(inflator, &s->scanlines, s->zdata.data, s->zdata.size, last));
+    /*the bytes before the resume position aren't needed anymore*/
+    dropFront(&s->zdata, inflator->resume / 8);
+    inflator->resume %= 8;
+  }
+
+  if(stream->state.info_png.interlace_method == 0) return streamRows(stream);
+  return 0;
+}
+
+/*called at the IEND chunk: finishes the image data and checks it*/
+static unsigned streamEnd(LodePNGDecoderStream* stream)
+{
+  LodePNGState* state = &stream->state;
+  struct LodePNGStreamInternal* s = stream->internal;
+  size_t p;
+
+  if(s->critical_pos != 3) return 53; /*error: no IDAT chunks, so the zlib data is too small*/
+  CERROR_TRY_RETURN(streamInflate(stream, 1));
+
+  /*the adler32 checksum follows the deflate data, at a byte boundary*/
+  p = (s->inflator.resume + 7) / 8;
+  if(p + 4 > s->zdata.size) return 53; /*error, size of zlib data too small*/
+  if(!state->decoder.zlibsettings.ignore_adler32)
+  {
+    unsigned ADLER32 = lodepng_read32bitInt(&s->zdata.data[p]);
+    unsigned checksum = adler32(s->scanlines.data, (unsigned)s->scanlines.size);
+    if(checksum != ADLER32) return 58; /*error, adler checksum not correct, data must be corrupted*/
+  }
+  if(s->scanlines.size != s->predict) return 91; /*decompressed size doesn't match prediction*/
+
+  if(state->info_png.interlace_method != 0) return streamInterlacedRows(stream);
+  return 0;
+}
+
+unsigned lodepng_decoder_feed(LodePNGDecoderStream* stream, const unsigned char* in, size_t insize)
+{
+  LodePNGState* state = &stream->state;
+  struct LodePNGStreamInternal* s = stream->internal;
+  size_t pos = 0; /*handled bytes of s->input*/
+
+  if(state->error) return state->error;
+  if(s->stage == STREAM_END) return 0;
+  state->error = appendBytes(&s->input, in, insize);
+  if(state->error) return state->error;
+
+  while(!state->error && s->stage != STREAM_END)
+  {
+    const unsigned char* chunk = &s->input.data[pos];
+    size_t available = s->input.size - pos;
+
+    if(s->stage == STREAM_HEADER)
     {
-      state->error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
-      if(state->error) return state->error;
+      if(available < 33) break;
+      /*reads the header and resets other parameters in state->info_png*/
+      state->error = lodepng_inspect(&stream->w, &stream->h, state, chunk, available);
+      if(!state->error) state->error = checkImageSize(stream->w, stream->h);
+      pos += 33;
+      s->stage = STREAM_CHUNK;
     }
-  }
-  else
-  {
-    /*color conversion needed; sort of copy of the data*/
-    unsigned char* data = *out;
-    size_t outsize;
+    else if(s->stage == STREAM_CHUNK)
+    {
+      /*length of the data of the chunk, excluding the length bytes, chunk type and CRC bytes*/
+      unsigned chunkLength;
+      if(available < 8) break;
+      chunkLength = lodepng_chunk_length(chunk);
+      /*error: chunk length larger than the max PNG chunk size*/
+      if(chunkLength > 2147483647) CERROR_BREAK(state->error, 63);
 
-    /*TODO: check if this works according to the statement in the documentation: "The converter can convert
-    from greyscale input color type, to 8-bit greyscale or greyscale with alpha"*/
-    if(!(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
-       && !(state->info_raw.bitdepth == 8))
+      if(lodepng_chunk_type_equals(chunk, "IDAT"))
+      {
+        if(s->critical_pos != 3)
+        {
+          state->error = streamStartImage(stream);
+          s->critical_pos = 3;
+        }
+        s->idatcrc = update_crc32(0, &chunk[4], 4); /*the CRC includes the chunk type*/
+        s->idatleft = chunkLength;
+        pos += 8;
+        s->stage = STREAM_IDAT;
+      }
+      else
+      {
+        unsigned char iend = 0;
+        if(available < (size_t)chunkLength + 12) break;
+        state->error = readChunk(state, chunk, &s->critical_pos, &iend);
+        pos += (size_t)chunkLength + 12;
+        if(!state->error && iend)
+        {
+          state->error = streamEnd(stream);
+          s->stage = STREAM_END;
+        }
+      }
+    }
+    else if(s->idatleft != 0) /*STREAM_IDAT, data*/
     {
-      return 56; /*unsupported color mode conversion*/
+      size_t amount = available < s->idatleft ? available : s->idatleft;
+      if(amount == 0) break;
+      if(!state->decoder.ignore_crc) s->idatcrc = update_crc32(s->idatcrc, chunk, amount);
+      state->error = appendBytes(&s->zdata, chunk, amount);
+      if(!state->error) state->error = streamInflate(stream, 0);
+      pos += amount;
+      s->idatleft -= (unsigned)amount;
     }
-
-    outsize = lodepng_get_raw_size(*w, *h, &state->info_raw);
-    *out = (unsigned char*)lodepng_malloc(outsize);
-    if(!(*out))
+    else /*STREAM_IDAT, CRC*/
     {
-      state->error = 83; /*alloc fail*/
+      if(available < 4) break;
+      if(!state->decoder.ignore_crc && lodepng_read32bitInt(chunk) != s->idatcrc)
+      {
+        CERROR_BREAK(state->error, 57); /*invalid CRC*/
+      }
+      pos += 4;
+      s->stage = STREAM_CHUNK;
     }
-    else state->error = lodepng_convert(*out, data, &state->info_raw,
-                                        &state->info_png.color, *w, *h);
-    lodepng_free(data);
   }
+
+  if(s->stage == STREAM_END) ucvector_cleanup(&s->input);
+  else dropFront(&s->input, pos);
+  return state->error;
+}
+
+unsigned lodepng_decoder_finish(LodePNGDecoderStream* stream)
+{
+  LodePNGState* state = &stream->state;
+  struct LodePNGStreamInternal* s = stream->internal;
+
+  if(state->error) return state->error;
+  if(s->stage == STREAM_HEADER)
+  {
+    /*error: the data is empty, or smaller than the length of a PNG header*/
+    state->error = s->input.size == 0 ? 48 : 27;
+  }
+  /*error: the data ended before the IEND chunk, the last chunk is broken off*/
+  else if(s->stage != STREAM_END) state->error = 30;
   return state->error;
 }
+#endif /*LODEPNG_COMPILE_ZLIB*/
 
 unsigned lodepng_decode_memory(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in,
                                size_t insize, LodePNGColorType colortype, unsigned bitdepth)
@@ -4697,12 +8172,12 @@ unsigned lodepng_decode24(unsigned char** out, unsigned* w, unsigned* h, const u
 unsigned lodepng_decode_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename,
                              LodePNGColorType colortype, unsigned bitdepth)
 {
-  unsigned char* buffer;
+  const unsigned char* buffer;
   size_t buffersize;
   unsigned error;
-  error = lodepng_load_file(&buffer, &buffersize, filename);
+  error = lodepng_map_file(&buffer, &buffersize, filename);
   if(!error) error = lodepng_decode_memory(out, w, h, buffer, buffersize, colortype, bitdepth);
-  lodepng_free(buffer);
+  lodepng_unmap_file(buffer, buffersize);
   return error;
 }
 
@@ -4715,19 +8190,140 @@ unsigned lodepng_decode24_file(unsigned char** out, unsigned* w, unsigned* h, co
 {
   return lodepng_decode_file(out, w, h, filename, LCT_RGB, 8);
 }
+
+/*most threads lodepng_decode_batch starts*/
+#define BATCH_MAX_THREADS 64u
+
+typedef struct BatchDecode
+{
+#ifdef LODEPNG_PTHREADS
+  pthread_mutex_t mutex; /*guards next*/
+#endif /*LODEPNG_PTHREADS*/
+  LodePNGBatchImage* images;
+  size_t numimages;
+  size_t next; /*the next image that no thread took yet*/
+  const LodePNGState* state;
+  unsigned threads; /*threads of lodepng_decode for each image*/
+} BatchDecode;
+
+/*
+Decodes images of the batch until none are left. Every thread has its own state and
+arena, so the arena grows to the largest image it decodes and then costs no more
+allocations. Threads take the next image when they're done with one, so that a
+thread that got small images takes over more of them.
+*/
+static void decodeBatchImages(BatchDecode* b)
+{
+  LodePNGState state;
+  LodePNGArena arena;
+  unsigned copyerror;
+
+  lodepng_state_init(&state);
+  lodepng_state_copy(&state, b->state);
+  copyerror = state.error;
+  lodepng_arena_init(&arena);
+  state.decoder.zlibsettings.arena = &arena;
+  state.decoder.threads = b->threads;
+
+  for(;;)
+  {
+    LodePNGBatchImage* image;
+    const unsigned char* buffer;
+    size_t buffersize;
+
+#ifdef LODEPNG_PTHREADS
+    pthread_mutex_lock(&b->mutex);
+#endif /*LODEPNG_PTHREADS*/
+    image = b->next != b->numimages ? &b->images[b->next++] : 0;
+#ifdef LODEPNG_PTHREADS
+    pthread_mutex_unlock(&b->mutex);
+#endif /*LODEPNG_PTHREADS*/
+    if(!image) break;
+
+    image->out = 0;
+    image->w = image->h = 0;
+    image->error = copyerror;
+    if(!image->error) image->error = lodepng_map_file(&buffer, &buffersize, image->filename);
+    if(!image->error)
+    {
+      lodepng_arena_reset(&arena);
+      image->error = lodepng_decode(&image->out, &image->w, &image->h, &state, buffer, buffersize);
+      lodepng_unmap_file(buffer, buffersize);
+    }
+  }
+
+  lodepng_arena_cleanup(&arena);
+  lodepng_state_cleanup(&state);
+}
+
+#ifdef LODEPNG_PTHREADS
+static void* batchThreadMain(void* arg)
+{
+  decodeBatchImages((BatchDecode*)arg);
+  return 0;
+}
+#endif /*LODEPNG_PTHREADS*/
+
+unsigned lodepng_decode_batch(LodePNGBatchImage* images, size_t numimages,
+                              const LodePNGState* state, unsigned threads)
+{
+  BatchDecode b;
+  size_t i;
+#ifdef LODEPNG_PTHREADS
+  pthread_t pool[BATCH_MAX_THREADS];
+  unsigned started = 0;
+#endif /*LODEPNG_PTHREADS*/
+
+  if(threads == 0) threads = 1;
+  if(threads > BATCH_MAX_THREADS) threads = BATCH_MAX_THREADS;
+  b.images = images;
+  b.numimages = numimages;
+  b.next = 0;
+  b.state = state;
+  /*threads that have no image of their own help decoding the images*/
+  b.threads = numimages != 0 && numimages < threads ? (unsigned)(threads / numimages) : 1;
+
+#ifdef LODEPNG_PTHREADS
+  pthread_mutex_init(&b.mutex, 0);
+  for(; started + 1 < threads && started + 1 < numimages; ++started)
+  {
+    if(pthread_create(&pool[started], 0, batchThreadMain, &b)) break;
+  }
+  decodeBatchImages(&b);
+  for(i = 0; i != started; ++i) pthread_join(pool[i], 0);
+  pthread_mutex_destroy(&b.mutex);
+#else /*LODEPNG_PTHREADS*/
+  decodeBatchImages(&b);
+#endif /*LODEPNG_PTHREADS*/
+
+  for(i = 0; i != numimages; ++i)
+  {
+    if(images[i].error) return images[i].error;
+  }
+  return 0;
+}
 #endif /*LODEPNG_COMPILE_DISK*/
 
 void lodepng_decoder_settings_init(LodePNGDecoderSettings* settings)
 {
   settings->color_convert = 1;
+  settings->flip_vertical = 0;
+  settings->bgr = 0;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   settings->read_text_chunks = 1;
   settings->remember_unknown_chunks = 0;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
   settings->ignore_crc = 0;
+  settings->threads = 1;
   lodepng_decompress_settings_init(&settings->zlibsettings);
 }
 
+void lodepng_decoder_settings_trusted(LodePNGDecoderSettings* settings)
+{
+  settings->ignore_crc = 1;
+  settings->zlibsettings.ignore_adler32 = 1;
+}
+
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #if defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)
@@ -4874,14 +8470,22 @@ static unsigned addChunk_tRNS(ucvector* out, const LodePNGColorMode* info)
 }
 
 static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t datasize,
-                              LodePNGCompressSettings* zlibsettings)
+                              LodePNGCompressSettings* zlibsettings, unsigned threads)
 {
   ucvector zlibdata;
   unsigned error = 0;
 
   /*compress with the Zlib compressor*/
   ucvector_init(&zlibdata);
+#ifdef LODEPNG_THREADED_ENCODE
+  if(threads > 1 && !zlibsettings->custom_zlib && !zlibsettings->custom_deflate)
+  {
+    error = zlib_compressThreaded(&zlibdata.data, &zlibdata.size, data, datasize, zlibsettings, threads);
+  }
+  else
+#endif /*LODEPNG_THREADED_ENCODE*/
   error = zlib_compress(&zlibdata.data, &zlibdata.size, data, datasize, zlibsettings);
+  (void)threads;
   if(!error) error = addChunk(out, "IDAT", zlibdata.data, zlibdata.size);
   ucvector_cleanup(&zlibdata);
 
@@ -5046,10 +8650,98 @@ static unsigned addChunk_pHYs(ucvector* out, const LodePNGInfo* info)
 
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
-                           size_t length, size_t bytewidth, unsigned char filterType)
+#ifdef LODEPNG_SIMD_X86
+/*
+SIMD version of filterScanline for a scanline with a previous scanline, the same result as
+the plain C code. Unlike when unfiltering, every output byte only depends on the input, so
+it does 16 bytes per step for any bytewidth. It starts at byte bytewidth and returns the
+amount of bytes done, filterScanline does the rest.
+*/
+
+/*the Paeth predictor in 16-bit lanes, in the same way as UNFILTER_PAETH_SIMD*/
+#define FILTER_PAETH_EPI16(a, b, c, zero)\
+  (pa = _mm_sub_epi16(b, c),\
+   pb = _mm_sub_epi16(a, c),\
+   pc = _mm_add_epi16(pa, pb),\
+   pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa)),\
+   pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb)),\
+   pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc)),\
+   smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb)),\
+   choose_a = _mm_cmpeq_epi16(pa, smallest),\
+   choose_b = _mm_andnot_si128(choose_a, _mm_cmpeq_epi16(pb, smallest)),\
+   _mm_or_si128(_mm_or_si128(_mm_and_si128(choose_a, a), _mm_and_si128(choose_b, b)),\
+                _mm_andnot_si128(_mm_or_si128(choose_a, choose_b), c)))
+
+static size_t filterScanline_sse2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                  size_t length, size_t bytewidth, unsigned char filterType) LODEPNG_TARGET("sse2");
+static size_t filterScanline_sse2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                  size_t length, size_t bytewidth, unsigned char filterType)
 {
   size_t i;
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi8(1);
+  for(i = bytewidth; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+    __m128i a = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+    __m128i b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+    __m128i pred;
+    if(filterType == 1) pred = a;
+    else if(filterType == 2) pred = b;
+    else if(filterType == 3) pred = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), ones));
+    else
+    {
+      __m128i c = _mm_loadu_si128((const __m128i*)&prevline[i - bytewidth]);
+      __m128i pa, pb, pc, smallest, choose_a, choose_b, lo, hi;
+      lo = FILTER_PAETH_EPI16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero), zero);
+      hi = FILTER_PAETH_EPI16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero), zero);
+      pred = _mm_packus_epi16(lo, hi);
+    }
+    _mm_storeu_si128((__m128i*)&out[i], _mm_sub_epi8(x, pred));
+  }
+  return i;
+}
+
+#undef FILTER_PAETH_EPI16
+
+/*the sum of the bytes, or of their absolute values as signed bytes (with 255 - s for negative s) if difference*/
+static size_t sumScanline_sse2(const unsigned char* data, size_t length, unsigned difference, size_t* sum) LODEPNG_TARGET("sse2");
+static size_t sumScanline_sse2(const unsigned char* data, size_t length, unsigned difference, size_t* sum)
+{
+  size_t i = 0;
+  const __m128i zero = _mm_setzero_si128();
+  *sum = 0;
+  while(i + 16 <= length)
+  {
+    /*at most 65536 steps per part, so that the sum of a part fits in 32 bits*/
+    size_t end = length - i > 1048576 ? i + 1048576 : length;
+    __m128i acc = zero;
+    for(; i + 16 <= end; i += 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i*)&data[i]);
+      /*flipping all bits of the negative bytes gives 255 - s*/
+      if(difference) v = _mm_xor_si128(v, _mm_cmplt_epi8(v, zero));
+      acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+    }
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+    *sum += (unsigned)_mm_cvtsi128_si32(acc);
+  }
+  return i;
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+/*cpu are the CPU_ flags for the SIMD code*/
+static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                           size_t length, size_t bytewidth, unsigned char filterType, unsigned cpu)
+{
+  size_t i, start = bytewidth;
+#ifdef LODEPNG_SIMD_X86
+  if(prevline && filterType != 0 && (cpu & CPU_SSE2))
+  {
+    start = filterScanline_sse2(out, scanline, prevline, length, bytewidth, filterType);
+  }
+#endif /*LODEPNG_SIMD_X86*/
+  (void)cpu;
   switch(filterType)
   {
     case 0: /*None*/
@@ -5057,12 +8749,13 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       break;
     case 1: /*Sub*/
       for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
-      for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
+      for(i = start; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
       break;
     case 2: /*Up*/
       if(prevline)
       {
-        for(i = 0; i != length; ++i) out[i] = scanline[i] - prevline[i];
+        for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - prevline[i];
+        for(i = start; i < length; ++i) out[i] = scanline[i] - prevline[i];
       }
       else
       {
@@ -5073,7 +8766,7 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       if(prevline)
       {
         for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - prevline[i] / 2;
-        for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) / 2);
+        for(i = start; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) / 2);
       }
       else
       {
@@ -5086,7 +8779,7 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       {
         /*paethPredictor(0, prevline[i], 0) is always prevline[i]*/
         for(i = 0; i != bytewidth; ++i) out[i] = (scanline[i] - prevline[i]);
-        for(i = bytewidth; i < length; ++i)
+        for(i = start; i < length; ++i)
         {
           out[i] = (scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]));
         }
@@ -5102,6 +8795,55 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
   }
 }
 
+/*
+The sum for LFS_MINSUM. For differences, each byte should be treated as signed, values above
+127 are negative (converted to signed char). Filtertype 0 isn't a difference though, so use
+unsigned there. This means filtertype 0 is almost never chosen, but that is justified.
+*/
+static size_t sumScanline(const unsigned char* data, size_t length, unsigned difference, unsigned cpu)
+{
+  size_t i = 0, sum = 0;
+#ifdef LODEPNG_SIMD_X86
+  if(cpu & CPU_SSE2) i = sumScanline_sse2(data, length, difference, &sum);
+#endif /*LODEPNG_SIMD_X86*/
+  (void)cpu;
+  if(difference)
+  {
+    for(; i != length; ++i) sum += data[i] < 128 ? data[i] : (255U - data[i]);
+  }
+  else
+  {
+    for(; i != length; ++i) sum += data[i];
+  }
+  return sum;
+}
+
+/*
+Counts the bytes of data in count, which must be zero. Runs of the same value are common
+in filtered scanlines, so four histograms are counted in turn to not wait on the previous
+increment of the same counter.
+*/
+static void countScanline(unsigned count[256], const unsigned char* data, size_t length)
+{
+  unsigned counts[3][256];
+  size_t i, x;
+  if(length < 1024)
+  {
+    for(i = 0; i != length; ++i) ++count[data[i]];
+    return;
+  }
+  memset(counts, 0, sizeof(counts));
+  for(i = 0; i + 4 <= length; i += 4)
+  {
+    ++count[data[i]];
+    ++counts[0][data[i + 1]];
+    ++counts[1][data[i + 2]];
+    ++counts[2][data[i + 3]];
+  }
+  for(; i != length; ++i) ++count[data[i]];
+  for(x = 0; x != 256; ++x) count[x] += counts[0][x] + counts[1][x] + counts[2][x];
+}
+
 /* log2 approximation. A slight bit faster than std::log. */
 static float flog2(float f)
 {
@@ -5111,147 +8853,106 @@ static float flog2(float f)
   return result + 1.442695f * (f * f * f / 3 - 3 * f * f / 2 + 3 * f - 1.83333f);
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+/*
+Filters the scanlines y0 to y1 - 1 of in with the strategy. Each scanline's filter only
+depends on its own and the previous unfiltered scanline, so any range of scanlines can
+be filtered independently of the others.
+*/
+static unsigned filterRows(unsigned char* out, const unsigned char* in, size_t linebytes, size_t bytewidth,
+                           unsigned y0, unsigned y1, LodePNGFilterStrategy strategy,
+                           const LodePNGEncoderSettings* settings, unsigned cpu)
 {
-  /*
-  For PNG filter method 0
-  out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
-  the scanlines with 1 extra byte per scanline
-  */
-
-  unsigned bpp = lodepng_get_bpp(info);
-  /*the width of a scanline in bytes, not including the filter type*/
-  size_t linebytes = (w * bpp + 7) / 8;
-  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
-  size_t bytewidth = (bpp + 7) / 8;
-  const unsigned char* prevline = 0;
+  const unsigned char* prevline = y0 == 0 ? 0 : &in[(y0 - 1) * linebytes];
+  unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
+  unsigned char* attempts = 0;
   unsigned x, y;
-  unsigned error = 0;
-  LodePNGFilterStrategy strategy = settings->filter_strategy;
-
-  /*
-  There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
-   *  If the image type is Palette, or the bit depth is smaller than 8, then do not filter the image (i.e.
-      use fixed filtering, with the filter None).
-   * (The other case) If the image type is Grayscale or RGB (with or without Alpha), and the bit depth is
-     not smaller than 8, then use adaptive filtering heuristic as follows: independently for each row, apply
-     all five filters and select the filter that produces the smallest sum of absolute values per row.
-  This heuristic is used if filter strategy is LFS_MINSUM and filter_palette_zero is true.
-
-  If filter_palette_zero is true and filter_strategy is not LFS_MINSUM, the above heuristic is followed,
-  but for "the other case", whatever strategy filter_strategy is set to instead of the minimum sum
-  heuristic is used.
-  */
-  if(settings->filter_palette_zero &&
-     (info->colortype == LCT_PALETTE || info->bitdepth < 8)) strategy = LFS_ZERO;
+  unsigned char type, bestType = 0;
 
-  if(bpp == 0) return 31; /*error: invalid color type*/
+  if(strategy == LFS_MINSUM || strategy == LFS_ENTROPY || strategy == LFS_BRUTE_FORCE)
+  {
+    attempts = (unsigned char*)lodepng_malloc(linebytes * 5 + 1);
+    if(!attempts) return 83; /*alloc fail*/
+    for(type = 0; type != 5; ++type) attempt[type] = &attempts[linebytes * type];
+  }
 
   if(strategy == LFS_ZERO)
   {
-    for(y = 0; y != h; ++y)
+    for(y = y0; y != y1; ++y)
     {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
       out[outindex] = 0; /*filter type byte*/
-      filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, 0);
+      filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, 0, cpu);
       prevline = &in[inindex];
     }
   }
   else if(strategy == LFS_MINSUM)
   {
     /*adaptive filtering*/
-    size_t sum[5];
-    ucvector attempt[5]; /*five filtering attempts, one for each filter type*/
-    size_t smallest = 0;
-    unsigned char type, bestType = 0;
-
-    for(type = 0; type != 5; ++type)
-    {
-      ucvector_init(&attempt[type]);
-      if(!ucvector_resize(&attempt[type], linebytes)) return 83; /*alloc fail*/
-    }
+    size_t sum, smallest = 0;
 
-    if(!error)
+    for(y = y0; y != y1; ++y)
     {
-      for(y = 0; y != h; ++y)
+      /*try the 5 filter types*/
+      for(type = 0; type != 5; ++type)
       {
-        /*try the 5 filter types*/
-        for(type = 0; type != 5; ++type)
-        {
-          filterScanline(attempt[type].data, &in[y * linebytes], prevline, linebytes, bytewidth, type);
+        filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type, cpu);
 
-          /*calculate the sum of the result*/
-          sum[type] = 0;
-          if(type == 0)
-          {
-            for(x = 0; x != linebytes; ++x) sum[type] += (unsigned char)(attempt[type].data[x]);
-          }
-          else
-          {
-            for(x = 0; x != linebytes; ++x)
-            {
-              /*For differences, each byte should be treated as signed, values above 127 are negative
-              (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-              This means filtertype 0 is almost never chosen, but that is justified.*/
-              unsigned char s = attempt[type].data[x];
-              sum[type] += s < 128 ? s : (255U - s);
-            }
-          }
+        /*calculate the sum of the result*/
+        sum = sumScanline(attempt[type], linebytes, type != 0, cpu);
 
-          /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
-          if(type == 0 || sum[type] < smallest)
-          {
-            bestType = type;
-            smallest = sum[type];
-          }
+        /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
+        if(type == 0 || sum < smallest)
+        {
+          bestType = type;
+          smallest = sum;
         }
+      }
 
-        prevline = &in[y * linebytes];
+      prevline = &in[y * linebytes];
 
-        /*now fill the out values*/
-        out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType].data[x];
-      }
+      /*now fill the out values*/
+      out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
+      memcpy(&out[y * (linebytes + 1) + 1], attempt[bestType], linebytes);
     }
-
-    for(type = 0; type != 5; ++type) ucvector_cleanup(&attempt[type]);
   }
   else if(strategy == LFS_ENTROPY)
   {
-    float sum[5];
-    ucvector attempt[5]; /*five filtering attempts, one for each filter type*/
-    float smallest = 0;
-    unsigned type, bestType = 0;
+    float sum, smallest = 0;
     unsigned count[256];
-
-    for(type = 0; type != 5; ++type)
+    /*flog2(1 / p) * p of each count, which is the same for all scanlines, negative if not yet known*/
+    float* entropy = (float*)lodepng_malloc(sizeof(float) * (linebytes + 2));
+    if(!entropy)
     {
-      ucvector_init(&attempt[type]);
-      if(!ucvector_resize(&attempt[type], linebytes)) return 83; /*alloc fail*/
+      lodepng_free(attempts);
+      return 83; /*alloc fail*/
     }
+    for(x = 0; x != linebytes + 2; ++x) entropy[x] = -1;
 
-    for(y = 0; y != h; ++y)
+    for(y = y0; y != y1; ++y)
     {
       /*try the 5 filter types*/
       for(type = 0; type != 5; ++type)
       {
-        filterScanline(attempt[type].data, &in[y * linebytes], prevline, linebytes, bytewidth, type);
+        filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type, cpu);
         for(x = 0; x != 256; ++x) count[x] = 0;
-        for(x = 0; x != linebytes; ++x) ++count[attempt[type].data[x]];
+        countScanline(count, attempt[type], linebytes);
         ++count[type]; /*the filter type itself is part of the scanline*/
-        sum[type] = 0;
+        sum = 0;
         for(x = 0; x != 256; ++x)
         {
-          float p = count[x] / (float)(linebytes + 1);
-          sum[type] += count[x] == 0 ? 0 : flog2(1 / p) * p;
+          if(count[x] != 0 && entropy[count[x]] < 0)
+          {
+            float p = count[x] / (float)(linebytes + 1);
+            entropy[count[x]] = flog2(1 / p) * p;
+          }
+          sum += count[x] == 0 ? 0 : entropy[count[x]];
         }
         /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
-        if(type == 0 || sum[type] < smallest)
+        if(type == 0 || sum < smallest)
         {
           bestType = type;
-          smallest = sum[type];
+          smallest = sum;
         }
       }
 
@@ -5259,20 +8960,20 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
 
       /*now fill the out values*/
       out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-      for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType].data[x];
+      memcpy(&out[y * (linebytes + 1) + 1], attempt[bestType], linebytes);
     }
 
-    for(type = 0; type != 5; ++type) ucvector_cleanup(&attempt[type]);
+    lodepng_free(entropy);
   }
   else if(strategy == LFS_PREDEFINED)
   {
-    for(y = 0; y != h; ++y)
+    for(y = y0; y != y1; ++y)
     {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
-      unsigned char type = settings->predefined_filters[y];
+      type = settings->predefined_filters[y];
       out[outindex] = type; /*filter type byte*/
-      filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, type);
+      filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, type, cpu);
       prevline = &in[inindex];
     }
   }
@@ -5282,9 +8983,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     deflate the scanline after every filter attempt to see which one deflates best.
     This is very slow and gives only slightly smaller, sometimes even larger, result*/
     size_t size[5];
-    ucvector attempt[5]; /*five filtering attempts, one for each filter type*/
     size_t smallest = 0;
-    unsigned type = 0, bestType = 0;
     unsigned char* dummy;
     LodePNGCompressSettings zlibsettings = settings->zlibsettings;
     /*use fixed tree on the attempts so that the tree is not adapted to the filtertype on purpose,
@@ -5296,22 +8995,17 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     images only, so disable it*/
     zlibsettings.custom_zlib = 0;
     zlibsettings.custom_deflate = 0;
-    for(type = 0; type != 5; ++type)
-    {
-      ucvector_init(&attempt[type]);
-      ucvector_resize(&attempt[type], linebytes); /*todo: give error if resize failed*/
-    }
-    for(y = 0; y != h; ++y) /*try the 5 filter types*/
+    for(y = y0; y != y1; ++y) /*try the 5 filter types*/
     {
       for(type = 0; type != 5; ++type)
       {
-        unsigned testsize = attempt[type].size;
+        size_t testsize = linebytes;
         /*if(testsize > 8) testsize /= 8;*/ /*it already works good enough by testing a part of the row*/
 
-        filterScanline(attempt[type].data, &in[y * linebytes], prevline, linebytes, bytewidth, type);
+        filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type, cpu);
         size[type] = 0;
         dummy = 0;
-        zlib_compress(&dummy, &size[type], attempt[type].data, testsize, &zlibsettings);
+        zlib_compress(&dummy, &size[type], attempt[type], testsize, &zlibsettings);
         lodepng_free(dummy);
         /*check if this is smallest size (or if type == 0 it's the first case so always store the values)*/
         if(type == 0 || size[type] < smallest)
@@ -5322,13 +9016,152 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       }
       prevline = &in[y * linebytes];
       out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-      for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType].data[x];
+      memcpy(&out[y * (linebytes + 1) + 1], attempt[bestType], linebytes);
     }
-    for(type = 0; type != 5; ++type) ucvector_cleanup(&attempt[type]);
   }
-  else return 88; /* unknown filter strategy */
 
-  return error;
+  lodepng_free(attempts);
+  return 0;
+}
+
+#ifdef LODEPNG_PTHREADS
+/*
+Multithreaded filtering: the scanlines are split in bands that threads filter at the same
+time, with the same result since the filter of a scanline doesn't depend on the filters
+chosen for the others.
+*/
+
+/*minimum amount of bytes of a band of scanlines*/
+#define FILTER_BAND_SIZE 65536u
+/*maximum amount of threads used*/
+#define FILTER_MAX_THREADS 64u
+
+typedef struct ThreadedFilter
+{
+  pthread_mutex_t mutex;
+  unsigned char* out;
+  const unsigned char* in;
+  size_t linebytes, bytewidth;
+  unsigned h, bandrows, numbands;
+  unsigned nextband; /*the next band a thread can filter*/
+  LodePNGFilterStrategy strategy;
+  const LodePNGEncoderSettings* settings;
+  unsigned cpu;
+  unsigned error;
+} ThreadedFilter;
+
+static void* filterThreadMain(void* arg)
+{
+  ThreadedFilter* d = (ThreadedFilter*)arg;
+  for(;;)
+  {
+    unsigned band, y0, y1, error;
+    pthread_mutex_lock(&d->mutex);
+    band = d->error ? d->numbands : d->nextband++;
+    pthread_mutex_unlock(&d->mutex);
+    if(band >= d->numbands) break;
+    y0 = band * d->bandrows;
+    y1 = d->h - y0 < d->bandrows ? d->h : y0 + d->bandrows;
+    error = filterRows(d->out, d->in, d->linebytes, d->bytewidth, y0, y1, d->strategy, d->settings, d->cpu);
+    if(error)
+    {
+      pthread_mutex_lock(&d->mutex);
+      if(!d->error) d->error = error;
+      pthread_mutex_unlock(&d->mutex);
+    }
+  }
+  return 0;
+}
+
+/*filters with settings->threads threads, returns 1 if it did, 0 if the image is too small to be worth it*/
+static unsigned filterThreaded(unsigned* error, unsigned char* out, const unsigned char* in, unsigned h,
+                               size_t linebytes, size_t bytewidth, LodePNGFilterStrategy strategy,
+                               const LodePNGEncoderSettings* settings, unsigned cpu)
+{
+  ThreadedFilter d;
+  pthread_t threads[FILTER_MAX_THREADS];
+  unsigned numthreads = settings->threads < FILTER_MAX_THREADS ? settings->threads : FILTER_MAX_THREADS;
+  unsigned started = 0, i;
+
+  d.bandrows = (unsigned)(FILTER_BAND_SIZE / (linebytes + 1) + 1);
+  d.numbands = (h + d.bandrows - 1) / d.bandrows;
+  if(numthreads > d.numbands) numthreads = d.numbands;
+  if(numthreads <= 1) return 0;
+
+  d.out = out;
+  d.in = in;
+  d.linebytes = linebytes;
+  d.bytewidth = bytewidth;
+  d.h = h;
+  d.nextband = 0;
+  d.strategy = strategy;
+  d.settings = settings;
+  d.cpu = cpu;
+  d.error = 0;
+
+  pthread_mutex_init(&d.mutex, 0);
+  for(; started + 1 < numthreads; ++started)
+  {
+    if(pthread_create(&threads[started], 0, filterThreadMain, &d)) break;
+  }
+  filterThreadMain(&d);
+  for(i = 0; i != started; ++i) pthread_join(threads[i], 0);
+  pthread_mutex_destroy(&d.mutex);
+
+  *error = d.error;
+  return 1;
+}
+#endif /*LODEPNG_PTHREADS*/
+
+static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+{
+  /*
+  For PNG filter method 0
+  out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
+  the scanlines with 1 extra byte per scanline
+  */
+
+  unsigned bpp = lodepng_get_bpp(info);
+  /*the width of a scanline in bytes, not including the filter type*/
+  size_t linebytes = (w * bpp + 7) / 8;
+  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
+  size_t bytewidth = (bpp + 7) / 8;
+  unsigned cpu = 0;
+  LodePNGFilterStrategy strategy = settings->filter_strategy;
+
+  /*
+  There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
+   *  If the image type is Palette, or the bit depth is smaller than 8, then do not filter the image (i.e.
+      use fixed filtering, with the filter None).
+   * (The other case) If the image type is Grayscale or RGB (with or without Alpha), and the bit depth is
+     not smaller than 8, then use adaptive filtering heuristic as follows: independently for each row, apply
+     all five filters and select the filter that produces the smallest sum of absolute values per row.
+  This heuristic is used if filter strategy is LFS_MINSUM and filter_palette_zero is true.
+
+  If filter_palette_zero is true and filter_strategy is not LFS_MINSUM, the above heuristic is followed,
+  but for "the other case", whatever strategy filter_strategy is set to instead of the minimum sum
+  heuristic is used.
+  */
+  if(settings->filter_palette_zero &&
+     (info->colortype == LCT_PALETTE || info->bitdepth < 8)) strategy = LFS_ZERO;
+
+  if(bpp == 0) return 31; /*error: invalid color type*/
+  if(strategy > LFS_PREDEFINED) return 88; /* unknown filter strategy */
+
+#ifdef LODEPNG_SIMD_X86
+  cpu = getCpuFeatures();
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_PTHREADS
+  if(settings->threads > 1)
+  {
+    unsigned error = 0;
+    if(filterThreaded(&error, out, in, h, linebytes, bytewidth, strategy, settings, cpu)) return error;
+  }
+#endif /*LODEPNG_PTHREADS*/
+
+  return filterRows(out, in, linebytes, bytewidth, 0, h, strategy, settings, cpu);
 }
 
 static void addPaddingBits(unsigned char* out, const unsigned char* in,
@@ -5652,7 +9485,8 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
     }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     /*IDAT (multiple IDAT chunks must be consecutive)*/
-    state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
+    state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings,
+                                 state->encoder.threads);
     if(state->error) break;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     /*tIME*/
@@ -5792,6 +9626,7 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings)
   settings->auto_convert = 1;
   settings->force_palette = 0;
   settings->predefined_filters = 0;
+  settings->threads = 1;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   settings->add_id = 0;
   settings->text_compression = 1;
@@ -5903,6 +9738,14 @@ const char* lodepng_error_text(unsigned code)
     case 91: return "invalid decompressed idat size";
     case 92: return "too many pixels, not supported";
     case 93: return "zero width or height is invalid";
+    case 94: return "the output buffer is too small for the decoded image";
+    case 95: return "bgr needs the decoded color type to be 8-bit RGB or RGBA";
+    case 96: return "flip_vertical needs the rows of the decoded image to end at byte boundaries";
+    case 97: return "the region to decode is not inside the image";
+    case 98: return "region decoding needs whole bytes per pixel, and 8-bit channels other than palette to downscale";
+    case 99: return "the compression level must be from 0 to 9, or LODEPNG_LEVEL_SETTINGS";
+    case 100: return "the maximum Huffman code length is too small for the amount of symbols";
+    case 101: return "region decoding inflates the data in steps, which custom_zlib and custom_inflate can't do";
   }
   return "unknown error code";
 }
@@ -5946,13 +9789,13 @@ void save_file(const std::vector<unsigned char>& buffer, const std::string& file
 unsigned decompress(std::vector<unsigned char>& out, const unsigned char* in, size_t insize,
                     const LodePNGDecompressSettings& settings)
 {
-  unsigned char* buffer = 0;
-  size_t buffersize = 0;
-  unsigned error = zlib_decompress(&buffer, &buffersize, in, insize, &settings);
-  if(buffer)
+  ucvector buffer;
+  ucvector_init_buffer(&buffer, 0, 0);
+  unsigned error = zlib_decompress(&buffer, in, insize, &settings);
+  if(buffer.data)
   {
-    out.insert(out.end(), &buffer[0], &buffer[buffersize]);
-    lodepng_free(buffer);
+    out.insert(out.end(), &buffer.data[0], &buffer.data[buffer.size]);
+    lodepng_free(buffer.data);
   }
   return error;
 }
@@ -77,6 +77,19 @@ source files with custom allocators.*/
 #ifndef LODEPNG_NO_COMPILE_ALLOCATORS
 #define LODEPNG_COMPILE_ALLOCATORS
 #endif
+/*SIMD versions of the hot loops, picked at runtime based on what the CPU supports.
+Has effect on x86 with GCC, Clang or Visual Studio, and for the CRC on Linux on ARMv8
+when built with the CRC extension (e.g. -march=armv8-a+crc). The plain C code is used
+everywhere else and also gives the reference results.*/
+#ifndef LODEPNG_NO_COMPILE_SIMD
+#define LODEPNG_COMPILE_SIMD
+#endif
+/*threads for decoding and encoding (see threads in LodePNGDecoderSettings and
+LodePNGEncoderSettings), with POSIX threads. Elsewhere, or without this, everything
+happens on the calling thread.*/
+#ifndef LODEPNG_NO_COMPILE_THREADS
+#define LODEPNG_COMPILE_THREADS
+#endif
 /*compile the C++ version (you can disable the C++ wrapper here even when compiling for C++)*/
 #ifdef __cplusplus
 #ifndef LODEPNG_NO_COMPILE_CPP
@@ -248,7 +261,45 @@ unsigned encode(const std::string& filename,
 const char* lodepng_error_text(unsigned code);
 #endif /*LODEPNG_COMPILE_ERROR_TEXT*/
 
+/*
+Arena allocator: memory is taken from big blocks by moving a pointer, and all of it is
+given back at once with lodepng_arena_reset. When a LodePNGDecompressSettings has an
+arena, the decoder takes its temporary memory from it (the compressed and inflated
+data, Huffman trees and intermediate images), so decoding costs no lodepng_malloc
+calls except for the resulting image, once the arena is big enough. After a reset
+the arena keeps its memory as one block, so it can be reused for a batch of images.
+An arena must only be used by one thread at a time. The statistics tell how much an
+image needed, when the arena is reset before decoding it. The Huffman trees of all
+deflate blocks of an image share the same memory, so allocations doesn't grow with
+the amount of blocks, and blockallocations is 0 when the arena was big enough.
+*/
+typedef struct LodePNGArena
+{
+  /*statistics since the last reset*/
+  size_t allocations; /*amount of allocations and reallocations done from the arena*/
+  size_t bytes; /*total size of those allocations*/
+  size_t blockallocations; /*amount of blocks allocated with lodepng_malloc*/
+
+  /*internal, the blocks and the state of the last one*/
+  void* blocks;
+  size_t used; /*used bytes of the last block*/
+  size_t capacity; /*total size of the blocks*/
+  unsigned char* last; /*the last allocation, which can be resized in place*/
+} LodePNGArena;
+
+void lodepng_arena_init(LodePNGArena* arena);
+/*makes all memory of the arena free for new allocations, and clears the statistics*/
+void lodepng_arena_reset(LodePNGArena* arena);
+void lodepng_arena_cleanup(LodePNGArena* arena);
+
 #ifdef LODEPNG_COMPILE_DECODER
+/*a piece of memory that is part of a longer input, see lodepng_zlib_decompress_spans*/
+typedef struct LodePNGSpan
+{
+  const unsigned char* data;
+  size_t size;
+} LodePNGSpan;
+
 /*Settings for zlib decompression*/
 typedef struct LodePNGDecompressSettings LodePNGDecompressSettings;
 struct LodePNGDecompressSettings
@@ -267,6 +318,13 @@ struct LodePNGDecompressSettings
                              const LodePNGDecompressSettings*);
 
   const void* custom_context; /*optional custom settings for custom functions*/
+
+  /*
+  if not null, the temporary memory of decoding comes from this arena (default: null).
+  lodepng_inflate and lodepng_zlib_decompress then also allocate their output from it,
+  *out must be null or memory of the same arena.
+  */
+  LodePNGArena* arena;
 };
 
 extern const LodePNGDecompressSettings lodepng_default_decompress_settings;
@@ -288,6 +346,16 @@ struct LodePNGCompressSettings /*deflate = compress*/
   unsigned minmatch; /*mininum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  /*
+  Compression level like zlib's, from 0 to 9. 0 stores the data without compression. 1 to 3
+  find matches by looking at a single earlier position per byte, without lazy matching, which
+  is fast enough for encoding screenshots or captures at frame rate; higher ones compress a bit
+  more. 4 to 9 search the hash chains with more effort per level, 6 is the same as the default
+  settings above and 9 is windowsize 32768 and nicematch 258. A level replaces use_lz77,
+  windowsize, minmatch, nicematch and lazymatching, and level 0 also btype. Default:
+  LODEPNG_LEVEL_SETTINGS, which uses those settings as they are. Other values give error 99.
+  */
+  unsigned level;
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -303,6 +371,9 @@ struct LodePNGCompressSettings /*deflate = compress*/
   const void* custom_context; /*optional custom settings for custom functions*/
 };
 
+/*value of level to use the separate LZ77 settings instead of a compression level*/
+#define LODEPNG_LEVEL_SETTINGS 0xFFFFFFFFu
+
 extern const LodePNGCompressSettings lodepng_default_compress_settings;
 void lodepng_compress_settings_init(LodePNGCompressSettings* settings);
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -522,6 +593,25 @@ typedef struct LodePNGDecoderSettings
 
   unsigned color_convert; /*whether to convert the PNG to the color type you want. Default: yes*/
 
+  /*
+  Layout of the decoded image, so that it can be given to OpenGL as it is. Except for
+  interlaced images, both are done while unfiltering or converting the rows. Default: 0.
+  flip_vertical: the rows are stored from the bottom to the top of the image. The
+  rows of info_raw must end at byte boundaries, else the error is 96.
+  bgr: blue, green and red instead of red, green and blue, such as BGRA8 from 8-bit
+  RGBA. info_raw must be 8-bit RGB or RGBA, else the error is 95.
+  The progressive decoder does bgr, but ignores flip_vertical: its rows come with their y.
+  */
+  unsigned flip_vertical;
+  unsigned bgr;
+
+  /*
+  Amount of threads lodepng_decode may use, including the calling one. Default: 1. With more,
+  large non-interlaced images are unfiltered and converted while they're inflated, and
+  inflated in parallel if the encoder made full flush points. The result is the same.
+  */
+  unsigned threads;
+
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   unsigned read_text_chunks; /*if false but remember_unknown_chunks is true, they're stored in the unknown chunks*/
   /*store all bytes from unknown chunks in the LodePNGInfo (off by default, useful for a png editor)*/
@@ -530,6 +620,14 @@ typedef struct LodePNGDecoderSettings
 } LodePNGDecoderSettings;
 
 void lodepng_decoder_settings_init(LodePNGDecoderSettings* settings);
+
+/*
+Trusted-asset mode: sets ignore_crc and zlibsettings.ignore_adler32, so no checksums are
+computed at all. Only for images that can't be corrupted or tampered with on the way,
+such as ones shipped with the program itself. Everything else is still checked, a broken
+image can still give an error, but never reads or writes out of bounds.
+*/
+void lodepng_decoder_settings_trusted(LodePNGDecoderSettings* settings);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -603,6 +701,16 @@ typedef struct LodePNGEncoderSettings
   /*force creating a PLTE chunk if colortype is 2 or 6 (= a suggested palette).
   If colortype is 3, PLTE is _always_ created.*/
   unsigned force_palette;
+
+  /*
+  Amount of threads lodepng_encode may use to filter and compress the image data, including
+  the calling one. Default: 1. With more, bands of scanlines are filtered at the same time,
+  with the same result. Image data larger than 256 KiB is split in parts of that size that
+  are compressed at the same time. Matches still reach back into the previous part, so
+  the PNG is only slightly larger, and it's the same for any amount above 1. With custom_zlib
+  or custom_deflate, only the filtering uses the threads.
+  */
+  unsigned threads;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   /*add LodePNG identifier and version as a text chunk, for debugging*/
   unsigned add_id;
@@ -649,6 +757,64 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
                         LodePNGState* state,
                         const unsigned char* in, size_t insize);
 
+/*
+Same as lodepng_decode, but decodes into a buffer of outsize bytes given by the caller,
+such as mapped GPU memory, instead of allocating one. The image takes
+lodepng_get_raw_size(w, h, &state->info_raw) bytes, use lodepng_inspect to know it
+beforehand. If outsize is less, the error is 94 and out is left unchanged.
+*/
+unsigned lodepng_decode_into(unsigned char* out, size_t outsize, unsigned* w, unsigned* h,
+                             LodePNGState* state,
+                             const unsigned char* in, size_t insize);
+
+/*
+Same as lodepng_decode, but decodes only the region of width by height pixels at x, y,
+for example to make a preview or a small mip level of a large image without having
+all of it in memory. A width or height of 0 goes to the right or bottom of the image.
+If downscale is not 0, every block of 2^downscale by 2^downscale pixels of the region is
+averaged to one pixel, each channel on its own, and blocks at the right and bottom
+edges average only the pixels they have. *w and *h are the size of the result.
+Only the rows down to the end of the region are decoded and checked, so errors in the
+rest of the image data may not be found. An interlaced image is decoded pass by pass,
+down to the end of the region in the last pass, so most of its data is inflated, but
+still only the region is kept. The threads setting isn't used here.
+Errors: 97 if the region isn't inside the image, 98 if info_raw doesn't have whole
+bytes per pixel, or downscale is more than 12 or info_raw isn't 8 bits per channel
+without palette while downscaling, 101 if custom_zlib or custom_inflate is set, the
+data is inflated in steps, which only the built in inflate does.
+*/
+unsigned lodepng_decode_region(unsigned char** out, unsigned* w, unsigned* h,
+                               LodePNGState* state,
+                               const unsigned char* in, size_t insize,
+                               unsigned x, unsigned y, unsigned width, unsigned height,
+                               unsigned downscale);
+
+#ifdef LODEPNG_COMPILE_DISK
+/*an image of lodepng_decode_batch*/
+typedef struct LodePNGBatchImage
+{
+  const char* filename; /*in: the PNG file to decode*/
+  /*out: the image in the color type of info_raw, 0 if it failed. Must be freed with free().*/
+  unsigned char* out;
+  unsigned w, h; /*out: size of the image*/
+  unsigned error; /*out: LodePNG error code of this image, 0 if it was decoded*/
+} LodePNGBatchImage;
+
+/*
+Decodes the files of numimages images at the same time, on up to threads threads
+(including the calling one), with the settings and info_raw of state. The state isn't
+changed: each thread decodes with its own copy, and with its own arena, so the arena
+of the state isn't used. The results are in the images in the same order, and every
+image has its own error, a failed image doesn't stop the others. If there are fewer
+images than threads, the threads setting of each decode is threads / numimages, else
+it's 1. Without POSIX threads (see LODEPNG_COMPILE_THREADS), the calling thread decodes
+all images. Return value: 0 if all images were decoded, else the error of the first
+one that failed.
+*/
+unsigned lodepng_decode_batch(LodePNGBatchImage* images, size_t numimages,
+                              const LodePNGState* state, unsigned threads);
+#endif /*LODEPNG_COMPILE_DISK*/
+
 /*
 Read the PNG header, but not the actual data. This returns only the information
 that is in the header chunk of the PNG, such as width, height and color type. The
@@ -657,6 +823,46 @@ information is placed in the info_png field of the LodePNGState.
 unsigned lodepng_inspect(unsigned* w, unsigned* h,
                          LodePNGState* state,
                          const unsigned char* in, size_t insize);
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*
+Progressive decoding: the PNG is given in pieces of any size with lodepng_decoder_feed,
+for example while it's still being read from disk or network, and every row of pixels
+is given to a callback as soon as it's decoded, in the color type of state.info_raw.
+Rows come in order from top to bottom. For interlaced PNGs they only come once all
+image data is there, because only then all Adam7 passes of a row are known.
+The row buffer is only valid during the callback.
+*/
+typedef void (*LodePNGRowCallback)(void* user, const unsigned char* row,
+                                   unsigned y, unsigned w, unsigned h);
+
+struct LodePNGStreamInternal;
+
+typedef struct LodePNGDecoderStream
+{
+  /*settings and info_raw can be changed before the first feed, info_png is filled in while decoding.
+  The custom_zlib and custom_inflate settings are not used, it always uses the built in inflate.*/
+  LodePNGState state;
+  LodePNGRowCallback row_callback;
+  void* user; /*given to row_callback*/
+  unsigned w, h; /*size of the image, 0 until the header was fed*/
+  struct LodePNGStreamInternal* internal; /*the rest of the decoder, private*/
+} LodePNGDecoderStream;
+
+/*init and cleanup functions to use with this struct, init also inits the state*/
+void lodepng_decoder_stream_init(LodePNGDecoderStream* stream, LodePNGRowCallback row_callback, void* user);
+void lodepng_decoder_stream_cleanup(LodePNGDecoderStream* stream);
+
+/*
+Give the next insize bytes of the PNG file, calls row_callback for the rows they complete.
+The in buffer does not need to stay valid afterwards. Return value is error, once an
+error happened every next call returns it again.
+*/
+unsigned lodepng_decoder_feed(LodePNGDecoderStream* stream, const unsigned char* in, size_t insize);
+
+/*Call after the last feed, returns an error if the PNG is incomplete. Returns 0 if the IEND chunk was decoded.*/
+unsigned lodepng_decoder_finish(LodePNGDecoderStream* stream);
+#endif /*LODEPNG_COMPILE_ZLIB*/
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 
@@ -759,6 +965,16 @@ buffer and *outsize its size in bytes. out must be freed by user after usage.
 unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize,
                                  const unsigned char* in, size_t insize,
                                  const LodePNGDecompressSettings* settings);
+
+/*
+Same as lodepng_zlib_decompress, but the zlib data is the numspans spans one after the
+other, for example the IDAT chunks of a PNG in the file, and it's inflated from where
+they are instead of first being copied into one buffer. Only a custom_inflate gets the
+data copied into one buffer, if there is more than one span.
+*/
+unsigned lodepng_zlib_decompress_spans(unsigned char** out, size_t* outsize,
+                                       const LodePNGSpan* spans, size_t numspans,
+                                       const LodePNGDecompressSettings* settings);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -799,6 +1015,15 @@ return value: error code (0 means ok)
 */
 unsigned lodepng_load_file(unsigned char** out, size_t* outsize, const char* filename);
 
+/*
+Like lodepng_load_file, but maps the file into memory read-only where the system can
+(mmap on unix), so that nothing is copied or allocated. Elsewhere it's loaded with
+lodepng_load_file. Either way, free it with lodepng_unmap_file, with the same size.
+The file must not be changed while it is mapped.
+*/
+unsigned lodepng_map_file(const unsigned char** out, size_t* outsize, const char* filename);
+void lodepng_unmap_file(const unsigned char* buffer, size_t buffersize);
+
 /*
 Save a file from buffer to disk. Warning, if it exists, this function overwrites
 the file without warning!
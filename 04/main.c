@@ -1,9 +1,12 @@
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <SDL2/SDL.h>
 #include <GL/glew.h>
 #include "shader.h"
 #include "camera.h"
+#include "capture.h"
 #include "deps/lodepng.h"
 #include "deps/linmath.h"
 
@@ -14,15 +17,16 @@
 #define MOVE_SPEED 5.0f
 #define MOUSE_SENS 20.0f
 #define FOV_SENS 1.2f
+#define TEXTURE_READ_SIZE 16384
 
 static bool init_gl(void);
 static bool init(void);
+static bool parse_args(int argc, char **argv);
 static void handle_keys(SDL_Keycode key);
 static void render(void);
 static void load_cube(void);
 static void update(float delta);
 static GLuint load_texture(const char *filename, GLint min_mag_filt, GLint wrap_mode);
-static void flip_image_vertical(unsigned char *data, unsigned int width, unsigned int height);
 
 int direction = -1;
 bool running = true;
@@ -40,14 +44,25 @@ struct camera cam = {
 	.vert_angle = 0.0f,
 	.horiz_angle = 0.0f
 };
+/* The cam.generation last uploaded, cam_update_orientation in init() moves it on from 0. */
+unsigned long camera_generation;
 SDL_Window *window;
 SDL_GLContext gl_context;
+/* Set with --capture PREFIX, frames are saved as PREFIX000000.png and so on. */
+const char *capture_prefix;
+struct capture capture;
+/* Set with --frames N, quits after rendering N frames. */
+long frame_limit = -1;
 
 int main(int argc, char **argv)
 {
 	SDL_Event event;
 	int cur_time, prev_time = 0;
 	int x, y;
+	long frames = 0;
+
+	if (!parse_args(argc, argv))
+		return EXIT_FAILURE;
 
 	if (!init())
 		return EXIT_FAILURE;
@@ -70,8 +85,8 @@ int main(int argc, char **argv)
 				break;
 			case SDL_MOUSEWHEEL:
 				if (event.wheel.y != 0)
-					cam.fov = cam.fov +
-						(FOV_SENS * -event.wheel.y);
+					cam_set_fov(&cam, cam.fov +
+						(FOV_SENS * -event.wheel.y));
 				break;
 			}
 		}
@@ -79,8 +94,14 @@ int main(int argc, char **argv)
 		update((float)(cur_time - prev_time) / 1000);
 		render();
 		prev_time = cur_time;
+
+		if (frame_limit >= 0 && ++frames >= frame_limit)
+			running = false;
 	}
 
+	if (capture_prefix)
+		capture_destroy(&capture);
+
 	SDL_Quit();
 
 	return EXIT_SUCCESS;
@@ -114,8 +135,37 @@ static bool init(void)
 
 	tex = load_texture("wooden-crate.png", GL_LINEAR, GL_CLAMP_TO_EDGE);
 	load_cube();
+	cam_update_orientation(&cam);
+
+	if (capture_prefix &&
+	    !capture_init(&capture, SCREEN_WIDTH, SCREEN_HEIGHT, capture_prefix))
+		return false;
+
+	return true;
+}
+
+static bool parse_args(int argc, char **argv)
+{
+	int i;
+	char *end;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--capture") && i + 1 < argc) {
+			capture_prefix = argv[++i];
+		} else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+			frame_limit = strtol(argv[++i], &end, 10);
+			if (end == argv[i] || *end || frame_limit <= 0)
+				goto usage;
+		} else {
+			goto usage;
+		}
+	}
 
 	return true;
+
+usage:
+	printf("Usage: %s [--capture PREFIX] [--frames N]\n", argv[0]);
+	return false;
 }
 
 static bool init_gl(void)
@@ -164,7 +214,7 @@ static void handle_keys(SDL_Keycode key)
 
 static void render(void)
 {
-	mat4x4 model, trans, camera;
+	mat4x4 model, trans;
 
 	mat4x4_identity(trans);
 	mat4x4_rotate(model, trans, 0.0f, 1.0f, 0.0f, RADIANS(degrees_rotated));
@@ -174,8 +224,12 @@ static void render(void)
 
 	glUseProgram(prog);
 
-	cam_get_matrix(&cam, camera);
-	glUniformMatrix4fv(glGetUniformLocation(prog, "camera"), 1, GL_FALSE, (GLfloat *) camera);
+	/* Uniforms keep their values, so only upload the camera when it changed. */
+	if (cam.generation != camera_generation) {
+		glUniformMatrix4fv(glGetUniformLocation(prog, "camera"), 1, GL_FALSE,
+				(const GLfloat *) cam_view_proj(&cam));
+		camera_generation = cam.generation;
+	}
 	glUniformMatrix4fv(glGetUniformLocation(prog, "model"), 1, GL_FALSE, (GLfloat *) model);
 
 	glActiveTexture(GL_TEXTURE0);
@@ -189,6 +243,10 @@ static void render(void)
 	glBindTexture(GL_TEXTURE_2D, 0);
 	glUseProgram(0);
 
+	/* Read back before the swap, the back buffer is undefined after it. */
+	if (capture_prefix)
+		capture_frame(&capture);
+
 	SDL_GL_SwapWindow(window);
 }
 
@@ -269,17 +327,26 @@ static void load_cube(void)
 	glUseProgram(0);
 }
 
-static GLuint load_texture(const char *filename, GLint min_mag_filt, GLint wrap_mode)
+/* Rows arrive top to bottom, GL wants the bottom row first. */
+static void upload_texture_row(void *user, const unsigned char *row,
+		unsigned int y, unsigned int width, unsigned int height)
 {
-	unsigned char *data;
-	unsigned int width, height, err;
-	GLuint texture;
+	if (y == 0)
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB,
+				GL_UNSIGNED_BYTE, NULL);
 
-	err = lodepng_decode24_file(&data, &width, &height, filename);
-	if (err)
-		fprintf(stderr, "Failed to load %s: %s\n", filename, lodepng_error_text(err));
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, height - y - 1, width, 1, GL_RGB,
+			GL_UNSIGNED_BYTE, row);
+}
 
-	flip_image_vertical(data, width, height);
+static GLuint load_texture(const char *filename, GLint min_mag_filt, GLint wrap_mode)
+{
+	LodePNGDecoderStream stream;
+	unsigned char buf[TEXTURE_READ_SIZE];
+	unsigned int err = 0;
+	size_t len;
+	FILE *file;
+	GLuint texture;
 
 	glGenTextures(1, &texture);
 	glBindTexture(GL_TEXTURE_2D, texture);
@@ -288,31 +355,33 @@ static GLuint load_texture(const char *filename, GLint min_mag_filt, GLint wrap_
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap_mode);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap_mode);
 
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB,
-			GL_UNSIGNED_BYTE, data);
+	/* Decode while reading, each row goes to GL as soon as it's ready. */
+	lodepng_decoder_stream_init(&stream, upload_texture_row, NULL);
+	stream.state.info_raw.colortype = LCT_RGB;
+	stream.state.info_raw.bitdepth = 8;
+	/* The textures ship with the program, no need to verify checksums. */
+	lodepng_decoder_settings_trusted(&stream.state.decoder);
+
+	file = fopen(filename, "rb");
+	if (!file)
+		err = 78;
+
+	while (!err && (len = fread(buf, 1, sizeof(buf), file)) > 0)
+		err = lodepng_decoder_feed(&stream, buf, len);
+	if (!err)
+		err = lodepng_decoder_finish(&stream);
+	if (err)
+		fprintf(stderr, "Failed to load %s: %s\n", filename, lodepng_error_text(err));
+
+	if (file)
+		fclose(file);
+	lodepng_decoder_stream_cleanup(&stream);
 
 	glBindTexture(GL_TEXTURE_2D, 0);
 
 	return texture;
 }
 
-/*XXX: This has to be updated to accept an RGB image as we have 24 bits of data, not 32.*/
-static void flip_image_vertical(unsigned char *data, unsigned int width, unsigned int height)
-{
-	unsigned int size = width * height * 3;
-	unsigned int stride = sizeof(char) * width * 3;
-	unsigned int i, j;
-	unsigned char *new_data = malloc(sizeof(unsigned char) * size);
-
-	for (i = 0; i < height; i++) {
-		j = height - i - 1;
-		memcpy(new_data + j * stride, data + i * stride, stride);
-	}
-
-	memcpy(data, new_data, size);
-	free(new_data);
-}
-
 static void update(float delta)
 {
 	degrees_rotated += delta * DEGREES_PER_SECOND;